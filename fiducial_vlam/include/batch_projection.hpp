@@ -0,0 +1,85 @@
+#ifndef FIDUCIAL_VLAM_BATCH_PROJECTION_HPP
+#define FIDUCIAL_VLAM_BATCH_PROJECTION_HPP
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Batched projection
+// ==============================================================================
+
+  // Camera intrinsics with the same model and conventions as gtsam::Cal3DS2. A pinhole
+  // camera has no distortion.
+  struct BatchCalibration
+  {
+    double fx_{1.};
+    double fy_{1.};
+    double s_{0.};
+    double u0_{0.};
+    double v0_{0.};
+    double k1_{0.};
+    double k2_{0.};
+    double p1_{0.};
+    double p2_{0.};
+  };
+
+  // The pose of the camera in the world frame, the same as the gtsam::Pose3 of a PinholeCamera.
+  struct BatchPose
+  {
+    std::array<double, 9> r_{};   // Rotation, row major
+    std::array<double, 3> t_{};   // Translation
+  };
+
+  // World points in structure of arrays layout so the projection loop vectorizes.
+  class PointBatch
+  {
+  public:
+    std::vector<double> x_{};
+    std::vector<double> y_{};
+    std::vector<double> z_{};
+
+    auto size() const
+    { return x_.size(); }
+
+    void clear()
+    {
+      x_.clear();
+      y_.clear();
+      z_.clear();
+    }
+
+    void add(double x, double y, double z)
+    {
+      x_.emplace_back(x);
+      y_.emplace_back(y);
+      z_.emplace_back(z);
+    }
+  };
+
+  // The image points of a PointBatch. h_[k][i] is element k of the row major 2x6 Jacobian of
+  // point i with respect to the camera pose, in the gtsam Pose3 tangent order [rotation, translation].
+  class ProjectionBatch
+  {
+  public:
+    std::vector<double> u_{};
+    std::vector<double> v_{};
+    std::vector<double> depth_{};   // z of each point in the camera frame
+    std::array<std::vector<double>, 12> h_{};
+
+    // The number of points at or behind the image plane. Their projections are meaningless.
+    std::size_t behind_count_{0};
+  };
+
+  // Project all the points through one camera. Gives the same results as
+  // gtsam::PinholeCamera<gtsam::Cal3DS2>::project() for each point.
+  void project_batch(const BatchPose &pose,
+                     const BatchCalibration &cal,
+                     const PointBatch &points,
+                     ProjectionBatch &projections,
+                     bool with_jacobians);
+}
+
+#endif //FIDUCIAL_VLAM_BATCH_PROJECTION_HPP
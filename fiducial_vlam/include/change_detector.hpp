@@ -0,0 +1,50 @@
+#ifndef FIDUCIAL_VLAM_CHANGE_DETECTOR_HPP
+#define FIDUCIAL_VLAM_CHANGE_DETECTOR_HPP
+
+#include <memory>
+
+namespace cv_bridge
+{
+  class CvImage;
+}
+
+namespace fiducial_vlam
+{
+  class Observations;
+
+// ==============================================================================
+// ChangeDetector class
+// ==============================================================================
+
+  // Decide whether an image has changed enough since the last marker detection that the
+  // markers need to be detected again. The images are compared at low resolution in
+  // grayscale. If markers were detected, only the regions around the markers are compared.
+  class ChangeDetector
+  {
+    class Reference;
+
+    const int decimation_;
+    const double threshold_;
+    const int max_skipped_frames_;
+    std::unique_ptr<Reference> reference_;
+    int skipped_frames_{0};
+
+  public:
+    // decimation: the images are shrunk by this factor before they are compared.
+    // threshold: the mean absolute difference in gray levels that counts as a change.
+    // max_skipped_frames: force a detection after this many frames have been skipped.
+    ChangeDetector(int decimation, double threshold, int max_skipped_frames);
+
+    ~ChangeDetector();
+
+    // True if the markers in this image need to be detected. If false, the observations
+    // from the last detection can be used for this image.
+    bool needs_detection(const std::shared_ptr<cv_bridge::CvImage> &color);
+
+    // Called with the observations after the markers in the image passed to the
+    // last needs_detection() call were detected.
+    void detected(const Observations &observations);
+  };
+}
+
+#endif //FIDUCIAL_VLAM_CHANGE_DETECTOR_HPP
@@ -3,6 +3,9 @@
 
 
 #include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 #include "sensor_msgs/msg/camera_info.hpp"
 
@@ -21,6 +24,8 @@ namespace fiducial_vlam
 
   class Map;
 
+  class Marker;
+
 // ==============================================================================
 // CameraInfo class
 // ==============================================================================
@@ -29,7 +34,11 @@ namespace fiducial_vlam
   {
     class CvCameraInfo;
 
+    class SamCameraInfo;
+
+    std::size_t hash_{};
     std::shared_ptr<CvCameraInfo> cv_;
+    std::shared_ptr<SamCameraInfo> sam_;
 
   public:
     CameraInfo();
@@ -39,8 +48,74 @@ namespace fiducial_vlam
     auto &cv() const
     { return cv_; }
 
+    auto &sam() const
+    { return sam_; }
+
+    auto hash() const
+    { return hash_; }
+
+    // A hash of the calibration values in a camera_info message. Used to detect calibration changes.
+    static std::size_t hash(const sensor_msgs::msg::CameraInfo &camera_info_msg);
+
+    // True if the calibration values of two camera_info messages are the same.
+    static bool same_calibration(const sensor_msgs::msg::CameraInfo &a,
+                                 const sensor_msgs::msg::CameraInfo &b);
+
+    // True if this object was built from the calibration in this camera_info message.
+    bool is_built_from(const sensor_msgs::msg::CameraInfo &camera_info_msg) const;
+
     bool is_valid() const
     { return cv_ != nullptr; }
+
+    // True if the camera has no distortion. The cheaper pinhole model is used for these cameras.
+    bool is_pinhole() const;
+
+    // Convert the camera_info for a raw image into the camera_info for the rectified image.
+    static sensor_msgs::msg::CameraInfo to_rectified_msg(const sensor_msgs::msg::CameraInfo &camera_info_msg);
+  };
+
+// ==============================================================================
+// CornerRefinement enum
+// ==============================================================================
+
+  // How the corners of detected markers are refined. The slower methods are more accurate.
+  enum class CornerRefinement
+  {
+    none = 0,
+    subpix = 1,
+    apriltag = 2,
+  };
+
+// ==============================================================================
+// RobustSolveOptions struct
+// ==============================================================================
+
+  // Options for a camera pose solve that is robust to mis-detected or mis-mapped markers.
+  struct RobustSolveOptions
+  {
+    // False => the plain solve is used.
+    bool enabled_{false};
+    // A marker is rejected if the camera pose found from it alone is further than this from the consensus.
+    double max_position_deviation_{0.25};
+    double max_angle_deviation_{0.35};
+    // The Huber threshold for the resectioning factors, in units of corner_measurement_sigma.
+    double huber_k_{1.345};
+    // The maximum number of Levenberg-Marquardt iterations.
+    int max_iterations_{10};
+  };
+
+// ==============================================================================
+// SolveMetrics struct
+// ==============================================================================
+
+  // Counts kept by FiducialMath::solve_t_map_camera().
+  struct SolveMetrics
+  {
+    std::uint64_t solves_{0};
+    // The number of solves that reused the previous result because the observations hadn't changed.
+    std::uint64_t memo_hits_{0};
+    // The number of memo hits that were refreshed with one Gauss-Newton step.
+    std::uint64_t memo_refreshes_{0};
   };
 
 // ==============================================================================
@@ -53,11 +128,30 @@ namespace fiducial_vlam
 
     class SamFiducialMath;
 
+    class PoseMemo;
+
     const bool sam_not_cv_;
+    const double corner_measurement_sigma_;
     std::unique_ptr<CvFiducialMath> cv_;
     std::unique_ptr<SamFiducialMath> sam_;
+    RobustSolveOptions robust_options_{};
+    std::unique_ptr<PoseMemo> memo_;
+    double memo_corner_tolerance_{0.0};
+    bool memo_refresh_{false};
+    bool cv_solve_only_{false};
+    bool cv_map_fusion_{false};
+    SolveMetrics metrics_{};
 
   public:
+    // One camera of a multi-camera rig: the FiducialMath for its calibration, where it is
+    // mounted on the rig, and what it saw. The caller owns all of these.
+    struct RigView
+    {
+      FiducialMath *fm_;
+      const TransformWithCovariance *t_base_camera_;
+      const Observations *observations_;
+    };
+
     explicit FiducialMath(bool sam_not_cv,
                           double corner_measurement_sigma,
                           const CameraInfo &camera_info);
@@ -68,13 +162,77 @@ namespace fiducial_vlam
 
     ~FiducialMath();
 
+    // True if this object was built from these arguments and can be reused.
+    bool is_built_from(bool sam_not_cv,
+                       double corner_measurement_sigma,
+                       const sensor_msgs::msg::CameraInfo &camera_info_msg) const;
+
+    const CameraInfo &camera_info() const;
+
     TransformWithCovariance solve_t_camera_marker(const Observation &observation, double marker_length);
 
+    // The robust options can be changed without rebuilding this object.
+    void set_robust_solve_options(const RobustSolveOptions &robust_options)
+    { robust_options_ = robust_options; }
+
+    // corner_tolerance > 0 => if every corner is within corner_tolerance pixels of the last solve,
+    // return the last result. refresh => improve the last result with one Gauss-Newton step.
+    // The memo must be cleared when the map changes.
+    void set_pose_memo_options(double corner_tolerance, bool refresh);
+
+    void clear_pose_memo();
+
+    // Clear the memo if its solve saw this marker. For when only this marker changed in the map.
+    void clear_pose_memo_if_observed(int id);
+
+    // Start the next camera solve that has known markers from this pose, for instance the
+    // pose saved when the node last ran. The solve keeps the solution nearest the guess
+    // unless it fits the corners clearly worse than a solve from scratch.
+    void set_t_map_camera_guess(const TransformWithCovariance &t_map_camera);
+
+    auto &metrics() const
+    { return metrics_; }
+
+    // If the robust solve is enabled, the ids of the markers that were left out
+    // of the solve are returned in rejected_ids.
     TransformWithCovariance solve_t_map_camera(const Observations &observations,
-                                               Map &map);
+                                               Map &map,
+                                               std::vector<int> *rejected_ids = nullptr);
+
+    // Solve without the pose memo and without counting the solve in the metrics. For auxiliary
+    // solves, like the per-marker camera poses, that shouldn't disturb the memo of the main solve.
+    TransformWithCovariance solve_t_map_camera_no_memo(const Observations &observations,
+                                                       Map &map,
+                                                       std::vector<int> *rejected_ids = nullptr);
+
+    // true => use the OpenCV solver even if this object was built for the SAM solver.
+    // Changing the solver clears the pose memo.
+    void set_cv_solve_only(bool cv_solve_only);
+
+    // true => when built for the OpenCV solver, update the map with information weighted
+    // fusion instead of a simple average.
+    void set_cv_map_fusion(bool cv_map_fusion)
+    { cv_map_fusion_ = cv_map_fusion; }
+
+    // true => detect markers with the in-tree decoder instead of cv::aruco.
+    void set_in_tree_decoder(bool in_tree_decoder);
 
     Observations detect_markers(std::shared_ptr<cv_bridge::CvImage> &color,
-                                std::shared_ptr<cv_bridge::CvImage> &color_marked);
+                                std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                CornerRefinement corner_refinement = CornerRefinement::apriltag);
+
+    // Only look for markers in the region around the near_observations. If there are no
+    // near_observations, then look in the whole image.
+    Observations detect_markers_near(std::shared_ptr<cv_bridge::CvImage> &color,
+                                     std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                     CornerRefinement corner_refinement,
+                                     const Observations &near_observations);
+
+    // Follow the corners of the previous observations with optical flow. The previous
+    // image is the image passed to the last detect or track call.
+    Observations track_markers(std::shared_ptr<cv_bridge::CvImage> &color,
+                               std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                               const Observations &previous_observations);
 
     void annotate_image_with_marker_axis(std::shared_ptr<cv_bridge::CvImage> &color,
                                          const TransformWithCovariance &t_camera_marker);
@@ -82,6 +240,36 @@ namespace fiducial_vlam
     void update_map(const TransformWithCovariance &t_map_camera,
                     const Observations &observations,
                     Map &map);
+
+    // Update the map from the views of the cameras of a rig taken at the same time. With the
+    // SAM solver the rig pose is one variable, so markers seen by different cameras are related
+    // through it. Otherwise each view updates the map on its own.
+    static void update_map_rig(const TransformWithCovariance &t_map_base,
+                               const std::vector<RigView> &views,
+                               Map &map);
+
+    // Update the map with information weighted fusion of the marker measurements.
+    // This is cheap and can be used no matter which solver this object was built for.
+    void fuse_into_map(const TransformWithCovariance &t_map_camera,
+                       const Observations &observations,
+                       Map &map);
+
+    // Set the map frame corners of a marker from its pose and covariance.
+    void update_marker_corners(Marker &marker, double marker_length);
+
+    // The observations of the known markers expected from a camera pose. Markers that are not in
+    // view are left out.
+    Observations predict_observations(const TransformWithCovariance &t_map_camera,
+                                      Map &map,
+                                      int image_width,
+                                      int image_height);
+
+    // Leave out the observations of known markers that don't agree with any of the other known
+    // markers. Agreement is checked by reprojecting corners from single marker poses, so this is
+    // much cheaper than a solve. An empty result => no two known markers agree.
+    Observations gate_observations(const Observations &observations,
+                                   Map &map,
+                                   double max_error);
   };
 }
 
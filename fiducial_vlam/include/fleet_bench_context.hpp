@@ -0,0 +1,96 @@
+#ifndef FIDUCIAL_VLAM_FLEET_BENCH_CONTEXT_HPP
+#define FIDUCIAL_VLAM_FLEET_BENCH_CONTEXT_HPP
+
+#include "ros2_shared/context_macros.hpp"
+
+namespace rclcpp
+{
+  class Node;
+}
+
+namespace fiducial_vlam
+{
+#define FLEET_BENCH_ALL_PARAMS \
+  CXT_MACRO_MEMBER(       /* number of simulated drones, each with its own vloc_node  */ \
+  drones, \
+  int, 1) \
+  CXT_MACRO_MEMBER(       /* drone n publishes images in the namespace <drone_prefix><n>, n starting at 1  */ \
+  drone_prefix, \
+  std::string, "drone") \
+  CXT_MACRO_MEMBER(       /* Hz => rate at which each drone publishes images  */ \
+  frame_rate_hz, \
+  double, 30.) \
+  CXT_MACRO_MEMBER(       /* number of images in one loop of the flight path. They are rendered at startup  */ \
+  frame_count, \
+  int, 60) \
+  \
+  CXT_MACRO_MEMBER(       /* image width in pixels  */ \
+  image_width, \
+  int, 640) \
+  CXT_MACRO_MEMBER(       /* image height in pixels  */ \
+  image_height, \
+  int, 480) \
+  CXT_MACRO_MEMBER(       /* focal length of the simulated camera in pixels  */ \
+  camera_f, \
+  double, 500.) \
+  \
+  CXT_MACRO_MEMBER(       /* length of a side of a marker in meters  */ \
+  marker_length, \
+  double, 0.1778) \
+  CXT_MACRO_MEMBER(       /* markers in each row of the wall of markers  */ \
+  marker_columns, \
+  int, 4) \
+  CXT_MACRO_MEMBER(       /* rows in the wall of markers  */ \
+  marker_rows, \
+  int, 2) \
+  CXT_MACRO_MEMBER(       /* meters between the centers of neighboring markers  */ \
+  marker_spacing, \
+  double, 0.4) \
+  CXT_MACRO_MEMBER(       /* meters from the camera to the wall of markers  */ \
+  camera_distance, \
+  double, 1.5) \
+  CXT_MACRO_MEMBER(       /* meters the camera moves to each side along the flight path  */ \
+  camera_sweep, \
+  double, 0.2) \
+  \
+  CXT_MACRO_MEMBER(       /* id of the top left marker. The others follow it. vmap_node initializes the map with it  */ \
+  map_init_id, \
+  int, 1) \
+  \
+  CXT_MACRO_MEMBER(       /* topic for the camera pose of each drone, in the drone's namespace  */ \
+  camera_pose_sub_topic, \
+  std::string, "camera_pose") \
+  CXT_MACRO_MEMBER(       /* topic for the headers vmap_node publishes as it takes in observations  */ \
+  ingest_stamp_sub_topic, \
+  std::string, "/fiducial_ingest_stamps") \
+  \
+  CXT_MACRO_MEMBER(       /* seconds to run before measuring so the map and the pipelines settle  */ \
+  warmup_s, \
+  double, 5.) \
+  CXT_MACRO_MEMBER(       /* seconds to measure for  */ \
+  duration_s, \
+  double, 20.) \
+  CXT_MACRO_MEMBER(       /* csv file to append a row of results to  */ \
+  summary_filename, \
+  std::string, "fleet_bench_summary.csv") \
+  /* End of list */
+
+  struct FleetBenchContext
+  {
+    rclcpp::Node &node_;
+
+    explicit FleetBenchContext(rclcpp::Node &node) :
+      node_{node}
+    {}
+
+#undef CXT_MACRO_MEMBER
+#define CXT_MACRO_MEMBER(n, t, d) CXT_MACRO_DEFINE_MEMBER(n, t, d)
+    FLEET_BENCH_ALL_PARAMS
+
+    void load_parameters();
+
+    void validate_parameters();
+  };
+}
+
+#endif //FIDUCIAL_VLAM_FLEET_BENCH_CONTEXT_HPP
@@ -39,6 +39,10 @@ namespace fiducial_vlam
     // Count of updates
     int update_count_{};
 
+    // The corners of the marker in the map frame. Only for maps with MapStyles::corners.
+    // In the same order as the corners of an observation.
+    std::array<PointWithCovariance, 4> corners_f_map_{};
+
   public:
     Marker() = default;
 
@@ -66,6 +70,15 @@ namespace fiducial_vlam
 
     void set_t_map_marker(TransformWithCovariance t_map_marker)
     { t_map_marker_ = std::move(t_map_marker); }
+
+    auto has_corners() const
+    { return corners_f_map_[0].is_valid(); }
+
+    const auto &corners_f_map() const
+    { return corners_f_map_; }
+
+    void set_corners_f_map(const std::array<PointWithCovariance, 4> &corners_f_map)
+    { corners_f_map_ = corners_f_map; }
   };
 
 // ==============================================================================
@@ -112,6 +125,26 @@ namespace fiducial_vlam
     std::vector<TransformWithCovariance> find_t_map_markers(const Observations &observations);
   };
 
+// ==============================================================================
+// Binary snapshots
+// ==============================================================================
+
+  // Save and restore binary snapshots of a map or a pose. These load much faster
+  // than the YAML map files and are used to cache state across restarts. All
+  // functions return an empty string on success or an error message.
+  std::string to_binary_file(const Map &map, const std::string &filename);
+
+  std::string from_binary_file(const std::string &filename, std::unique_ptr<Map> &map);
+
+  std::string to_binary_file(const TransformWithCovariance &twc, const std::string &filename);
+
+  std::string from_binary_file(const std::string &filename, TransformWithCovariance &twc);
+
+  // The same map snapshot held in a memory buffer.
+  std::string to_binary_string(const Map &map);
+
+  std::string from_binary_string(const std::string &buffer, std::unique_ptr<Map> &map);
+
 // ==============================================================================
 // Utility
 // ==============================================================================
@@ -0,0 +1,83 @@
+#ifndef FIDUCIAL_VLAM_MAP_SHM_HPP
+#define FIDUCIAL_VLAM_MAP_SHM_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace fiducial_vlam
+{
+  class Map;
+
+// ==============================================================================
+// MapShmWriter class
+// ==============================================================================
+
+  // Publish map snapshots into a POSIX shared memory segment so vloc nodes on the
+  // same host can pick up a new map without a ROS message round trip. The segment
+  // holds a header with a sequence counter followed by a binary map snapshot. The
+  // counter is odd while a write is in progress (a seqlock) so readers never block
+  // the writer. Each writer creates a fresh segment, replacing any left by an earlier
+  // writer, and removes it when it exits. The header carries a session id and the
+  // writer's pid so readers can tell a new writer from an old one and ignore a
+  // segment whose writer has died.
+  class MapShmWriter
+  {
+    const std::string name_;
+    const std::uint64_t session_;
+    int fd_{-1};
+    void *addr_{nullptr};
+    std::size_t mapped_size_{0};
+
+    std::string map_segment(std::size_t data_capacity);
+
+  public:
+    // name: the shared memory object name, for example "/fiducial_map".
+    explicit MapShmWriter(std::string name);
+
+    ~MapShmWriter();
+
+    // Returns an empty string on success or an error message.
+    std::string write(const Map &map);
+  };
+
+// ==============================================================================
+// MapShmReader class
+// ==============================================================================
+
+  // Read map snapshots written by a MapShmWriter. The segment is mapped read-only.
+  // Checking for a new map costs one atomic load, so read() can be called on every frame.
+  // Every writer_check_period calls, read() also checks that the segment is still the
+  // current one and that its writer is alive.
+  class MapShmReader
+  {
+    const std::string name_;
+    int fd_{-1};
+    const void *addr_{nullptr};
+    std::size_t mapped_size_{0};
+    // The session and version of the last map read.
+    std::uint64_t session_{0};
+    std::uint64_t version_{0};
+    int reads_until_check_{0};
+    std::string buffer_{};
+
+    std::string map_segment();
+
+    void unmap_segment();
+
+    void close_segment();
+
+    std::string check_segment();
+
+  public:
+    explicit MapShmReader(std::string name);
+
+    ~MapShmReader();
+
+    // Returns an empty string on success or an error message. map is only
+    // set if a map version that has not been read before is available.
+    std::string read(std::unique_ptr<Map> &map);
+  };
+}
+
+#endif //FIDUCIAL_VLAM_MAP_SHM_HPP
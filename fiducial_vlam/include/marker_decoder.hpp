@@ -0,0 +1,32 @@
+#ifndef FIDUCIAL_VLAM_MARKER_DECODER_HPP
+#define FIDUCIAL_VLAM_MARKER_DECODER_HPP
+
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// MarkerDecoder class
+// ==============================================================================
+
+  // Find and decode DICT_6X6_250 markers. This takes the place of cv::aruco::detectMarkers.
+  // Instead of warping each candidate quad to a canonical image and thresholding the cells,
+  // the homography of each quad is used to sample a few pixels in the center of each of the
+  // 8x8 cells (the 6x6 bits plus the border), and each cell is read by a majority of its
+  // samples. The codeword is then looked up in a hash table that holds all four rotations of
+  // every marker plus every single bit error.
+  class MarkerDecoder
+  {
+  public:
+    // The corners and ids are returned in the same form as cv::aruco::detectMarkers. If
+    // refine_corners, then the corners are refined with cv::cornerSubPix.
+    void detect_markers(const cv::Mat &gray,
+                        std::vector<std::vector<cv::Point2f>> &corners,
+                        std::vector<int> &ids,
+                        bool refine_corners) const;
+  };
+}
+
+#endif //FIDUCIAL_VLAM_MARKER_DECODER_HPP
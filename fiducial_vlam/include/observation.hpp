@@ -102,7 +102,12 @@ namespace fiducial_vlam
 
     fiducial_vlam_msgs::msg::Observations to_msg(std_msgs::msg::Header::_stamp_type stamp,
                                                  const std_msgs::msg::Header::_frame_id_type &frame_id,
-                                                 const sensor_msgs::msg::CameraInfo &camera_info_msg);
+                                                 const sensor_msgs::msg::CameraInfo &camera_info_msg) const;
+
+    // Fill in a message that is reused from frame to frame. The camera_info field is not touched.
+    void to_msg(std_msgs::msg::Header::_stamp_type stamp,
+                const std_msgs::msg::Header::_frame_id_type &frame_id,
+                fiducial_vlam_msgs::msg::Observations &msg) const;
   };
 
 
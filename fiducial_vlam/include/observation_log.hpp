@@ -0,0 +1,38 @@
+#ifndef FIDUCIAL_VLAM_OBSERVATION_LOG_HPP
+#define FIDUCIAL_VLAM_OBSERVATION_LOG_HPP
+
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "fiducial_vlam_msgs/msg/observations.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Observation logs
+// ==============================================================================
+
+  // A recorded stream of Observations messages. vmap_node can record the observations it
+  // receives and later replay them as fast as they can be processed. Like the map snapshots,
+  // the log is written in the native byte order.
+  class ObservationLogWriter
+  {
+    std::ofstream out_;
+
+  public:
+    explicit ObservationLogWriter(const std::string &filename);
+
+    bool is_open() const
+    { return out_.is_open() && out_.good(); }
+
+    void write(const fiducial_vlam_msgs::msg::Observations &msg);
+  };
+
+  // Call the callback with each message in the log in the order they were recorded.
+  // Returns an empty string on success or an error message.
+  std::string from_observation_log(const std::string &filename,
+                                   const std::function<void(const fiducial_vlam_msgs::msg::Observations &)> &callback);
+}
+
+#endif //FIDUCIAL_VLAM_OBSERVATION_LOG_HPP
@@ -0,0 +1,63 @@
+#ifndef FIDUCIAL_VLAM_QUALITY_GOVERNOR_HPP
+#define FIDUCIAL_VLAM_QUALITY_GOVERNOR_HPP
+
+#include <chrono>
+#include <ctime>
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// QualityGovernor class
+// ==============================================================================
+
+  // Step between processing tiers to hold the per-frame latency and the CPU usage under
+  // their targets. Tier 0 is the best quality and the most expensive. Higher tiers are
+  // cheaper. The governor moves to a cheaper tier when the smoothed load is over a target
+  // and back to a better tier when the load is comfortably under the targets. A tier is
+  // held for a minimum number of frames after each change so the tiers don't oscillate.
+  class QualityGovernor
+  {
+    const int max_tier_;
+    const double target_latency_;
+    const double target_cpu_;
+    const double hysteresis_;
+    const int hold_frames_;
+
+    int tier_{0};
+    int frames_since_change_{0};
+    bool has_samples_{false};
+    double latency_{0.0};
+    double cpu_{0.0};
+
+    std::chrono::steady_clock::time_point frame_start_{};
+    std::chrono::steady_clock::time_point last_frame_end_{};
+    std::clock_t last_frame_end_cpu_{};
+
+  public:
+    // max_tier: the cheapest tier.
+    // target_latency: seconds of processing per frame, 0 => no latency target.
+    // target_cpu: the CPU usage of the process in cores, 0 => no CPU target.
+    // hysteresis: move to a better tier when the load is under (1 - hysteresis) of the target.
+    // hold_frames: the minimum number of frames between tier changes.
+    QualityGovernor(int max_tier, double target_latency, double target_cpu,
+                    double hysteresis, int hold_frames);
+
+    void start_frame();
+
+    // Returns true if the tier changed.
+    bool end_frame();
+
+    auto tier() const
+    { return tier_; }
+
+    // The smoothed latency in seconds.
+    auto latency() const
+    { return latency_; }
+
+    // The smoothed CPU usage in cores.
+    auto cpu() const
+    { return cpu_; }
+  };
+}
+
+#endif //FIDUCIAL_VLAM_QUALITY_GOVERNOR_HPP
@@ -0,0 +1,35 @@
+#ifndef FIDUCIAL_VLAM_RIG_HPP
+#define FIDUCIAL_VLAM_RIG_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "transform_with_covariance.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Rig class
+// ==============================================================================
+
+  // The cameras of a multi-camera rig and where each one is mounted on the rig. A camera is
+  // known by the frame_id in the header of its images and observations.
+  class Rig
+  {
+    std::map<std::string, TransformWithCovariance> t_base_cameras_{};
+
+  public:
+    // extrinsics holds "frame_id x y z roll pitch yaw" for each camera, separated by ';'.
+    // The pose is t_base_camera. Returns an empty string on success or an error message.
+    static std::string from_string(const std::string &extrinsics, std::unique_ptr<Rig> &rig);
+
+    auto size() const
+    { return t_base_cameras_.size(); }
+
+    // nullptr => the camera is not on the rig.
+    const TransformWithCovariance *find_t_base_camera(const std::string &frame_id) const;
+  };
+}
+
+#endif //FIDUCIAL_VLAM_RIG_HPP
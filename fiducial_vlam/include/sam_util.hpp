@@ -0,0 +1,57 @@
+#ifndef FIDUCIAL_VLAM_SAM_UTIL_HPP
+#define FIDUCIAL_VLAM_SAM_UTIL_HPP
+
+#include "transform_with_covariance.hpp"
+
+#include <gtsam/geometry/Pose3.h>
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Conversions between tf2 and gtsam
+// ==============================================================================
+
+  inline gtsam::Pose3 to_pose3(const tf2::Transform &transform)
+  {
+    auto q = transform.getRotation();
+    auto t = transform.getOrigin();
+    return gtsam::Pose3{gtsam::Rot3{q.w(), q.x(), q.y(), q.z()},
+                        gtsam::Vector3{t.x(), t.y(), t.z()}};
+  }
+
+  inline tf2::Transform to_tf2_transform(const gtsam::Pose3 &pose)
+  {
+    auto q = pose.rotation().toQuaternion();
+    auto &t = pose.translation();
+    return tf2::Transform{tf2::Quaternion{q.x(), q.y(), q.z(), q.w()},
+                          tf2::Vector3{t.x(), t.y(), t.z()}};
+  }
+
+  // TransformWithCovariance orders the covariance [x y z roll pitch yaw] and gtsam
+  // orders it [rotation translation].
+  inline gtsam::Matrix6 to_cov_sam(const TransformWithCovariance::cov_type &cov)
+  {
+    static const int ro[] = {3, 4, 5, 0, 1, 2};
+    gtsam::Matrix6 cov_sam;
+    for (int r = 0; r < 6; r += 1) {
+      for (int c = 0; c < 6; c += 1) {
+        cov_sam(ro[r], ro[c]) = cov[r * 6 + c];
+      }
+    }
+    return cov_sam;
+  }
+
+  inline TransformWithCovariance::cov_type to_cov_type(const gtsam::Matrix6 &cov_sam)
+  {
+    static const int ro[] = {3, 4, 5, 0, 1, 2};
+    TransformWithCovariance::cov_type cov;
+    for (int r = 0; r < 6; r += 1) {
+      for (int c = 0; c < 6; c += 1) {
+        cov[r * 6 + c] = cov_sam(ro[r], ro[c]);
+      }
+    }
+    return cov;
+  }
+}
+
+#endif //FIDUCIAL_VLAM_SAM_UTIL_HPP
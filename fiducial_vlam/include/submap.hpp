@@ -0,0 +1,78 @@
+#ifndef FIDUCIAL_VLAM_SUBMAP_HPP
+#define FIDUCIAL_VLAM_SUBMAP_HPP
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "sensor_msgs/msg/camera_info.hpp"
+
+namespace fiducial_vlam
+{
+  class FiducialMath;
+  class Map;
+  class Observations;
+  class TransformWithCovariance;
+
+// ==============================================================================
+// Submaps class
+// ==============================================================================
+
+  // Split a large map into spatially compact submaps. Each submap holds its markers in its
+  // own frame and is updated on its own, so observations in one part of the map only
+  // optimize that part. Submaps touched by the same observations are updated in parallel.
+  // The submap frames are aligned through the markers they share in a small top-level
+  // graph that only spans the submaps near the observations. The map passed to
+  // update_map() is kept in sync with the submaps.
+  class Submaps
+  {
+  public:
+    using FiducialMathFactory = std::function<std::unique_ptr<FiducialMath>(
+      const sensor_msgs::msg::CameraInfo &camera_info_msg)>;
+
+  private:
+    class Submap;
+
+    const double radius_;
+    FiducialMathFactory fm_factory_;
+    std::vector<std::unique_ptr<Submap>> submaps_{};
+
+    // The submap that each marker belongs to. A marker can also be a guest in other
+    // submaps. The guests are what link the submaps in the top-level graph.
+    std::map<int, std::size_t> home_{};
+
+    // The submaps that each submap shares markers with.
+    std::vector<std::set<std::size_t>> links_{};
+
+    std::size_t find_home(const TransformWithCovariance &t_map_marker, const Map &map);
+
+    void add_marker(std::size_t submap_idx, const TransformWithCovariance &t_map_marker,
+                    int id, bool is_fixed, int update_count);
+
+    std::vector<std::size_t> align_submaps(const std::vector<std::size_t> &touched);
+
+    void compose_into_map(std::size_t submap_idx, FiducialMath &fm, Map &map);
+
+  public:
+    // radius: a new marker farther than this from the origin of every submap starts a
+    // new submap. The markers already in map are split into submaps.
+    Submaps(double radius, FiducialMathFactory fm_factory, const Map &map);
+
+    ~Submaps();
+
+    // Update the submaps that hold the observed markers, realign the submaps if
+    // needed, and copy the changed markers into map.
+    void update_map(const TransformWithCovariance &t_map_camera,
+                    const Observations &observations,
+                    const sensor_msgs::msg::CameraInfo &camera_info_msg,
+                    FiducialMath &fm,
+                    Map &map);
+
+    auto size() const
+    { return submaps_.size(); }
+  };
+}
+
+#endif //FIDUCIAL_VLAM_SUBMAP_HPP
@@ -0,0 +1,107 @@
+#ifndef FIDUCIAL_VLAM_TASK_SCHEDULER_HPP
+#define FIDUCIAL_VLAM_TASK_SCHEDULER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fiducial_vlam
+{
+  // Higher priority tasks are always started before lower priority ones. A task that
+  // has started runs to completion.
+  enum class TaskPriority
+  {
+    pose = 0,       // On the path from an image or observation to a pose or map update
+    normal,         // Everything else that a caller is waiting for
+    background,     // Annotation, publishing, saving files
+  };
+
+// ==============================================================================
+// TaskScheduler class
+// ==============================================================================
+
+  // One pool of worker threads for all the parallel work in a process. Each worker has
+  // its own queues and steals from the others when it runs out. A thread that waits for
+  // a task runs other tasks of the same or higher priority while it waits, so tasks can
+  // submit tasks and wait for them without tying up the pool.
+  class TaskScheduler
+  {
+    using Task = std::function<void()>;
+    static constexpr std::size_t priority_count = 3;
+
+    struct Queue
+    {
+      std::mutex mutex_{};
+      std::array<std::deque<Task>, priority_count> tasks_{};
+    };
+
+    // queues_[0] takes the tasks submitted from threads outside the pool.
+    std::vector<std::unique_ptr<Queue>> queues_{};
+    std::vector<std::thread> threads_{};
+    std::atomic<std::size_t> pending_{0};
+    std::mutex sleep_mutex_{};
+    std::condition_variable sleep_cv_{};
+    bool stop_{false};
+
+    std::size_t this_queue() const;
+
+    void push(TaskPriority priority, Task task);
+
+    bool try_run(TaskPriority lowest_priority);
+
+    void run(std::size_t queue_idx);
+
+  public:
+    // thread_count: the number of worker threads. At least one is started.
+    explicit TaskScheduler(std::size_t thread_count);
+
+    ~TaskScheduler();
+
+    // The scheduler for this process. It is created on first use with one thread
+    // less than the number of cores unless configure() was called first.
+    static TaskScheduler &instance();
+
+    // Set the number of worker threads for the process. 0 => one less than the number of
+    // cores. Once the scheduler exists it is never replaced because callers hold references
+    // to it and tasks may be queued. Returns false if it already exists with a different
+    // number of threads.
+    static bool configure(std::size_t thread_count);
+
+    auto thread_count() const
+    { return threads_.size(); }
+
+    template<typename F>
+    auto submit(TaskPriority priority, F &&f) -> std::future<decltype(f())>
+    {
+      using R = decltype(f());
+      auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+      auto future = task->get_future();
+      push(priority, [task]() -> void
+      { (*task)(); });
+      return future;
+    }
+
+    // Wait for a task to finish and return its result. Tasks at priority or higher are
+    // run on this thread while waiting.
+    template<typename T>
+    T wait(std::future<T> &future, TaskPriority priority)
+    {
+      while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (!try_run(priority)) {
+          future.wait_for(std::chrono::microseconds(50));
+        }
+      }
+      return future.get();
+    }
+  };
+}
+
+#endif //FIDUCIAL_VLAM_TASK_SCHEDULER_HPP
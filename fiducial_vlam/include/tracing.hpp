@@ -0,0 +1,49 @@
+#ifndef FIDUCIAL_VLAM_TRACING_HPP
+#define FIDUCIAL_VLAM_TRACING_HPP
+
+#include <cstdint>
+
+#include "builtin_interfaces/msg/time.hpp"
+
+// Static tracepoints for perf, bpftrace, systemtap and LTTng userspace probes. If CMake found
+// sys/sdt.h, FIDUCIAL_VLAM_HAVE_SDT is defined and each tracepoint is a nop plus a note in the
+// executable. Nothing runs until a tracer attaches. Otherwise the tracepoints compile to nothing
+// and their arguments are not evaluated. The provider is "fiducial_vlam". For example:
+//
+//   bpftrace -e 'usdt:vloc_node:fiducial_vlam:solve_end { printf("%lld %d %d\n", arg0, arg1, arg2); }'
+//
+// The first argument of a per-frame tracepoint is the frame stamp in nanoseconds.
+#ifdef FIDUCIAL_VLAM_HAVE_SDT
+#include <sys/sdt.h>
+#define FVLAM_TRACE1(name, a1) DTRACE_PROBE1(fiducial_vlam, name, a1)
+#define FVLAM_TRACE2(name, a1, a2) DTRACE_PROBE2(fiducial_vlam, name, a1, a2)
+#define FVLAM_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(fiducial_vlam, name, a1, a2, a3)
+#else
+#define FVLAM_TRACE1(name, a1) do {} while (0)
+#define FVLAM_TRACE2(name, a1, a2) do {} while (0)
+#define FVLAM_TRACE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+namespace fiducial_vlam
+{
+  inline std::int64_t trace_stamp(const builtin_interfaces::msg::Time &stamp)
+  {
+    return static_cast<std::int64_t>(stamp.sec) * 1000000000 + stamp.nanosec;
+  }
+}
+
+// Tracepoints:
+//  vloc_node
+//   frame_ingest(stamp, width, height)
+//   detect_start(stamp)
+//   detect_end(stamp, marker_count)
+//   solve_start(stamp, marker_count)
+//   solve_end(stamp, marker_count, pose_valid)
+//  vmap_node
+//   map_update_start(stamp, marker_count)
+//   map_update_end(stamp, marker_count, map_marker_count)
+//   map_publish(map_marker_count)
+//   yaml_save_start(map_marker_count)
+//   yaml_save_end(map_marker_count, failed)
+
+#endif //FIDUCIAL_VLAM_TRACING_HPP
@@ -73,6 +73,33 @@ namespace fiducial_vlam
     void update_simple_average(const TransformWithCovariance &newVal, int previous_update_count);
   };
 
+  class PointWithCovariance
+  {
+  public:
+    using cov_type = std::array<double, 9>;
+
+  private:
+    bool is_valid_{false};
+    tf2::Vector3 point_{};
+    cov_type cov_{{0.}};
+
+  public:
+    PointWithCovariance() = default;
+
+    PointWithCovariance(const tf2::Vector3 &point, const cov_type &cov)
+      : is_valid_(true), point_(point), cov_(cov)
+    {}
+
+    auto is_valid() const
+    { return is_valid_; }
+
+    auto &point() const
+    { return point_; }
+
+    auto &cov() const
+    { return cov_; }
+  };
+
 }
 
 #endif //FIDUCIAL_VLAM_TRANSFORM_WITH_COVARIANCE_HPP
@@ -3,6 +3,7 @@
 
 #include <string>
 
+#include "fiducial_math.hpp"
 #include "ros2_shared/context_macros.hpp"
 #include "transform_with_covariance.hpp"
 
@@ -36,6 +37,12 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* topic for subscription to fiducial_vlam_msgs::msg::Map  */\
   fiducial_map_sub_topic,  \
   std::string, "/fiducial_map") \
+  CXT_MACRO_MEMBER(       /* non-zero => subscribe to the map transient_local, only matches transient_local publishers  */ \
+  fiducial_map_sub_transient_local,  \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* shared memory name to read the map from instead of the map topic, "" => use the topic  */ \
+  map_shm_name,  \
+  std::string, "") \
   CXT_MACRO_MEMBER(       /* topic for subscription to sensor_msgs::msg::CameraInfo associated with the image  */ \
   camera_info_sub_topic,  \
   std::string, "camera_info") \
@@ -53,31 +60,47 @@ namespace fiducial_vlam
   base_frame_id,  \
   std::string, "base_link") \
   \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the pose of the camera at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the pose of the camera every n-th frame, 0 => never  */ \
   publish_camera_pose,  \
   int, 1) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the pose of the base at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the pose of the base every n-th frame, 0 => never  */ \
   publish_base_pose,  \
   int, 1) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the tf of the camera at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the tf of the camera every n-th frame, 0 => never  */ \
   publish_tfs,  \
   int, 1) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the camera tf/pose as determined by each visible marker  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the camera tf as determined by each visible marker every n-th frame  */ \
   publish_tfs_per_marker,  \
   int, 0) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the odometry of the camera at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the odometry of the camera every n-th frame, 0 => never  */ \
   publish_camera_odom,  \
   int, 1) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the odometry of the base at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the odometry of the base every n-th frame, 0 => never  */ \
   publish_base_odom,  \
   int, 1) \
-  CXT_MACRO_MEMBER(       /* non-zero => publish the image_marked at every frame  */ \
+  CXT_MACRO_MEMBER(       /* n => publish the image_marked every n-th frame, 0 => never  */ \
   publish_image_marked,  \
   int, 1) \
+  CXT_MACRO_MEMBER(       /* n => publish the observations every n-th frame, 0 => never  */ \
+  publish_observations,  \
+  int, 1) \
+  CXT_MACRO_MEMBER(       /* non-zero => publish from a separate thread, don't hold up the next image  */ \
+  publish_in_background,  \
+  int, 1) \
   CXT_MACRO_MEMBER(       /* non-zero => debug mode, helpful for dealing with rviz when playing bags.  */ \
   stamp_msgs_with_current_time,  \
   int, 0) \
   \
+  CXT_MACRO_MEMBER(       /* name of the file to cache the last received map in, empty => no map cache  */ \
+  map_cache_full_filename, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* name of the file to cache the last camera pose in, empty => no pose cache  */ \
+  pose_cache_full_filename, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* seconds => minimum time between saves of the camera pose cache  */ \
+  pose_cache_save_period_s, \
+  double, 1.0) \
+  \
   CXT_MACRO_MEMBER(       /* camera=>baselink transform component */ \
   t_camera_base_x,  \
   double, 0.) \
@@ -100,18 +123,103 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* subscribe to camera_info message with best_effort (gazebo camera) not reliable (tello_ros) */ \
   sub_camera_info_best_effort_not_reliable, \
   int, 0) \
+  CXT_MACRO_MEMBER(       /* non-zero => images are rectified, use the P matrix and no distortion  */ \
+  images_are_rectified, \
+  int, 0) \
   CXT_MACRO_MEMBER(       /* use gtsam for fiducial calculations not opencv */ \
   sam_not_cv, \
   int, 1) \
   CXT_MACRO_MEMBER(       /* noise in detection of marker corners in the image (sigma in pixels) */ \
   corner_measurement_sigma, \
   double, 1.0) \
+  \
+  CXT_MACRO_MEMBER(       /* non-zero => reject inconsistent markers and use a robust, bounded solve */ \
+  robust_solve, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* meters => reject a marker if its camera position is this far from the consensus */ \
+  robust_max_position_deviation, \
+  double, 0.25) \
+  CXT_MACRO_MEMBER(       /* radians => reject a marker if its camera orientation is this far from the consensus */ \
+  robust_max_angle_deviation, \
+  double, 0.35) \
+  CXT_MACRO_MEMBER(       /* Huber threshold on the corner residuals (in units of corner_measurement_sigma) */ \
+  robust_huber_k, \
+  double, 1.345) \
+  CXT_MACRO_MEMBER(       /* maximum optimizer iterations for the robust solve */ \
+  robust_max_iterations, \
+  int, 10) \
+  CXT_MACRO_MEMBER(       /* seconds => log the markers the robust solve rejected at most this often */ \
+  robust_rejected_log_period_s, \
+  double, 5.0) \
+  \
+  CXT_MACRO_MEMBER(       /* pixels => reuse the last pose if all corners moved less than this, 0 => never reuse */ \
+  pose_memo_corner_tolerance, \
+  double, 0.0) \
+  CXT_MACRO_MEMBER(       /* non-zero => refresh a reused pose with one Gauss-Newton step (sam_not_cv only) */ \
+  pose_memo_refresh, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* non-zero => decode markers with the in-tree decoder, not cv::aruco */ \
+  in_tree_decoder, \
+  int, 0) \
+  \
+  CXT_MACRO_MEMBER(       /* non-zero => estimate markers that are not in the map and use them to localize */ \
+  provisional_mapping, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* number of sightings before a provisional marker is used to localize */ \
+  provisional_min_updates, \
+  int, 3) \
+  CXT_MACRO_MEMBER(       /* multiply the covariance of provisional markers by this when localizing */ \
+  provisional_cov_scale, \
+  double, 4.0) \
+  \
+  CXT_MACRO_MEMBER(       /* non-zero => skip marker detection when the image has not changed */ \
+  change_detection, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* factor to shrink images by before looking for changes */ \
+  change_detection_decimation, \
+  int, 8) \
+  CXT_MACRO_MEMBER(       /* mean gray level difference around the markers that counts as a change */ \
+  change_detection_threshold, \
+  double, 2.0) \
+  CXT_MACRO_MEMBER(       /* force a marker detection after this many frames without one */ \
+  change_detection_max_skipped_frames, \
+  int, 30) \
+  \
+  CXT_MACRO_MEMBER(       /* non-zero => step between processing tiers to hold the latency and cpu targets */ \
+  quality_governor, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* seconds => target processing time per image, 0 => no latency target */ \
+  governor_target_latency_s, \
+  double, 0.05) \
+  CXT_MACRO_MEMBER(       /* cores => target cpu usage of the node, 0 => no cpu target */ \
+  governor_target_cpu, \
+  double, 0.0) \
+  CXT_MACRO_MEMBER(       /* fraction => move to a better tier when the load is under (1 - hysteresis) of the target */ \
+  governor_hysteresis, \
+  double, 0.3) \
+  CXT_MACRO_MEMBER(       /* minimum number of images between tier changes */ \
+  governor_hold_frames, \
+  int, 30) \
+  CXT_MACRO_MEMBER(       /* cheapest tier: 1 subpix, 2 roi, 3 roi + cv solve, 4 tracking + cv solve */ \
+  governor_max_tier, \
+  int, 4) \
+  \
+  CXT_MACRO_MEMBER(       /* seconds => period for logging solver metrics, 0 => never */ \
+  metrics_log_period_s, \
+  double, 0.0) \
+  \
+  CXT_MACRO_MEMBER(       /* number of worker threads for parallel work, 0 => one less than the number of cores */ \
+  scheduler_threads, \
+  int, 0) \
   /* End of list */
 
 #define VLOC_ALL_OTHERS \
   CXT_MACRO_MEMBER(       /* transform from base frame to camera frame */ \
   t_camera_base,  \
   TransformWithCovariance,) \
+  CXT_MACRO_MEMBER(       /* options for the robust solve */ \
+  robust_solve_options,  \
+  RobustSolveOptions,) \
   /* End of list */
 
   struct VlocContext
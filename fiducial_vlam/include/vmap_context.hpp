@@ -15,6 +15,9 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* topic for publishing map of markers  */ \
   fiducial_map_pub_topic,  \
   std::string, "/fiducial_map") \
+  CXT_MACRO_MEMBER(       /* non-zero => publish the map transient_local so late subscribers get the last map at once  */ \
+  fiducial_map_pub_transient_local,  \
+  int, 0) \
   CXT_MACRO_MEMBER(       /* topic for publishing rviz visualizations of the fiducial markers  */ \
   fiducial_markers_pub_topic,  \
   std::string, "fiducial_markers") \
@@ -22,6 +25,9 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* topic for subscription to fiducial_vlam_msgs::msg::Observations  */ \
   fiducial_observations_sub_topic,  \
   std::string, "/fiducial_observations") \
+  CXT_MACRO_MEMBER(       /* topic for publishing the header of each observations message once it is in the map, "" => off  */ \
+  ingest_stamp_pub_topic,  \
+  std::string, "") \
   \
   CXT_MACRO_MEMBER(       /* frame_id for marker and tf messages - normally "map"  */ \
   map_frame_id,  \
@@ -49,6 +55,9 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* non-zero => create a new map  */\
   make_not_use_map,  \
   int, 1) \
+  CXT_MACRO_MEMBER(       /* non-zero => a new map also holds the marker corners and their covariances  */\
+  map_with_corners,  \
+  int, 0) \
   CXT_MACRO_MEMBER(       /* 0->marker id, pose from file, 1->marker id, pose as parameter, 2->camera pose as parameter  */ \
   map_init_style, \
   int, 1) \
@@ -82,6 +91,41 @@ namespace fiducial_vlam
   CXT_MACRO_MEMBER(       /* noise in detection of marker corners in the image (sigma in pixels) */ \
   corner_measurement_sigma, \
   double, 0.5) \
+  CXT_MACRO_MEMBER(       /* non-zero => with sam_not_cv off, fuse marker measurements weighted by their covariance */ \
+  cv_map_fusion, \
+  int, 0) \
+  CXT_MACRO_MEMBER(       /* shared memory name to also publish the map in for vloc nodes on this host, "" => off */ \
+  map_shm_name, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* meters => markers are grouped into submaps of about this radius, 0 => one flat map */ \
+  submap_radius, \
+  double, 0.) \
+  CXT_MACRO_MEMBER(       /* pixels => drop observations of known markers that don't reproject onto another known marker within this, 0 => off */ \
+  ingest_gate_max_error, \
+  double, 0.) \
+  CXT_MACRO_MEMBER(       /* rig cameras as "frame_id x y z roll pitch yaw; ..." (t_base_camera), observations within rig_stamp_tolerance => one rig pose, "" => off */ \
+  rig_extrinsics, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* seconds => rig observations with stamps this close to the first of a group share one rig pose */ \
+  rig_stamp_tolerance, \
+  double, 0.005) \
+  CXT_MACRO_MEMBER(       /* number of camera calibrations to keep solvers for, the least recently seen is dropped first */ \
+  max_camera_calibrations, \
+  int, 16) \
+  \
+  CXT_MACRO_MEMBER(       /* name of the file to record the received observations in, "" => no recording */ \
+  observation_log_record_filename, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* name of an observation log to replay as fast as possible and then exit, "" => normal operation */ \
+  observation_log_replay_filename, \
+  std::string, "") \
+  CXT_MACRO_MEMBER(       /* name of the csv file for the per-message timing of a replay, "" => no timing file */ \
+  replay_timing_filename, \
+  std::string, "vmap_replay_timing.csv") \
+  \
+  CXT_MACRO_MEMBER(       /* number of worker threads for parallel work, 0 => one less than the number of cores */ \
+  scheduler_threads, \
+  int, 0) \
   /* End of list */
 
 #define VMAP_ALL_OTHERS \
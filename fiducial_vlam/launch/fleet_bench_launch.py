@@ -0,0 +1,77 @@
+"""Benchmark N vloc_nodes and one vmap_node on this machine with synthetic images.
+
+fleet_bench_node publishes images of a wall of markers for each drone, measures the pose
+latency of every drone and how far vmap_node lags behind, then appends a row to the summary
+file and shuts the launch down. Use fleet_bench_sweep.py to run this for a range of N.
+
+Settings come from the environment so a sweep can run this file unchanged:
+  FLEET_BENCH_DRONES         number of drones (default 1)
+  FLEET_BENCH_RATE_HZ        images per second per drone (default 30)
+  FLEET_BENCH_WARMUP_S       seconds before measuring (default 5)
+  FLEET_BENCH_DURATION_S     seconds to measure (default 20)
+  FLEET_BENCH_SUMMARY        summary csv file (default fleet_bench_summary.csv)
+  FLEET_BENCH_VLOC_THREADS   worker threads per vloc_node, 0 => one less than the cores (default 1)
+"""
+
+import os
+
+from launch import LaunchDescription
+from launch.actions import Shutdown
+from launch_ros.actions import Node
+
+drones = int(os.environ.get('FLEET_BENCH_DRONES', '1'))
+frame_rate_hz = float(os.environ.get('FLEET_BENCH_RATE_HZ', '30'))
+warmup_s = float(os.environ.get('FLEET_BENCH_WARMUP_S', '5'))
+duration_s = float(os.environ.get('FLEET_BENCH_DURATION_S', '20'))
+summary_filename = os.environ.get('FLEET_BENCH_SUMMARY', 'fleet_bench_summary.csv')
+vloc_threads = int(os.environ.get('FLEET_BENCH_VLOC_THREADS', '1'))
+
+marker_length = 0.1778
+map_init_id = 1
+drone_prefix = 'drone'
+
+
+def generate_launch_description():
+    entities = [
+        # Build a map from the observations of all the drones, starting from the first marker
+        Node(package='fiducial_vlam', node_executable='vmap_node', output='screen',
+             node_name='vmap_node', parameters=[{
+                'publish_tfs': 0,
+                'publish_marker_visualizations': 0,
+                'marker_length': marker_length,
+                'make_not_use_map': 1,
+                'map_init_style': 1,
+                'map_init_id': map_init_id,
+                'marker_map_save_full_filename': 'fleet_bench_map.yaml',
+                'ingest_stamp_pub_topic': '/fiducial_ingest_stamps',
+            }]),
+
+        # Publish the images and measure. Everything stops when it is done.
+        Node(package='fiducial_vlam', node_executable='fleet_bench_node', output='screen',
+             node_name='fleet_bench_node', on_exit=Shutdown(), parameters=[{
+                'drones': drones,
+                'drone_prefix': drone_prefix,
+                'frame_rate_hz': frame_rate_hz,
+                'marker_length': marker_length,
+                'map_init_id': map_init_id,
+                'warmup_s': warmup_s,
+                'duration_s': duration_s,
+                'summary_filename': summary_filename,
+                'ingest_stamp_sub_topic': '/fiducial_ingest_stamps',
+            }]),
+    ]
+
+    for idx in range(drones):
+        namespace = drone_prefix + str(idx + 1)
+        entities.append(
+            Node(package='fiducial_vlam', node_executable='vloc_node', output='screen',
+                 node_name='vloc_node', node_namespace=namespace, parameters=[{
+                    'publish_tfs': 0,
+                    'publish_image_marked': 0,
+                    'publish_observations': 1,
+                    'stamp_msgs_with_current_time': 0,  # Keep the image stamp so latency can be measured
+                    'camera_frame_id': namespace + '_camera',
+                    'scheduler_threads': vloc_threads,
+                }]))
+
+    return LaunchDescription(entities)
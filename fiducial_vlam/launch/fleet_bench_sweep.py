@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Run fleet_bench_launch.py for a range of fleet sizes and find the knee of the scaling curve.
+
+Each run appends one row to the summary csv. The report gives two knees:
+  capacity  the largest fleet for which every fleet up to it is healthy: the pipelines turn at
+            least --min-efficiency of the offered images into poses, the p95 pose latency is
+            under --max-latency-ms, and vmap_node takes in at least --min-efficiency of the
+            observations the fleet produces
+  kneedle   where the aggregate throughput curve bends the most (Satopaa et al., 2011)
+
+Examples:
+  fleet_bench_sweep.py --max-drones 12
+  fleet_bench_sweep.py --analyze fleet_bench_summary.csv
+"""
+
+import argparse
+import csv
+import os
+import signal
+import subprocess
+
+
+def run_one(drones, args):
+    env = dict(os.environ)
+    env.update({
+        'FLEET_BENCH_DRONES': str(drones),
+        'FLEET_BENCH_RATE_HZ': str(args.rate),
+        'FLEET_BENCH_WARMUP_S': str(args.warmup),
+        'FLEET_BENCH_DURATION_S': str(args.duration),
+        'FLEET_BENCH_SUMMARY': os.path.abspath(args.summary),
+        'FLEET_BENCH_VLOC_THREADS': str(args.vloc_threads),
+    })
+    print('=== %d drones' % drones, flush=True)
+    process = subprocess.Popen(['ros2', 'launch', 'fiducial_vlam', 'fleet_bench_launch.py'],
+                               env=env, start_new_session=True)
+    try:
+        process.wait(timeout=args.warmup + args.duration + args.timeout)
+    except subprocess.TimeoutExpired:
+        print('Run with %d drones timed out' % drones, flush=True)
+        os.killpg(process.pid, signal.SIGINT)
+        process.wait()
+
+
+def read_rows(filename):
+    # The last row for each fleet size wins, so a size can be run again.
+    rows = {}
+    with open(filename) as f:
+        for row in csv.DictReader(f):
+            row = {k: float(v) for k, v in row.items()}
+            rows[int(row['drones'])] = row
+    return [rows[n] for n in sorted(rows)]
+
+
+def is_healthy(row, args):
+    max_latency_ms = args.max_latency_ms if args.max_latency_ms > 0. else 2000. / row['frame_rate_hz']
+    return (row['efficiency'] >= args.min_efficiency and
+            row['latency_p95_ms'] <= max_latency_ms and
+            row['vmap_ingest_fps'] >= args.min_efficiency * row['throughput_fps'])
+
+
+def capacity_knee(rows, args):
+    knee = None
+    for row in rows:
+        if not is_healthy(row, args):
+            break
+        knee = row
+    return knee
+
+
+def kneedle_knee(rows):
+    if len(rows) < 3:
+        return None
+    xs = [row['drones'] for row in rows]
+    ys = [row['throughput_fps'] for row in rows]
+    x_span = xs[-1] - xs[0]
+    y_span = max(ys) - min(ys)
+    if x_span <= 0. or y_span <= 0.:
+        return None
+    differences = [(y - min(ys)) / y_span - (x - xs[0]) / x_span for x, y in zip(xs, ys)]
+    best = max(range(len(rows)), key=lambda i: differences[i])
+    return rows[best] if differences[best] > 0. else None
+
+
+def report(rows, args):
+    print('%6s %10s %10s %6s %8s %8s %10s %10s %10s' % (
+        'drones', 'offered', 'poses/s', 'eff', 'p50 ms', 'p95 ms', 'worst p95', 'vmap fps', 'vmap p95'))
+    for row in rows:
+        print('%6d %10.1f %10.1f %6.2f %8.1f %8.1f %10.1f %10.1f %10.1f%s' % (
+            row['drones'], row['offered_fps'], row['throughput_fps'], row['efficiency'],
+            row['latency_p50_ms'], row['latency_p95_ms'], row['worst_drone_p95_ms'],
+            row['vmap_ingest_fps'], row['vmap_lag_p95_ms'], '' if is_healthy(row, args) else '  *'))
+
+    capacity = capacity_knee(rows, args)
+    kneedle = kneedle_knee(rows)
+    print('* => not healthy')
+    print('capacity knee: %s' % ('%d drones' % capacity['drones'] if capacity else 'none, even the smallest fleet is not healthy'))
+    print('kneedle knee:  %s' % ('%d drones' % kneedle['drones'] if kneedle else 'none, need 3 or more fleet sizes with a bend'))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--analyze', metavar='CSV', help='only report on an existing summary file')
+    parser.add_argument('--summary', default='fleet_bench_summary.csv', help='summary csv to append to')
+    parser.add_argument('--min-drones', type=int, default=1)
+    parser.add_argument('--max-drones', type=int, default=8)
+    parser.add_argument('--step', type=int, default=1)
+    parser.add_argument('--rate', type=float, default=30., help='images per second per drone')
+    parser.add_argument('--warmup', type=float, default=5., help='seconds before measuring')
+    parser.add_argument('--duration', type=float, default=20., help='seconds to measure')
+    parser.add_argument('--vloc-threads', type=int, default=1, help='worker threads per vloc_node')
+    parser.add_argument('--timeout', type=float, default=60., help='extra seconds before a run is stopped')
+    parser.add_argument('--min-efficiency', type=float, default=0.95)
+    parser.add_argument('--max-latency-ms', type=float, default=0., help='0 => two frame periods')
+    args = parser.parse_args()
+
+    if not args.analyze:
+        for drones in range(args.min_drones, args.max_drones + 1, args.step):
+            run_one(drones, args)
+
+    report(read_rows(args.analyze or args.summary), args)
+
+
+if __name__ == '__main__':
+    main()
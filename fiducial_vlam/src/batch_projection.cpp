@@ -0,0 +1,130 @@
+#include "batch_projection.hpp"
+
+namespace fiducial_vlam
+{
+  // The loop bodies below have no branches and only touch the arrays at index i so the
+  // compiler can vectorize them. CMake adds -fopenmp-simd for this file so the pragmas
+  // are honored without linking OpenMP.
+
+  void project_batch(const BatchPose &pose,
+                     const BatchCalibration &cal,
+                     const PointBatch &points,
+                     ProjectionBatch &projections,
+                     bool with_jacobians)
+  {
+    const auto n = points.size();
+    projections.u_.resize(n);
+    projections.v_.resize(n);
+    projections.depth_.resize(n);
+    if (with_jacobians) {
+      for (auto &h : projections.h_) {
+        h.resize(n);
+      }
+    }
+
+    const double r0 = pose.r_[0], r1 = pose.r_[1], r2 = pose.r_[2];
+    const double r3 = pose.r_[3], r4 = pose.r_[4], r5 = pose.r_[5];
+    const double r6 = pose.r_[6], r7 = pose.r_[7], r8 = pose.r_[8];
+    const double tx = pose.t_[0], ty = pose.t_[1], tz = pose.t_[2];
+    const double fx = cal.fx_, fy = cal.fy_, s = cal.s_, u0 = cal.u0_, v0 = cal.v0_;
+    const double k1 = cal.k1_, k2 = cal.k2_, p1 = cal.p1_, p2 = cal.p2_;
+
+    const double *__restrict px = points.x_.data();
+    const double *__restrict py = points.y_.data();
+    const double *__restrict pz = points.z_.data();
+    double *__restrict pu = projections.u_.data();
+    double *__restrict pv = projections.v_.data();
+    double *__restrict pd = projections.depth_.data();
+
+    std::size_t behind_count = 0;
+
+    if (!with_jacobians) {
+#pragma omp simd reduction(+:behind_count)
+      for (std::size_t i = 0; i < n; i += 1) {
+        // The point in the camera frame: R^T (p - t)
+        const double dx = px[i] - tx, dy = py[i] - ty, dz = pz[i] - tz;
+        const double cx = r0 * dx + r3 * dy + r6 * dz;
+        const double cy = r1 * dx + r4 * dy + r7 * dz;
+        const double cz = r2 * dx + r5 * dy + r8 * dz;
+        pd[i] = cz;
+        behind_count += cz <= 0. ? 1 : 0;
+
+        // Normalize, distort, and apply the camera matrix.
+        const double iz = 1. / cz;
+        const double x = cx * iz, y = cy * iz;
+        const double xx = x * x, yy = y * y, xy = x * y, rr = xx + yy;
+        const double g = 1. + k1 * rr + k2 * rr * rr;
+        const double xd = g * x + 2. * p1 * xy + p2 * (rr + 2. * xx);
+        const double yd = g * y + 2. * p2 * xy + p1 * (rr + 2. * yy);
+        pu[i] = fx * xd + s * yd + u0;
+        pv[i] = fy * yd + v0;
+      }
+
+      projections.behind_count_ = behind_count;
+      return;
+    }
+
+    double *__restrict h0 = projections.h_[0].data();
+    double *__restrict h1 = projections.h_[1].data();
+    double *__restrict h2 = projections.h_[2].data();
+    double *__restrict h3 = projections.h_[3].data();
+    double *__restrict h4 = projections.h_[4].data();
+    double *__restrict h5 = projections.h_[5].data();
+    double *__restrict h6 = projections.h_[6].data();
+    double *__restrict h7 = projections.h_[7].data();
+    double *__restrict h8 = projections.h_[8].data();
+    double *__restrict h9 = projections.h_[9].data();
+    double *__restrict h10 = projections.h_[10].data();
+    double *__restrict h11 = projections.h_[11].data();
+
+#pragma omp simd reduction(+:behind_count)
+    for (std::size_t i = 0; i < n; i += 1) {
+      const double dx = px[i] - tx, dy = py[i] - ty, dz = pz[i] - tz;
+      const double cx = r0 * dx + r3 * dy + r6 * dz;
+      const double cy = r1 * dx + r4 * dy + r7 * dz;
+      const double cz = r2 * dx + r5 * dy + r8 * dz;
+      pd[i] = cz;
+      behind_count += cz <= 0. ? 1 : 0;
+
+      const double iz = 1. / cz;
+      const double x = cx * iz, y = cy * iz;
+      const double xx = x * x, yy = y * y, xy = x * y, rr = xx + yy;
+      const double g = 1. + k1 * rr + k2 * rr * rr;
+      const double xd = g * x + 2. * p1 * xy + p2 * (rr + 2. * xx);
+      const double yd = g * y + 2. * p2 * xy + p1 * (rr + 2. * yy);
+      pu[i] = fx * xd + s * yd + u0;
+      pv[i] = fy * yd + v0;
+
+      // d(xd, yd) / d(x, y)
+      const double dg = 2. * (k1 + 2. * k2 * rr);
+      const double a11 = g + xx * dg + 2. * p1 * y + 6. * p2 * x;
+      const double a12 = xy * dg + 2. * p1 * x + 2. * p2 * y;
+      const double a21 = xy * dg + 2. * p1 * x + 2. * p2 * y;
+      const double a22 = g + yy * dg + 6. * p1 * y + 2. * p2 * x;
+
+      // d(u, v) / d(xd, yd) * d(xd, yd) / d(x, y)
+      const double b11 = fx * a11 + s * a21, b12 = fx * a12 + s * a22;
+      const double b21 = fy * a21, b22 = fy * a22;
+
+      // ... * d(x, y) / d(camera point)
+      const double c11 = b11 * iz, c12 = b12 * iz, c13 = -(b11 * x + b12 * y) * iz;
+      const double c21 = b21 * iz, c22 = b22 * iz, c23 = -(b21 * x + b22 * y) * iz;
+
+      // ... * d(camera point) / d(pose) = [skew(camera point), -I]
+      h0[i] = c12 * cz - c13 * cy;
+      h1[i] = c13 * cx - c11 * cz;
+      h2[i] = c11 * cy - c12 * cx;
+      h3[i] = -c11;
+      h4[i] = -c12;
+      h5[i] = -c13;
+      h6[i] = c22 * cz - c23 * cy;
+      h7[i] = c23 * cx - c21 * cz;
+      h8[i] = c21 * cy - c22 * cx;
+      h9[i] = -c21;
+      h10[i] = -c22;
+      h11[i] = -c23;
+    }
+
+    projections.behind_count_ = behind_count;
+  }
+}
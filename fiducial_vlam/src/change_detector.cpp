@@ -0,0 +1,110 @@
+#include "change_detector.hpp"
+
+#include <algorithm>
+
+#include "observation.hpp"
+
+#include "cv_bridge/cv_bridge.h"
+#include "opencv2/imgproc.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// ChangeDetector::Reference class
+// ==============================================================================
+
+  class ChangeDetector::Reference
+  {
+  public:
+    // The shrunken grayscale image at the last detection.
+    cv::Mat gray_{};
+    // The regions of the shrunken image that are compared. Empty => compare everything.
+    std::vector<cv::Rect> rois_{};
+    // The shrunken grayscale image of the last call to needs_detection.
+    cv::Mat pending_gray_{};
+    bool is_valid_{false};
+  };
+
+// ==============================================================================
+// ChangeDetector class
+// ==============================================================================
+
+  ChangeDetector::ChangeDetector(int decimation, double threshold, int max_skipped_frames) :
+    decimation_{std::max(1, decimation)},
+    threshold_{threshold},
+    max_skipped_frames_{max_skipped_frames},
+    reference_{std::make_unique<Reference>()}
+  {}
+
+  ChangeDetector::~ChangeDetector() = default;
+
+  bool ChangeDetector::needs_detection(const std::shared_ptr<cv_bridge::CvImage> &color)
+  {
+    // Shrink first, then convert to gray. The conversion is cheaper on the small image.
+    cv::Mat small;
+    cv::resize(color->image, small, cv::Size{}, 1.0 / decimation_, 1.0 / decimation_, cv::INTER_AREA);
+    auto &gray = reference_->pending_gray_;
+    if (small.channels() == 3) {
+      cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+    } else if (small.channels() == 4) {
+      cv::cvtColor(small, gray, cv::COLOR_BGRA2GRAY);
+    } else {
+      gray = small;
+    }
+
+    // Always detect if there is nothing to compare against or if too many frames have been skipped.
+    if (!reference_->is_valid_ ||
+        reference_->gray_.size() != gray.size() ||
+        reference_->gray_.type() != gray.type() ||
+        skipped_frames_ >= max_skipped_frames_) {
+      return true;
+    }
+
+    // Find the motion energy in the regions of interest.
+    cv::Mat diff;
+    cv::absdiff(gray, reference_->gray_, diff);
+    if (reference_->rois_.empty()) {
+      if (cv::mean(diff)[0] > threshold_) {
+        return true;
+      }
+    } else {
+      for (auto &roi : reference_->rois_) {
+        if (cv::mean(diff(roi))[0] > threshold_) {
+          return true;
+        }
+      }
+    }
+
+    skipped_frames_ += 1;
+    return false;
+  }
+
+  void ChangeDetector::detected(const Observations &observations)
+  {
+    reference_->gray_ = reference_->pending_gray_.clone();
+    reference_->rois_.clear();
+    reference_->is_valid_ = !reference_->gray_.empty();
+    skipped_frames_ = 0;
+
+    // Compare a region around each marker, expanded by half the size of the marker so that
+    // a marker moving out of its old region is seen.
+    cv::Rect image_rect{0, 0, reference_->gray_.cols, reference_->gray_.rows};
+    for (auto &observation : observations.observations()) {
+      auto x_min = std::min({observation.x0(), observation.x1(), observation.x2(), observation.x3()});
+      auto x_max = std::max({observation.x0(), observation.x1(), observation.x2(), observation.x3()});
+      auto y_min = std::min({observation.y0(), observation.y1(), observation.y2(), observation.y3()});
+      auto y_max = std::max({observation.y0(), observation.y1(), observation.y2(), observation.y3()});
+      auto margin_x = (x_max - x_min) / 2.0;
+      auto margin_y = (y_max - y_min) / 2.0;
+
+      cv::Rect roi{cv::Point{static_cast<int>((x_min - margin_x) / decimation_),
+                             static_cast<int>((y_min - margin_y) / decimation_)},
+                   cv::Point{static_cast<int>((x_max + margin_x) / decimation_) + 1,
+                             static_cast<int>((y_max + margin_y) / decimation_) + 1}};
+      roi &= image_rect;
+      if (roi.area() > 0) {
+        reference_->rois_.emplace_back(roi);
+      }
+    }
+  }
+}
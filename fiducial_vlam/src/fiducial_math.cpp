@@ -1,20 +1,35 @@
 
 #include "fiducial_math.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <map>
+#include <mutex>
+#include <numeric>
+
+#include "batch_projection.hpp"
 #include "map.hpp"
+#include "marker_decoder.hpp"
 #include "observation.hpp"
+#include "sam_util.hpp"
+#include "task_scheduler.hpp"
 #include "transform_with_covariance.hpp"
 
 #include "cv_bridge/cv_bridge.h"
 #include "opencv2/aruco.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/video/tracking.hpp"
 
+#include <gtsam/geometry/Cal3_S2.h>
 #include <gtsam/geometry/Cal3DS2.h>
 #include <gtsam/geometry/PinholeCamera.h>
+#include <gtsam/geometry/PinholePose.h>
 #include <gtsam/geometry/Point3.h>
 #include <gtsam/geometry/Pose3.h>
 #include "gtsam/inference/Symbol.h"
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/GaussNewtonOptimizer.h>
 #include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
 #include <gtsam/nonlinear/Marginals.h>
 #include <gtsam/slam/BetweenFactor.h>
@@ -28,34 +43,118 @@ namespace fiducial_vlam
 
   class CameraInfo::CvCameraInfo
   {
+    // The message this was built from. Compared on cache lookups because hashes can collide.
+    const sensor_msgs::msg::CameraInfo msg_;
     cv::Mat camera_matrix_;
     cv::Mat dist_coeffs_;
+    bool is_pinhole_;
+
+    static bool has_no_distortion(const sensor_msgs::msg::CameraInfo &msg)
+    {
+      return std::all_of(msg.d.begin(), msg.d.end(), [](double d) -> bool
+      { return d == 0.; });
+    }
 
   public:
     CvCameraInfo() = delete;
 
     explicit CvCameraInfo(const sensor_msgs::msg::CameraInfo &msg)
-      : camera_matrix_(3, 3, CV_64F, 0.), dist_coeffs_(1, 5, CV_64F)
+      : msg_(msg), camera_matrix_(3, 3, CV_64F, 0.), dist_coeffs_(), is_pinhole_(has_no_distortion(msg))
     {
       camera_matrix_.at<double>(0, 0) = msg.k[0];
+      camera_matrix_.at<double>(0, 1) = msg.k[1];
       camera_matrix_.at<double>(0, 2) = msg.k[2];
       camera_matrix_.at<double>(1, 1) = msg.k[4];
       camera_matrix_.at<double>(1, 2) = msg.k[5];
       camera_matrix_.at<double>(2, 2) = 1.;
 
-      // ROS and OpenCV (and everybody?) agree on this ordering: k1, k2, t1 (p1), t2 (p2), k3
-      dist_coeffs_.at<double>(0) = msg.d[0];
-      dist_coeffs_.at<double>(1) = msg.d[1];
-      dist_coeffs_.at<double>(2) = msg.d[2];
-      dist_coeffs_.at<double>(3) = msg.d[3];
-      dist_coeffs_.at<double>(4) = msg.d[4];
+      // A camera without distortion (ie. one publishing rectified images) is a pure
+      // pinhole camera. Leave dist_coeffs_ empty so OpenCV skips the distortion model.
+      if (!is_pinhole_) {
+        // ROS and OpenCV (and everybody?) agree on this ordering: k1, k2, t1 (p1), t2 (p2), k3
+        dist_coeffs_ = cv::Mat(1, 5, CV_64F, 0.);
+        for (std::size_t i = 0; i < 5 && i < msg.d.size(); i += 1) {
+          dist_coeffs_.at<double>(i) = msg.d[i];
+        }
+      }
     }
 
+    auto &msg() const
+    { return msg_; }
+
     auto &camera_matrix()
     { return camera_matrix_; }
 
     auto &dist_coeffs()
     { return dist_coeffs_; }
+
+    auto is_pinhole() const
+    { return is_pinhole_; }
+  };
+
+// ==============================================================================
+// CameraInfo::SamCameraInfo class
+// ==============================================================================
+
+  class CameraInfo::SamCameraInfo
+  {
+    // Shared by all the factors that use this calibration. Only the model that describes
+    // the camera is built: cal3_s2_ for a pinhole camera, cal3ds2_ otherwise. The other is null.
+    const boost::shared_ptr<gtsam::Cal3DS2> cal3ds2_;
+    const boost::shared_ptr<gtsam::Cal3_S2> cal3_s2_;
+
+    static boost::shared_ptr<gtsam::Cal3DS2> to_cal3ds2(CvCameraInfo &cv)
+    {
+      if (cv.is_pinhole()) {
+        return nullptr;
+      }
+      auto &camera_matrix = cv.camera_matrix();
+      auto &dist_coeffs = cv.dist_coeffs();
+      return boost::make_shared<gtsam::Cal3DS2>(
+        camera_matrix.at<double>(0, 0),  // fx
+        camera_matrix.at<double>(1, 1),  // fy
+        camera_matrix.at<double>(0, 1),  // s
+        camera_matrix.at<double>(0, 2),  // u0
+        camera_matrix.at<double>(1, 2),  // v0
+        dist_coeffs.at<double>(0), // k1
+        dist_coeffs.at<double>(1), // k2
+        dist_coeffs.at<double>(2), // p1
+        dist_coeffs.at<double>(3));// p2
+    }
+
+    static boost::shared_ptr<gtsam::Cal3_S2> to_cal3_s2(CvCameraInfo &cv)
+    {
+      if (!cv.is_pinhole()) {
+        return nullptr;
+      }
+      auto &camera_matrix = cv.camera_matrix();
+      return boost::make_shared<gtsam::Cal3_S2>(
+        camera_matrix.at<double>(0, 0),  // fx
+        camera_matrix.at<double>(1, 1),  // fy
+        camera_matrix.at<double>(0, 1),  // s
+        camera_matrix.at<double>(0, 2),  // u0
+        camera_matrix.at<double>(1, 2)); // v0
+    }
+
+  public:
+    SamCameraInfo() = delete;
+
+    explicit SamCameraInfo(CvCameraInfo &cv)
+      : cal3ds2_{to_cal3ds2(cv)},
+        cal3_s2_{to_cal3_s2(cv)}
+    {}
+
+    auto &cal3ds2() const
+    { return *cal3ds2_; }
+
+    auto &cal3_s2() const
+    { return *cal3_s2_; }
+
+    auto &cal3ds2_ptr() const
+    { return cal3ds2_; }
+
+    auto &cal3_s2_ptr() const
+    { return cal3_s2_; }
   };
 
 // ==============================================================================
@@ -65,8 +164,96 @@ namespace fiducial_vlam
   CameraInfo::CameraInfo() = default;
 
   CameraInfo::CameraInfo(const sensor_msgs::msg::CameraInfo &camera_info_msg)
-    : cv_(std::make_shared<CameraInfo::CvCameraInfo>(camera_info_msg))
-  {}
+    : hash_{hash(camera_info_msg)}
+  {
+    // The calibration objects derived from a camera_info message are shared by every
+    // CameraInfo in the process that was built from the same calibration. They are
+    // only built when a calibration that is not in use shows up. Entries are keyed by
+    // the hash, but the calibration values are compared as well in case two hashes collide.
+    using cache_entry_type = std::pair<std::weak_ptr<CvCameraInfo>, std::weak_ptr<SamCameraInfo>>;
+    static std::mutex cache_mutex;
+    static std::multimap<std::size_t, cache_entry_type> cache;
+
+    std::lock_guard<std::mutex> lock{cache_mutex};
+
+    auto range = cache.equal_range(hash_);
+    for (auto it = range.first; it != range.second; ++it) {
+      auto cv = it->second.first.lock();
+      auto sam = it->second.second.lock();
+      if (cv && sam && same_calibration(cv->msg(), camera_info_msg)) {
+        cv_ = std::move(cv);
+        sam_ = std::move(sam);
+        return;
+      }
+    }
+
+    cv_ = std::make_shared<CameraInfo::CvCameraInfo>(camera_info_msg);
+    sam_ = std::make_shared<CameraInfo::SamCameraInfo>(*cv_);
+    cache.emplace(hash_, cache_entry_type{cv_, sam_});
+
+    // Drop entries for calibrations that are no longer in use.
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = it->second.first.expired() ? cache.erase(it) : std::next(it);
+    }
+  }
+
+  std::size_t CameraInfo::hash(const sensor_msgs::msg::CameraInfo &camera_info_msg)
+  {
+    // Only the fields that contribute to the calibration are hashed. The header changes with every message.
+    std::size_t seed{std::hash<std::string>{}(camera_info_msg.distortion_model)};
+    auto combine = [&seed](double v) -> void
+    {
+      seed ^= std::hash<double>{}(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    };
+    combine(camera_info_msg.width);
+    combine(camera_info_msg.height);
+    for (auto v : camera_info_msg.d) {
+      combine(v);
+    }
+    for (auto v : camera_info_msg.k) {
+      combine(v);
+    }
+    for (auto v : camera_info_msg.p) {
+      combine(v);
+    }
+    return seed;
+  }
+
+  bool CameraInfo::same_calibration(const sensor_msgs::msg::CameraInfo &a,
+                                    const sensor_msgs::msg::CameraInfo &b)
+  {
+    // The same fields that are hashed.
+    return a.distortion_model == b.distortion_model &&
+           a.width == b.width &&
+           a.height == b.height &&
+           a.d == b.d &&
+           a.k == b.k &&
+           a.p == b.p;
+  }
+
+  bool CameraInfo::is_built_from(const sensor_msgs::msg::CameraInfo &camera_info_msg) const
+  {
+    return is_valid() &&
+           hash_ == hash(camera_info_msg) &&
+           same_calibration(cv_->msg(), camera_info_msg);
+  }
+
+  bool CameraInfo::is_pinhole() const
+  {
+    return cv_->is_pinhole();
+  }
+
+  sensor_msgs::msg::CameraInfo CameraInfo::to_rectified_msg(const sensor_msgs::msg::CameraInfo &camera_info_msg)
+  {
+    // The images have already been rectified, so the projection matrix P describes the
+    // camera and there is no distortion. Copy the intrinsic part of P into K.
+    auto rectified_msg{camera_info_msg};
+    rectified_msg.k = {camera_info_msg.p[0], camera_info_msg.p[1], camera_info_msg.p[2],
+                       camera_info_msg.p[4], camera_info_msg.p[5], camera_info_msg.p[6],
+                       camera_info_msg.p[8], camera_info_msg.p[9], camera_info_msg.p[10]};
+    std::fill(rectified_msg.d.begin(), rectified_msg.d.end(), 0.);
+    return rectified_msg;
+  }
 
 // ==============================================================================
 // drawDetectedMarkers function
@@ -125,9 +312,20 @@ namespace fiducial_vlam
 
   class FiducialMath::CvFiducialMath
   {
+    // The grayscale version of the last image. Used for tracking.
+    cv::Mat last_gray_{};
+
+    MarkerDecoder marker_decoder_{};
+
   public:
     const CameraInfo ci_;
 
+    // true => detect markers with MarkerDecoder instead of cv::aruco::detectMarkers
+    bool use_in_tree_decoder_{false};
+
+    // A pose for the next camera solve to start from, or invalid. It is used once.
+    TransformWithCovariance t_map_camera_guess_{};
+
     explicit CvFiducialMath(const CameraInfo &camera_info)
       : ci_{camera_info}
     {}
@@ -159,20 +357,81 @@ namespace fiducial_vlam
       return TransformWithCovariance(to_tf2_transform(rvec, tvec));
     }
 
+    // Find the camera pose from each known marker on its own and reject the markers whose
+    // camera pose disagrees with the consensus. The consensus is the single marker camera pose
+    // that the most other markers agree with. With fewer than three known markers there is no
+    // way to tell which marker is wrong so none are rejected. Unknown markers are kept.
+    Observations consistent_observations(const Observations &observations,
+                                         Map &map,
+                                         const RobustSolveOptions &options,
+                                         std::vector<int> *rejected_ids)
+    {
+      std::vector<size_t> known_idxs{};
+      std::vector<tf2::Transform> t_map_cameras{};
+
+      for (size_t i = 0; i < observations.size(); i += 1) {
+        auto &observation = observations.observations()[i];
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          auto t_camera_marker = solve_t_camera_marker(observation, map.marker_length());
+          known_idxs.emplace_back(i);
+          t_map_cameras.emplace_back(marker_ptr->t_map_marker().transform() * t_camera_marker.transform().inverse());
+        }
+      }
+
+      if (known_idxs.size() < 3) {
+        return observations;
+      }
+
+      auto agree = [&options](const tf2::Transform &a, const tf2::Transform &b) -> bool
+      {
+        return (a.getOrigin() - b.getOrigin()).length() <= options.max_position_deviation_ &&
+               a.getRotation().angleShortestPath(b.getRotation()) <= options.max_angle_deviation_;
+      };
+
+      // Find the consensus pose.
+      size_t best = 0;
+      size_t best_support = 0;
+      for (size_t i = 0; i < t_map_cameras.size(); i += 1) {
+        size_t support = 0;
+        for (size_t j = 0; j < t_map_cameras.size(); j += 1) {
+          support += agree(t_map_cameras[i], t_map_cameras[j]) ? 1 : 0;
+        }
+        if (support > best_support) {
+          best = i;
+          best_support = support;
+        }
+      }
+
+      // Keep every observation except the known markers that disagree with the consensus.
+      std::vector<bool> rejected(observations.size(), false);
+      for (size_t i = 0; i < t_map_cameras.size(); i += 1) {
+        rejected[known_idxs[i]] = !agree(t_map_cameras[best], t_map_cameras[i]);
+      }
+
+      Observations inliers{};
+      for (size_t i = 0; i < observations.size(); i += 1) {
+        auto &observation = observations.observations()[i];
+        if (!rejected[i]) {
+          inliers.add(observation);
+        } else if (rejected_ids != nullptr) {
+          rejected_ids->emplace_back(observation.id());
+        }
+      }
+      return inliers;
+    }
+
     TransformWithCovariance solve_t_map_camera(const Observations &observations,
                                                Map &map)
     {
-      auto t_map_markers = map.find_t_map_markers(observations);
-
-      // Build up two lists of corner points: 2D in the image frame, 3D in the marker frame
+      // Build up two lists of corner points: 2D in the image frame, 3D in the map frame
       std::vector<cv::Point3d> all_corners_f_map;
       std::vector<cv::Point2f> all_corners_f_image;
 
-      for (int i = 0; i < observations.size(); i += 1) {
-        auto &observation = observations.observations()[i];
-        auto &t_map_marker = t_map_markers[i];
-        if (t_map_marker.is_valid()) {
-          append_corners_f_map(t_map_marker, map.marker_length(), all_corners_f_map);
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          append_corners_f_map(*marker_ptr, map.marker_length(), all_corners_f_map);
           append_corners_f_image(observation, all_corners_f_image);
         }
       }
@@ -210,6 +469,23 @@ namespace fiducial_vlam
         }
       }
 
+      // A guess, like the pose saved by the last run, can pick the right one of two mirror
+      // solutions. Solve again starting from the guess and keep that solution unless it
+      // fits the corners clearly worse.
+      if (t_map_camera_guess_.is_valid()) {
+        cv::Vec3d rvec_guess, tvec_guess;
+        to_cv_rvec_tvec(TransformWithCovariance{t_map_camera_guess_.transform().inverse()}, rvec_guess, tvec_guess);
+        t_map_camera_guess_ = TransformWithCovariance{};
+        cv::solvePnP(all_corners_f_map, all_corners_f_image,
+                     ci_.cv()->camera_matrix(), ci_.cv()->dist_coeffs(),
+                     rvec_guess, tvec_guess, true);
+        if (reprojection_rms(all_corners_f_map, all_corners_f_image, rvec_guess, tvec_guess) <=
+            1.2 * reprojection_rms(all_corners_f_map, all_corners_f_image, rvec, tvec)) {
+          rvec = rvec_guess;
+          tvec = tvec_guess;
+        }
+      }
+
       if (tvec[0] < 0) { // specific tests for bad pose determination
         int xxx = 9;
       }
@@ -222,26 +498,54 @@ namespace fiducial_vlam
     }
 
     Observations detect_markers(cv_bridge::CvImagePtr &color,
-                                std::shared_ptr<cv_bridge::CvImage> &color_marked)
+                                std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                CornerRefinement corner_refinement,
+                                const Observations *near_observations)
     {
       // Todo: make the dictionary a parameter
       auto dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
       auto detectorParameters = cv::aruco::DetectorParameters::create();
 #if (CV_VERSION_MAJOR == 4)
-      // Use the new AprilTag 2 corner algorithm, much better but much slower
-      detectorParameters->cornerRefinementMethod = cv::aruco::CornerRefineMethod::CORNER_REFINE_APRILTAG;
+      // The new AprilTag 2 corner algorithm is much better but much slower
+      detectorParameters->cornerRefinementMethod =
+        corner_refinement == CornerRefinement::apriltag ? cv::aruco::CornerRefineMethod::CORNER_REFINE_APRILTAG :
+        corner_refinement == CornerRefinement::subpix ? cv::aruco::CornerRefineMethod::CORNER_REFINE_SUBPIX :
+        cv::aruco::CornerRefineMethod::CORNER_REFINE_NONE;
 #else
-      detectorParameters->doCornerRefinement = true;
+      detectorParameters->doCornerRefinement = corner_refinement != CornerRefinement::none;
 #endif
 
       // Color to gray for detection
-      cv::Mat gray;
-      cv::cvtColor(color->image, gray, cv::COLOR_BGR2GRAY);
+      cv::cvtColor(color->image, last_gray_, cv::COLOR_BGR2GRAY);
+
+      // Only look in the region around the previous markers if there are any.
+      cv::Rect roi{0, 0, last_gray_.cols, last_gray_.rows};
+      if (near_observations != nullptr && near_observations->size() > 0) {
+        auto near_roi = near_rect(*near_observations) & roi;
+        if (near_roi.area() > 0) {
+          roi = near_roi;
+        }
+      }
 
       // Detect markers
       std::vector<int> ids;
       std::vector<std::vector<cv::Point2f>> corners;
-      cv::aruco::detectMarkers(gray, dictionary, corners, ids, detectorParameters);
+      if (use_in_tree_decoder_) {
+        // The in-tree decoder doesn't do AprilTag refinement, subpixel refinement is used instead.
+        marker_decoder_.detect_markers(last_gray_(roi), corners, ids, corner_refinement != CornerRefinement::none);
+      } else {
+        cv::aruco::detectMarkers(last_gray_(roi), dictionary, corners, ids, detectorParameters);
+      }
+
+      // Move the corners from the roi back to the full image
+      if (roi.x != 0 || roi.y != 0) {
+        for (auto &marker_corners : corners) {
+          for (auto &corner : marker_corners) {
+            corner.x += roi.x;
+            corner.y += roi.y;
+          }
+        }
+      }
 
       // Annotate the markers
       if (color_marked) {
@@ -252,6 +556,47 @@ namespace fiducial_vlam
       return to_observations(ids, corners);
     }
 
+    // Follow the corners of the previous observations into this image with optical flow. A marker
+    // is dropped if any of its corners is lost. No detection is done.
+    Observations track_markers(cv_bridge::CvImagePtr &color,
+                               std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                               const Observations &previous_observations)
+    {
+      cv::Mat gray;
+      cv::cvtColor(color->image, gray, cv::COLOR_BGR2GRAY);
+
+      std::vector<int> ids;
+      std::vector<std::vector<cv::Point2f>> corners;
+
+      if (!last_gray_.empty() && last_gray_.size() == gray.size() && previous_observations.size() > 0) {
+        std::vector<cv::Point2f> previous_points;
+        for (auto &observation : previous_observations.observations()) {
+          append_corners_f_image(observation, previous_points);
+        }
+
+        std::vector<cv::Point2f> points;
+        std::vector<uchar> status;
+        std::vector<float> err;
+        cv::calcOpticalFlowPyrLK(last_gray_, gray, previous_points, points, status, err);
+
+        for (size_t i = 0; i < previous_observations.size(); i += 1) {
+          if (status[i * 4] && status[i * 4 + 1] && status[i * 4 + 2] && status[i * 4 + 3]) {
+            ids.emplace_back(previous_observations.observations()[i].id());
+            corners.emplace_back(points.begin() + i * 4, points.begin() + i * 4 + 4);
+          }
+        }
+      }
+
+      last_gray_ = gray;
+
+      // Annotate the markers
+      if (color_marked) {
+        drawDetectedMarkers(color_marked->image, corners, ids);
+      }
+
+      return to_observations(ids, corners);
+    }
+
     void annotate_image_with_marker_axis(std::shared_ptr<cv_bridge::CvImage> &color_marked,
                                          const TransformWithCovariance &t_camera_marker)
     {
@@ -321,6 +666,22 @@ namespace fiducial_vlam
     }
 
 
+    void append_corners_f_map(const Marker &marker,
+                              double marker_length,
+                              std::vector<cv::Point3d> &corners_f_map)
+    {
+      // Use the corners stored in the map if there are any. This skips the transform.
+      if (!marker.has_corners()) {
+        append_corners_f_map(marker.t_map_marker(), marker_length, corners_f_map);
+        return;
+      }
+
+      for (auto &corner_f_map : marker.corners_f_map()) {
+        auto &p = corner_f_map.point();
+        corners_f_map.emplace_back(cv::Point3d(p.x(), p.y(), p.z()));
+      }
+    }
+
     void append_corners_f_marker(double marker_length, std::vector<cv::Point3d> &corners_f_marker)
     {
       // Add to the list of the corner locations in the marker frame.
@@ -343,6 +704,24 @@ namespace fiducial_vlam
     };
 
   private:
+    // The bounding box of the observations, expanded by half the size of each marker.
+    static cv::Rect near_rect(const Observations &observations)
+    {
+      cv::Rect rect{};
+      for (auto &observation : observations.observations()) {
+        auto x_min = std::min({observation.x0(), observation.x1(), observation.x2(), observation.x3()});
+        auto x_max = std::max({observation.x0(), observation.x1(), observation.x2(), observation.x3()});
+        auto y_min = std::min({observation.y0(), observation.y1(), observation.y2(), observation.y3()});
+        auto y_max = std::max({observation.y0(), observation.y1(), observation.y2(), observation.y3()});
+        auto margin_x = (x_max - x_min) / 2.0;
+        auto margin_y = (y_max - y_min) / 2.0;
+        cv::Rect marker_rect{cv::Point{static_cast<int>(x_min - margin_x), static_cast<int>(y_min - margin_y)},
+                             cv::Point{static_cast<int>(x_max + margin_x) + 1, static_cast<int>(y_max + margin_y) + 1}};
+        rect = rect.area() > 0 ? (rect | marker_rect) : marker_rect;
+      }
+      return rect;
+    }
+
     Observations to_observations(const std::vector<int> &ids, const std::vector<std::vector<cv::Point2f>> &corners)
     {
       Observations observations;
@@ -372,6 +751,21 @@ namespace fiducial_vlam
       return result;
     }
 
+    double reprojection_rms(const std::vector<cv::Point3d> &corners_f_map,
+                            const std::vector<cv::Point2f> &corners_f_image,
+                            const cv::Vec3d &rvec, const cv::Vec3d &tvec)
+    {
+      std::vector<cv::Point2d> projected;
+      cv::projectPoints(corners_f_map, rvec, tvec, ci_.cv()->camera_matrix(), ci_.cv()->dist_coeffs(), projected);
+      double sum2 = 0.;
+      for (std::size_t i = 0; i < projected.size(); i += 1) {
+        auto dx = projected[i].x - corners_f_image[i].x;
+        auto dy = projected[i].y - corners_f_image[i].y;
+        sum2 += dx * dx + dy * dy;
+      }
+      return std::sqrt(sum2 / projected.size());
+    }
+
     void to_cv_rvec_tvec(const TransformWithCovariance &t, cv::Vec3d &rvec, cv::Vec3d &tvec)
     {
       auto c = t.transform().getOrigin();
@@ -396,157 +790,590 @@ namespace fiducial_vlam
   class FiducialMath::SamFiducialMath
   {
     CvFiducialMath &cv_;
-    gtsam::Cal3DS2 cal3ds2_;
+    const bool is_pinhole_;
+    const double corner_measurement_sigma_;
     const gtsam::SharedNoiseModel corner_measurement_noise_;
+    const gtsam::SharedNoiseModel constrained_noise_;
+    const BatchCalibration batch_cal_;
+    const std::array<double, 4> corner_sqrt_information_;   // Row major 2x2
 
     gtsam::Key camera_key_{gtsam::Symbol('c', 1)};
 
+    static BatchCalibration to_batch_calibration(const CameraInfo &ci, bool is_pinhole)
+    {
+      if (is_pinhole) {
+        auto &k = ci.sam()->cal3_s2();
+        return BatchCalibration{k.fx(), k.fy(), k.skew(), k.px(), k.py()};
+      }
+      auto &k = ci.sam()->cal3ds2();
+      return BatchCalibration{k.fx(), k.fy(), k.skew(), k.px(), k.py(), k.k1(), k.k2(), k.p1(), k.p2()};
+    }
+
+    static BatchPose to_batch_pose(const gtsam::Pose3 &pose)
+    {
+      BatchPose batch_pose{};
+      auto r = pose.rotation().matrix();
+      for (int row = 0; row < 3; row += 1) {
+        for (int col = 0; col < 3; col += 1) {
+          batch_pose.r_[row * 3 + col] = r(row, col);
+        }
+      }
+      auto &t = pose.translation();
+      batch_pose.t_ = {t.x(), t.y(), t.z()};
+      return batch_pose;
+    }
+
+    // The square root information of a 2x2 measurement covariance: R with R^T R = cov^-1.
+    static std::array<double, 4> to_sqrt_information(const gtsam::Matrix2 &cov)
+    {
+      gtsam::Matrix2 information = cov.inverse();
+      gtsam::Matrix2 r = Eigen::LLT<gtsam::Matrix2>(information).matrixU();
+      return {r(0, 0), r(0, 1), r(1, 0), r(1, 1)};
+    }
+
+
+    // The factors below can have their measurements and noise models updated in place. This lets
+    // a graph be built once for a set of visible markers and then reused for later frames.
+    class ResectioningFactorBase : public gtsam::NoiseModelFactor1<gtsam::Pose3>
+    {
+    protected:
+      gtsam::Point3 P_;       ///< 3D point on the calibration rig
+      gtsam::Point2 p_;       ///< 2D measurement of the 3D point
+
+    public:
+      ResectioningFactorBase(const gtsam::SharedNoiseModel &model,
+                             const gtsam::Key key,
+                             gtsam::Point2 p,
+                             gtsam::Point3 P) :
+        NoiseModelFactor1<gtsam::Pose3>(model, key),
+        P_(std::move(P)),
+        p_(std::move(p))
+      {}
+
+      void update(const gtsam::SharedNoiseModel &model, const gtsam::Point2 &p, const gtsam::Point3 &P)
+      {
+        noiseModel_ = model;
+        p_ = p;
+        P_ = P;
+      }
+    };
 
-    class ResectioningFactor : public gtsam::NoiseModelFactor1<gtsam::Pose3>
+    template<class CALIBRATION>
+    class ResectioningFactor : public ResectioningFactorBase
     {
-      const gtsam::Cal3DS2 cal3ds2_;
-      const gtsam::Point3 P_;       ///< 3D point on the calibration rig
-      const gtsam::Point2 p_;       ///< 2D measurement of the 3D point
+      const boost::shared_ptr<CALIBRATION> cal_;
 
     public:
       /// Construct factor given known point P and its projection p
       ResectioningFactor(const gtsam::SharedNoiseModel &model,
                          const gtsam::Key key,
-                         const gtsam::Cal3DS2 &cal3ds2,
+                         const boost::shared_ptr<CALIBRATION> &cal,
                          gtsam::Point2 p,
                          gtsam::Point3 P) :
-        NoiseModelFactor1<gtsam::Pose3>(model, key),
-        cal3ds2_{cal3ds2},
-        P_(std::move(P)),
-        p_(std::move(p))
+        ResectioningFactorBase(model, key, std::move(p), std::move(P)),
+        cal_{cal}
       {}
 
       /// evaluate the error
       gtsam::Vector evaluateError(const gtsam::Pose3 &pose,
                                   boost::optional<gtsam::Matrix &> H) const override
       {
-        auto camera = gtsam::PinholeCamera<gtsam::Cal3DS2>{pose, cal3ds2_};
-        return camera.project(P_, H) - p_;
+        auto camera = gtsam::PinholePose<CALIBRATION>{pose, cal_};
+        return camera.project2(P_, H) - p_;
       }
     };
 
-    gtsam::Pose3 to_pose3(const tf2::Transform &transform)
+    // All the corners seen from one camera pose in a single factor. The corners are projected
+    // together by project_batch() instead of through one PinholeCamera each. Every corner has its
+    // own square root information so the factor whitens its own error and has a unit noise model.
+    class BatchResectioningFactor : public gtsam::NoiseModelFactor1<gtsam::Pose3>
     {
-      auto q = transform.getRotation();
-      auto t = transform.getOrigin();
-      return gtsam::Pose3{gtsam::Rot3{q.w(), q.x(), q.y(), q.z()},
-                          gtsam::Vector3{t.x(), t.y(), t.z()}};
-    }
+      const BatchCalibration cal_;
+      PointBatch corners_f_world_{};
+      std::vector<double> corners_f_image_{};                  // u0, v0, u1, v1, ...
+      std::vector<std::array<double, 4>> sqrt_informations_{};
+      mutable ProjectionBatch projections_{};
 
-    gtsam::Matrix6 to_cov_sam(const TransformWithCovariance::cov_type cov)
-    {
-      gtsam::Matrix6 cov_sam;
-      for (int r = 0; r < 6; r += 1) {
-        for (int c = 0; c < 6; c += 1) {
-          static int ro[] = {3, 4, 5, 0, 1, 2};
-          cov_sam(ro[r], ro[c]) = cov[r * 6 + c];
-        }
+    public:
+      BatchResectioningFactor(const gtsam::Key key, const BatchCalibration &cal) :
+        NoiseModelFactor1<gtsam::Pose3>(gtsam::noiseModel::Unit::Create(2), key),
+        cal_{cal}
+      {}
+
+      void clear()
+      {
+        corners_f_world_.clear();
+        corners_f_image_.clear();
+        sqrt_informations_.clear();
       }
-      return cov_sam;
-    }
 
-    TransformWithCovariance::cov_type to_cov_type(const gtsam::Pose3 &sam_pose, const gtsam::Matrix6 &cov_sam)
-    {
-      // Try to rotate the position part of the covariance
-//      gtsam::Matrix6 rot6{};
-//      rot6.setZero();
-//      gtsam::Matrix3 rot3 = sam_pose.rotation().matrix();
-//      for (int r = 0; r < 3; r += 1) {
-//        for (int c = 0; c < 3; c += 1) {
-//          rot6(r, c) = rot3(r, c);
-//          rot6(r + 3, c + 3) = rot3(r, c);
-//        }
-//      }
-//      gtsam::Matrix6 cov_sam_r = rot6 * cov_sam * rot6.transpose();
+      void add(const gtsam::Point2 &corner_f_image, const gtsam::Point3 &corner_f_world,
+               const std::array<double, 4> &sqrt_information)
+      {
+        corners_f_world_.add(corner_f_world.x(), corner_f_world.y(), corner_f_world.z());
+        corners_f_image_.emplace_back(corner_f_image.x());
+        corners_f_image_.emplace_back(corner_f_image.y());
+        sqrt_informations_.emplace_back(sqrt_information);
+      }
 
-      // Convert covariance
-      TransformWithCovariance::cov_type cov;
-      for (int r = 0; r < 6; r += 1) {
-        for (int c = 0; c < 6; c += 1) {
-          static int ro[] = {3, 4, 5, 0, 1, 2};
-          cov[r * 6 + c] = cov_sam(ro[r], ro[c]);
+      // Called after the corners have been added.
+      void finish_load()
+      {
+        auto dim = corners_f_image_.size();
+        if (noiseModel_->dim() != dim) {
+          noiseModel_ = gtsam::noiseModel::Unit::Create(dim);
         }
       }
-      return cov;
-    }
 
-    TransformWithCovariance to_transform_with_covariance(const gtsam::Pose3 &sam_pose, const gtsam::Matrix6 &sam_cov)
-    {
-      auto q1 = sam_pose.rotation().toQuaternion().coeffs();
-      auto &t = sam_pose.translation();
-      return TransformWithCovariance{
-        tf2::Transform{tf2::Quaternion{q1[0], q1[1], q1[2], q1[3]},
-                       tf2::Vector3{t.x(), t.y(), t.z()}},
-        to_cov_type(sam_pose, sam_cov)};
-    }
+      gtsam::Vector evaluateError(const gtsam::Pose3 &pose,
+                                  boost::optional<gtsam::Matrix &> H) const override
+      {
+        project_batch(to_batch_pose(pose), cal_, corners_f_world_, projections_, static_cast<bool>(H));
+        if (projections_.behind_count_ > 0) {
+          throw gtsam::CheiralityException();
+        }
 
-    TransformWithCovariance extract_transform_with_covariance(gtsam::NonlinearFactorGraph &graph,
-                                                              const gtsam::Values &result,
-                                                              gtsam::Key key)
-    {
-      gtsam::Marginals marginals(graph, result);
-      return to_transform_with_covariance(result.at<gtsam::Pose3>(key),
-                                          marginals.marginalCovariance(key));
-    }
+        auto n = corners_f_world_.size();
+        gtsam::Vector error(2 * n);
+        if (H) {
+          H->resize(2 * n, 6);
+        }
+        for (size_t i = 0; i < n; i += 1) {
+          auto &r = sqrt_informations_[i];
+          auto eu = projections_.u_[i] - corners_f_image_[2 * i];
+          auto ev = projections_.v_[i] - corners_f_image_[2 * i + 1];
+          error(2 * i) = r[0] * eu + r[1] * ev;
+          error(2 * i + 1) = r[2] * eu + r[3] * ev;
+          if (H) {
+            for (int c = 0; c < 6; c += 1) {
+              auto hu = projections_.h_[c][i];
+              auto hv = projections_.h_[6 + c][i];
+              (*H)(2 * i, c) = r[0] * hu + r[1] * hv;
+              (*H)(2 * i + 1, c) = r[2] * hu + r[3] * hv;
+            }
+          }
+        }
+        return error;
+      }
+    };
 
-    TransformWithCovariance solve_camera_f_marker(
-      const Observation &observation,
-      double marker_length)
+    // Same as gtsam::BetweenFactor<gtsam::Pose3>
+    class PoseBetweenFactor : public gtsam::NoiseModelFactor2<gtsam::Pose3, gtsam::Pose3>
     {
-      // 1. Allocate the graph and initial estimate
-      gtsam::NonlinearFactorGraph graph{};
-      gtsam::Values initial{};
+      gtsam::Pose3 measured_;
 
-      // 2. add factors to the graph
-      std::vector<cv::Point3d> corners_f_marker{};
-      std::vector<cv::Point2f> corners_f_image{};
+    public:
+      PoseBetweenFactor(const gtsam::SharedNoiseModel &model,
+                        const gtsam::Key key1,
+                        const gtsam::Key key2,
+                        gtsam::Pose3 measured) :
+        NoiseModelFactor2<gtsam::Pose3, gtsam::Pose3>(model, key1, key2),
+        measured_(std::move(measured))
+      {}
 
-      cv_.append_corners_f_marker(marker_length, corners_f_marker);
-      cv_.append_corners_f_image(observation, corners_f_image);
+      void update(const gtsam::SharedNoiseModel &model, const gtsam::Pose3 &measured)
+      {
+        noiseModel_ = model;
+        measured_ = measured;
+      }
 
-      for (size_t j = 0; j < corners_f_image.size(); j += 1) {
-        gtsam::Point2 corner_f_image{corners_f_image[j].x, corners_f_image[j].y};
-        gtsam::Point3 corner_f_marker{corners_f_marker[j].x, corners_f_marker[j].y, corners_f_marker[j].z};
-        graph.emplace_shared<ResectioningFactor>(corner_measurement_noise_, camera_key_,
-                                                 cal3ds2_,
-                                                 corner_f_image,
-                                                 corner_f_marker);
+      gtsam::Vector evaluateError(const gtsam::Pose3 &p1, const gtsam::Pose3 &p2,
+                                  boost::optional<gtsam::Matrix &> H1,
+                                  boost::optional<gtsam::Matrix &> H2) const override
+      {
+        auto hx = p1.between(p2, H1, H2);
+        return measured_.localCoordinates(hx);
       }
+    };
 
-      // 3. Add the initial estimate for the camera pose in the marker frame
-      auto cv_t_camera_marker = cv_.solve_t_camera_marker(observation, marker_length);
-      auto camera_f_marker_initial = to_pose3(cv_t_camera_marker.transform().inverse());
-      initial.insert(camera_key_, camera_f_marker_initial);
+    // Same as gtsam::PriorFactor<gtsam::Pose3>
+    class PosePriorFactor : public gtsam::NoiseModelFactor1<gtsam::Pose3>
+    {
+      gtsam::Pose3 prior_;
 
-      // 4. Optimize the graph using Levenberg-Marquardt
-      auto result = gtsam::LevenbergMarquardtOptimizer(graph, initial).optimize();
+    public:
+      PosePriorFactor(const gtsam::SharedNoiseModel &model,
+                      const gtsam::Key key,
+                      gtsam::Pose3 prior) :
+        NoiseModelFactor1<gtsam::Pose3>(model, key),
+        prior_(std::move(prior))
+      {}
 
-      // 5. Extract the result
-      return extract_transform_with_covariance(graph, result, camera_key_);
-    }
+      void update(const gtsam::SharedNoiseModel &model, const gtsam::Pose3 &prior)
+      {
+        noiseModel_ = model;
+        prior_ = prior;
+      }
 
-  public:
-    explicit SamFiducialMath(CvFiducialMath &cv, double corner_measurement_sigma) :
-      cv_{cv}, cal3ds2_{
-      cv.ci_.cv()->camera_matrix().at<double>(0, 0),  // fx
-      cv.ci_.cv()->camera_matrix().at<double>(1, 1),  // fy
-      1.0, // s
-      cv.ci_.cv()->camera_matrix().at<double>(0, 2),  // u0
-      cv.ci_.cv()->camera_matrix().at<double>(1, 2),  // v0
-      cv.ci_.cv()->dist_coeffs().at<double>(0), // k1
-      cv.ci_.cv()->dist_coeffs().at<double>(1), // k2
-      cv.ci_.cv()->dist_coeffs().at<double>(2), // p1
-      cv.ci_.cv()->dist_coeffs().at<double>(3)},// p2
-      corner_measurement_noise_{gtsam::noiseModel::Diagonal::Sigmas(
-        gtsam::Vector2(corner_measurement_sigma, corner_measurement_sigma))}
-    {}
+      gtsam::Vector evaluateError(const gtsam::Pose3 &x,
+                                  boost::optional<gtsam::Matrix &> H) const override
+      {
+        if (H) {
+          (*H) = gtsam::Matrix::Identity(6, 6);
+        }
+        return prior_.localCoordinates(x);
+      }
+    };
 
-    TransformWithCovariance solve_t_map_camera_sfm(const Observations &observations,
+    // A graph, its initial values, and its elimination ordering. The topology of the graph depends only
+    // on which markers are visible, so a template is built the first time a set of markers is seen
+    // and its factors and values are updated in place after that. Reusing the ordering skips the
+    // symbolic analysis that the optimizer and marginals would otherwise do on every call.
+    struct GraphTemplate
+    {
+      gtsam::NonlinearFactorGraph graph_{};
+      gtsam::Values initial_{};
+      gtsam::Ordering ordering_{};
+      std::vector<boost::shared_ptr<ResectioningFactorBase>> resectioning_factors_{};
+      std::vector<boost::shared_ptr<BatchResectioningFactor>> batch_factors_{};
+      std::vector<boost::shared_ptr<PoseBetweenFactor>> between_factors_{};
+      std::vector<boost::shared_ptr<PosePriorFactor>> prior_factors_{};
+
+      // Update the next factor of a kind or add it if this is the first time the template is loaded.
+      void set_resectioning_factor(size_t &i, SamFiducialMath &sam, gtsam::Key key,
+                                   const gtsam::SharedNoiseModel &model,
+                                   const gtsam::Point2 &corner_f_image, const gtsam::Point3 &corner_f_world)
+      {
+        if (i < resectioning_factors_.size()) {
+          resectioning_factors_[i]->update(model, corner_f_image, corner_f_world);
+        } else {
+          auto factor = sam.make_resectioning_factor(key, model, corner_f_image, corner_f_world);
+          graph_.push_back(factor);
+          resectioning_factors_.emplace_back(factor);
+        }
+        i += 1;
+      }
+
+      // The next batch factor, emptied and ready for its corners.
+      BatchResectioningFactor &next_batch_factor(size_t &i, gtsam::Key key, const BatchCalibration &cal)
+      {
+        if (i >= batch_factors_.size()) {
+          auto factor = boost::make_shared<BatchResectioningFactor>(key, cal);
+          graph_.push_back(factor);
+          batch_factors_.emplace_back(factor);
+        }
+        auto &factor = *batch_factors_[i];
+        factor.clear();
+        i += 1;
+        return factor;
+      }
+
+      void set_between_factor(size_t &i, gtsam::Key key1, gtsam::Key key2,
+                              const gtsam::SharedNoiseModel &model, const gtsam::Pose3 &measured)
+      {
+        if (i < between_factors_.size()) {
+          between_factors_[i]->update(model, measured);
+        } else {
+          auto factor = boost::make_shared<PoseBetweenFactor>(model, key1, key2, measured);
+          graph_.push_back(factor);
+          between_factors_.emplace_back(factor);
+        }
+        i += 1;
+      }
+
+      void set_prior_factor(size_t &i, gtsam::Key key,
+                            const gtsam::SharedNoiseModel &model, const gtsam::Pose3 &prior)
+      {
+        if (i < prior_factors_.size()) {
+          prior_factors_[i]->update(model, prior);
+        } else {
+          auto factor = boost::make_shared<PosePriorFactor>(model, key, prior);
+          graph_.push_back(factor);
+          prior_factors_.emplace_back(factor);
+        }
+        i += 1;
+      }
+
+      void set_initial(gtsam::Key key, const gtsam::Pose3 &pose)
+      {
+        if (initial_.exists(key)) {
+          initial_.update(key, pose);
+        } else {
+          initial_.insert(key, pose);
+        }
+      }
+
+      // Called after the factors have been loaded.
+      void finish_load()
+      {
+        if (ordering_.empty()) {
+          ordering_ = gtsam::Ordering::Colamd(graph_);
+        }
+      }
+
+      // max_iterations > 0 => cap the number of iterations
+      gtsam::Values optimize(int max_iterations = 0) const
+      {
+        gtsam::LevenbergMarquardtParams params{};
+        params.setOrdering(ordering_);
+        if (max_iterations > 0) {
+          params.setMaxIterations(max_iterations);
+        }
+        return gtsam::LevenbergMarquardtOptimizer(graph_, initial_, params).optimize();
+      }
+
+      gtsam::Values gauss_newton_step() const
+      {
+        gtsam::GaussNewtonParams params{};
+        params.setOrdering(ordering_);
+        params.setMaxIterations(1);
+        return gtsam::GaussNewtonOptimizer(graph_, initial_, params).optimize();
+      }
+
+      gtsam::Marginals marginals(const gtsam::Values &result) const
+      {
+        return gtsam::Marginals(graph_, result, gtsam::Marginals::CHOLESKY, ordering_);
+      }
+    };
+
+    // The templates for solve_t_map_camera and update_map. These are only used from the
+    // thread that calls into FiducialMath.
+    enum class GraphKind : std::uint64_t
+    {
+      markers = 0,
+      corners = 1,
+      robust = 2,
+      refresh = 3,
+      rig = 4,
+    };
+    // When there are too many, the least recently used template is dropped.
+    struct GraphTemplateEntry
+    {
+      std::unique_ptr<GraphTemplate> graph_template_;
+      std::list<const std::vector<std::uint64_t> *>::iterator lru_pos_;
+    };
+    static constexpr size_t max_graph_templates_ = 64;
+    std::map<std::vector<std::uint64_t>, GraphTemplateEntry> graph_templates_{};
+    std::list<const std::vector<std::uint64_t> *> graph_templates_lru_{};   // Most recent first
+
+    // The templates for solve_camera_f_marker. These graphs all have the same topology. The
+    // measurements are solved concurrently so each thread borrows a template from the pool.
+    std::mutex marker_templates_mutex_{};
+    std::vector<std::unique_ptr<GraphTemplate>> marker_templates_{};
+
+    // The noise models of the known marker priors. A model is rebuilt only when the marker's
+    // covariance changes. Like the graph templates, these are only used from the calling thread.
+    std::map<int, std::pair<TransformWithCovariance::cov_type, gtsam::SharedNoiseModel>> marker_prior_noises_{};
+
+    // The Huber model of the robust solve and the k it was built for.
+    double robust_noise_k_{0.};
+    gtsam::SharedNoiseModel robust_noise_{};
+
+    const gtsam::SharedNoiseModel &marker_prior_noise(const Marker &marker)
+    {
+      auto &cov = marker.t_map_marker().cov();
+      auto &entry = marker_prior_noises_[marker.id()];
+      if (!entry.second || entry.first != cov) {
+        entry.first = cov;
+        entry.second = gtsam::noiseModel::Gaussian::Covariance(to_cov_sam(cov));
+      }
+      return entry.second;
+    }
+
+    const gtsam::SharedNoiseModel &robust_noise(double huber_k)
+    {
+      if (!robust_noise_ || robust_noise_k_ != huber_k) {
+        robust_noise_k_ = huber_k;
+        robust_noise_ = gtsam::noiseModel::Robust::Create(
+          gtsam::noiseModel::mEstimator::Huber::Create(huber_k),
+          corner_measurement_noise_);
+      }
+      return robust_noise_;
+    }
+
+    GraphTemplate &find_graph_template(const std::vector<std::uint64_t> &topology)
+    {
+      auto it = graph_templates_.find(topology);
+      if (it != graph_templates_.end()) {
+        graph_templates_lru_.splice(graph_templates_lru_.begin(), graph_templates_lru_, it->second.lru_pos_);
+        return *it->second.graph_template_;
+      }
+
+      // Drop the least recently used template if too many different sets of markers have been seen.
+      if (graph_templates_.size() >= max_graph_templates_) {
+        auto lru_it = graph_templates_.find(*graph_templates_lru_.back());
+        graph_templates_lru_.pop_back();
+        graph_templates_.erase(lru_it);
+      }
+      it = graph_templates_.emplace(topology, GraphTemplateEntry{std::make_unique<GraphTemplate>(), {}}).first;
+      graph_templates_lru_.emplace_front(&it->first);
+      it->second.lru_pos_ = graph_templates_lru_.begin();
+      return *it->second.graph_template_;
+    }
+
+    std::unique_ptr<GraphTemplate> borrow_marker_template()
+    {
+      std::lock_guard<std::mutex> lock{marker_templates_mutex_};
+      if (marker_templates_.empty()) {
+        return std::make_unique<GraphTemplate>();
+      }
+      auto graph_template = std::move(marker_templates_.back());
+      marker_templates_.pop_back();
+      return graph_template;
+    }
+
+    void return_marker_template(std::unique_ptr<GraphTemplate> graph_template)
+    {
+      std::lock_guard<std::mutex> lock{marker_templates_mutex_};
+      marker_templates_.emplace_back(std::move(graph_template));
+    }
+
+    // Make a resectioning factor that uses the cheapest camera model that describes the camera.
+    // A pinhole camera (rectified images) does not need the distortion calculations of Cal3DS2.
+    boost::shared_ptr<ResectioningFactorBase> make_resectioning_factor(gtsam::Key key,
+                                                                       const gtsam::SharedNoiseModel &noise_model,
+                                                                       const gtsam::Point2 &corner_f_image,
+                                                                       const gtsam::Point3 &corner_f_world)
+    {
+      if (is_pinhole_) {
+        return boost::make_shared<ResectioningFactor<gtsam::Cal3_S2>>(noise_model, key,
+                                                                      cv_.ci_.sam()->cal3_s2_ptr(),
+                                                                      corner_f_image,
+                                                                      corner_f_world);
+      }
+      return boost::make_shared<ResectioningFactor<gtsam::Cal3DS2>>(noise_model, key,
+                                                                    cv_.ci_.sam()->cal3ds2_ptr(),
+                                                                    corner_f_image,
+                                                                    corner_f_world);
+    }
+
+    void add_resectioning_factor(gtsam::NonlinearFactorGraph &graph,
+                                 gtsam::Key key,
+                                 const gtsam::Point2 &corner_f_image,
+                                 const gtsam::Point3 &corner_f_world)
+    {
+      graph.push_back(make_resectioning_factor(key, corner_measurement_noise_, corner_f_image, corner_f_world));
+    }
+
+    TransformWithCovariance to_transform_with_covariance(const gtsam::Pose3 &sam_pose, const gtsam::Matrix6 &sam_cov)
+    {
+      return TransformWithCovariance{to_tf2_transform(sam_pose), to_cov_type(sam_cov)};
+    }
+
+    TransformWithCovariance extract_transform_with_covariance(gtsam::NonlinearFactorGraph &graph,
+                                                              const gtsam::Values &result,
+                                                              gtsam::Key key)
+    {
+      gtsam::Marginals marginals(graph, result);
+      return extract_transform_with_covariance(marginals, result, key);
+    }
+
+    TransformWithCovariance extract_transform_with_covariance(const gtsam::Marginals &marginals,
+                                                              const gtsam::Values &result,
+                                                              gtsam::Key key)
+    {
+      return to_transform_with_covariance(result.at<gtsam::Pose3>(key),
+                                          marginals.marginalCovariance(key));
+    }
+
+    // The covariance of a corner measurement when the location of the corner in the map is uncertain.
+    // The corner covariance is projected into the image and added to the corner measurement noise.
+    gtsam::Matrix2 projected_corner_cov(const gtsam::Pose3 &camera_f_map,
+                                        const gtsam::Point3 &corner_f_map,
+                                        const gtsam::Matrix3 &corner_cov)
+    {
+      gtsam::Matrix23 H_point;
+      if (is_pinhole_) {
+        gtsam::PinholePose<gtsam::Cal3_S2>{camera_f_map, cv_.ci_.sam()->cal3_s2_ptr()}
+          .project2(corner_f_map, boost::none, H_point);
+      } else {
+        gtsam::PinholePose<gtsam::Cal3DS2>{camera_f_map, cv_.ci_.sam()->cal3ds2_ptr()}
+          .project2(corner_f_map, boost::none, H_point);
+      }
+      return H_point * corner_cov * H_point.transpose() +
+             gtsam::Matrix2::Identity() * corner_measurement_sigma_ * corner_measurement_sigma_;
+    }
+
+    // The map frame covariance of corner j of a marker. It comes from the marker's corners if
+    // it has them and from the marker's pose covariance otherwise.
+    gtsam::Matrix3 corner_f_map_cov(const Marker &marker, size_t j, double marker_length)
+    {
+      if (marker.has_corners()) {
+        return to_corner_cov_sam(marker.corners_f_map()[j].cov());
+      }
+
+      std::vector<cv::Point3d> corners_f_marker{};
+      cv_.append_corners_f_marker(marker_length, corners_f_marker);
+      gtsam::Matrix36 H_pose;
+      to_pose3(marker.t_map_marker().transform()).transformFrom(
+        gtsam::Point3{corners_f_marker[j].x, corners_f_marker[j].y, corners_f_marker[j].z}, H_pose);
+      return H_pose * to_cov_sam(marker.t_map_marker().cov()) * H_pose.transpose();
+    }
+
+    // A noise model like noise_model, which may be robust, but with this covariance.
+    static gtsam::SharedNoiseModel with_covariance(const gtsam::SharedNoiseModel &noise_model,
+                                                   const gtsam::Matrix2 &cov)
+    {
+      auto gaussian = gtsam::noiseModel::Gaussian::Covariance(cov);
+      auto robust = boost::dynamic_pointer_cast<gtsam::noiseModel::Robust>(noise_model);
+      if (!robust) {
+        return gaussian;
+      }
+      return gtsam::noiseModel::Robust::Create(robust->robust(), gaussian);
+    }
+
+    static gtsam::Matrix3 to_corner_cov_sam(const PointWithCovariance::cov_type &cov)
+    {
+      gtsam::Matrix3 cov_sam;
+      for (int r = 0; r < 3; r += 1) {
+        for (int c = 0; c < 3; c += 1) {
+          cov_sam(r, c) = cov[r * 3 + c];
+        }
+      }
+      return cov_sam;
+    }
+
+    TransformWithCovariance solve_camera_f_marker(
+      const Observation &observation,
+      double marker_length)
+    {
+      // 1. Borrow a graph template. They all have the same single factor for the four corners.
+      auto graph_template = borrow_marker_template();
+
+      // 2. add or update the factors in the graph
+      std::vector<cv::Point3d> corners_f_marker{};
+      std::vector<cv::Point2f> corners_f_image{};
+
+      cv_.append_corners_f_marker(marker_length, corners_f_marker);
+      cv_.append_corners_f_image(observation, corners_f_image);
+
+      size_t batch_idx = 0;
+      auto &batch_factor = graph_template->next_batch_factor(batch_idx, camera_key_, batch_cal_);
+      for (size_t j = 0; j < corners_f_image.size(); j += 1) {
+        gtsam::Point2 corner_f_image{corners_f_image[j].x, corners_f_image[j].y};
+        gtsam::Point3 corner_f_marker{corners_f_marker[j].x, corners_f_marker[j].y, corners_f_marker[j].z};
+        batch_factor.add(corner_f_image, corner_f_marker, corner_sqrt_information_);
+      }
+      batch_factor.finish_load();
+
+      // 3. Add the initial estimate for the camera pose in the marker frame
+      auto cv_t_camera_marker = cv_.solve_t_camera_marker(observation, marker_length);
+      auto camera_f_marker_initial = to_pose3(cv_t_camera_marker.transform().inverse());
+      graph_template->set_initial(camera_key_, camera_f_marker_initial);
+      graph_template->finish_load();
+
+      // 4. Optimize the graph using Levenberg-Marquardt
+      auto result = graph_template->optimize();
+
+      // 5. Extract the result
+      auto camera_f_marker = extract_transform_with_covariance(graph_template->marginals(result), result, camera_key_);
+      return_marker_template(std::move(graph_template));
+      return camera_f_marker;
+    }
+
+  public:
+    explicit SamFiducialMath(CvFiducialMath &cv, double corner_measurement_sigma) :
+      cv_{cv},
+      is_pinhole_{cv.ci_.is_pinhole()},
+      corner_measurement_sigma_{corner_measurement_sigma},
+      corner_measurement_noise_{gtsam::noiseModel::Diagonal::Sigmas(
+        gtsam::Vector2(corner_measurement_sigma, corner_measurement_sigma))},
+      constrained_noise_{gtsam::noiseModel::Constrained::MixedSigmas(gtsam::Z_6x1)},
+      batch_cal_{to_batch_calibration(cv.ci_, is_pinhole_)},
+      corner_sqrt_information_{1. / corner_measurement_sigma, 0., 0., 1. / corner_measurement_sigma}
+    {}
+
+    TransformWithCovariance solve_t_map_camera_sfm(const Observations &observations,
                                                    Map &map)
     {
       auto t_map_markers = map.find_t_map_markers(observations);
@@ -578,10 +1405,7 @@ namespace fiducial_vlam
           for (size_t j = 0; j < corners_f_image.size(); j += 1) {
             gtsam::Point2 corner_f_image{corners_f_image[j].x, corners_f_image[j].y};
             gtsam::Point3 corner_f_map{corners_f_map[j].x, corners_f_map[j].y, corners_f_map[j].z};
-            graph.emplace_shared<ResectioningFactor>(corner_measurement_noise_, camera_key_,
-                                                     cal3ds2_,
-                                                     corner_f_image,
-                                                     corner_f_map);
+            add_resectioning_factor(graph, camera_key_, corner_f_image, corner_f_map);
           }
         }
       }
@@ -598,18 +1422,101 @@ namespace fiducial_vlam
       return extract_transform_with_covariance(graph, result, camera_key_);
     }
 
-    void load_graph_from_observations(const TransformWithCovariance &t_map_camera,
-                                      const Observations &observations,
-                                      Map &map,
-                                      gtsam::Key camera_key, bool add_unknown_markers,
-                                      gtsam::NonlinearFactorGraph &graph, gtsam::Values &initial)
+    // Solve for camera_f_marker for each observation that will be added to the graph. The first
+    // measurement is solved on this thread and the rest on the scheduler. The entries for
+    // observations that are skipped are left invalid. A map update is not as urgent as a pose.
+    std::vector<TransformWithCovariance> solve_camera_f_markers(const Observations &observations,
+                                                                Map &map,
+                                                                bool add_unknown_markers)
     {
-      // 1. clear the graph and initial estimate
-      graph.resize(0);
-      initial.clear();
+      auto &scheduler = TaskScheduler::instance();
+      auto priority = add_unknown_markers ? TaskPriority::normal : TaskPriority::pose;
+      std::vector<TransformWithCovariance> camera_f_markers(observations.size());
+      std::vector<std::pair<size_t, std::future<TransformWithCovariance>>> futures{};
+      bool first = true;
 
-      // 2. add measurement factors, known marker priors, and marker initial estimates to the graph
-      for (auto &observation : observations.observations()) {
+      for (size_t i = 0; i < observations.size(); i += 1) {
+        auto &observation = observations.observations()[i];
+        if (!add_unknown_markers && map.find_marker(observation.id()) == nullptr) {
+          continue;
+        }
+
+        if (first) {
+          first = false;
+          continue;
+        }
+
+        futures.emplace_back(i, scheduler.submit(priority,
+                                                 [this, &observation, marker_length = map.marker_length()]()
+                                                 {
+                                                   return solve_camera_f_marker(observation, marker_length);
+                                                 }));
+      }
+
+      // Solve the first measurement while the workers solve the rest.
+      for (size_t i = 0; i < observations.size(); i += 1) {
+        auto &observation = observations.observations()[i];
+        if (add_unknown_markers || map.find_marker(observation.id()) != nullptr) {
+          camera_f_markers[i] = solve_camera_f_marker(observation, map.marker_length());
+          break;
+        }
+      }
+
+      for (auto &future : futures) {
+        camera_f_markers[future.first] = scheduler.wait(future.second, priority);
+      }
+
+      return camera_f_markers;
+    }
+
+    GraphTemplate &load_graph_from_observations(const TransformWithCovariance &t_map_camera,
+                                                const Observations &observations,
+                                                Map &map,
+                                                gtsam::Key camera_key, bool add_unknown_markers)
+    {
+      // 1. solve for the measurements. Each measurement is independent of the others so they
+      // can be solved concurrently. The results are kept in observation order so the factors are
+      // always added to the graph in the same order.
+      auto camera_f_markers = solve_camera_f_markers(observations, map, add_unknown_markers);
+
+      return load_graph_from_measurements(GraphKind::markers, t_map_camera, observations, camera_f_markers,
+                                          map, camera_key, add_unknown_markers);
+    }
+
+    // camera_f_markers has a measurement for each observation that goes into the graph. A marker
+    // can be observed more than once. Each observation gets a between factor but the marker
+    // only gets one prior.
+    GraphTemplate &load_graph_from_measurements(GraphKind kind,
+                                                const TransformWithCovariance &t_map_camera,
+                                                const Observations &observations,
+                                                const std::vector<TransformWithCovariance> &camera_f_markers,
+                                                Map &map,
+                                                gtsam::Key camera_key, bool add_unknown_markers)
+    {
+      // 2. find the graph template for this set of markers. The topology depends on which markers
+      // are in the graph and which of those are known, not on the order they were detected in.
+      // The factors are loaded in marker id order so a slot of a template always has the same keys.
+      std::vector<size_t> order(observations.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&observations](size_t a, size_t b) -> bool
+      { return observations.observations()[a].id() < observations.observations()[b].id(); });
+
+      std::vector<std::uint64_t> topology{static_cast<std::uint64_t>(kind), camera_key};
+      for (auto i : order) {
+        auto &observation = observations.observations()[i];
+        bool known = map.find_marker(observation.id()) != nullptr;
+        if (known || add_unknown_markers) {
+          topology.emplace_back(static_cast<std::uint64_t>(observation.id()) * 2 + (known ? 1 : 0));
+        }
+      }
+      auto &graph_template = find_graph_template(topology);
+      size_t between_idx = 0;
+      size_t prior_idx = 0;
+      std::vector<int> prior_ids{};
+
+      // 3. add or update measurement factors, known marker priors, and marker initial estimates
+      for (auto i : order) {
+        auto &observation = observations.observations()[i];
         gtsam::Symbol marker_key{'m', static_cast<std::uint64_t>(observation.id())};
 
         // See if this is a known marker by looking it up in the map.
@@ -619,15 +1526,21 @@ namespace fiducial_vlam
         if (marker_ptr != nullptr) {
 
           // Get the measurement
-          auto camera_f_marker = solve_camera_f_marker(observation, map.marker_length());
+          auto &camera_f_marker = camera_f_markers[i];
 
           // Add the between factor for this measurement
           auto cov = to_cov_sam(camera_f_marker.cov());
-          graph.emplace_shared<gtsam::BetweenFactor<gtsam::Pose3>>(
-            marker_key,
-            camera_key,
-            to_pose3(camera_f_marker.transform()),
-            gtsam::noiseModel::Gaussian::Covariance(cov));
+          graph_template.set_between_factor(between_idx,
+                                            marker_key,
+                                            camera_key,
+                                            gtsam::noiseModel::Gaussian::Covariance(cov),
+                                            to_pose3(camera_f_marker.transform()));
+
+          // The marker has its prior from an earlier observation.
+          if (std::find(prior_ids.begin(), prior_ids.end(), observation.id()) != prior_ids.end()) {
+            continue;
+          }
+          prior_ids.emplace_back(observation.id());
 
           // Get the pose and covariance from the marker.
           auto known_marker_f_map = to_pose3(marker_ptr->t_map_marker().transform());
@@ -644,19 +1557,20 @@ namespace fiducial_vlam
                                  map.map_style() == Map::MapStyles::pose ||
                                  known_marker_cov(0, 0) == 0.0;
 
-          // Create the appropriate marker pose prior noise model.
-          auto known_noise_model = use_constrained ?
-                                   gtsam::noiseModel::Constrained::MixedSigmas(gtsam::Z_6x1) :
-                                   gtsam::noiseModel::Gaussian::Covariance(known_marker_cov);
+          // Find the appropriate marker pose prior noise model.
+          auto &known_noise_model = use_constrained ?
+                                    constrained_noise_ :
+                                    marker_prior_noise(*marker_ptr);
 
           // Add the prior for the known marker.
-          graph.emplace_shared<gtsam::PriorFactor<gtsam::Pose3> >(marker_key,
-                                                                  known_marker_f_map,
-                                                                  known_noise_model);
+          graph_template.set_prior_factor(prior_idx,
+                                          marker_key,
+                                          known_noise_model,
+                                          known_marker_f_map);
 
           // Add the initial estimate for the known marker.
-          initial.insert(marker_key,
-                         known_marker_f_map);
+          graph_template.set_initial(marker_key,
+                                     known_marker_f_map);
         }
 
         // If this is an unknown marker, then add the measurement and just add the initial estimate.
@@ -664,24 +1578,475 @@ namespace fiducial_vlam
         if (marker_ptr == nullptr && add_unknown_markers) {
 
           // Get the measurement
-          auto camera_f_marker = solve_camera_f_marker(observation, map.marker_length());
+          auto &camera_f_marker = camera_f_markers[i];
 
           // Add the between factor for this measurement
           auto cov = to_cov_sam(camera_f_marker.cov());
-          graph.emplace_shared<gtsam::BetweenFactor<gtsam::Pose3>>(
-            marker_key,
-            camera_key,
-            to_pose3(camera_f_marker.transform()),
-            gtsam::noiseModel::Gaussian::Covariance(cov));
+          graph_template.set_between_factor(between_idx,
+                                            marker_key,
+                                            camera_key,
+                                            gtsam::noiseModel::Gaussian::Covariance(cov),
+                                            to_pose3(camera_f_marker.transform()));
 
           auto unknown_marker_f_map = t_map_camera.transform() * camera_f_marker.transform().inverse();
-          initial.insert(marker_key,
-                         to_pose3(unknown_marker_f_map));
+          graph_template.set_initial(marker_key,
+                                     to_pose3(unknown_marker_f_map));
         }
       }
 
       // Add the camera initial value.
-      initial.insert(camera_key, to_pose3(t_map_camera.transform()));
+      graph_template.set_initial(camera_key, to_pose3(t_map_camera.transform()));
+      graph_template.finish_load();
+      return graph_template;
+    }
+
+    // Solve against the corner points stored in the map. There is no need to transform the marker
+    // poses into corners or to build the marker pose priors and between factors.
+    TransformWithCovariance solve_t_map_camera_corners(const TransformWithCovariance &cv_t_map_camera,
+                                                       const Observations &observations,
+                                                       Map &map)
+    {
+      // 1. Find the graph template for the known markers in this set of observations
+      std::vector<std::uint64_t> topology{static_cast<std::uint64_t>(GraphKind::corners), camera_key_};
+      for (auto &observation : observations.observations()) {
+        if (map.find_marker(observation.id()) != nullptr) {
+          topology.emplace_back(static_cast<std::uint64_t>(observation.id()));
+        }
+      }
+      // Every factor is on the camera pose, so the order the markers are loaded in doesn't matter.
+      std::sort(topology.begin() + 2, topology.end());
+      auto &graph_template = find_graph_template(topology);
+      size_t batch_idx = 0;
+      auto &batch_factor = graph_template.next_batch_factor(batch_idx, camera_key_, batch_cal_);
+      auto camera_f_map_initial = to_pose3(cv_t_map_camera.transform());
+
+      // 2. add or update the factors in the graph
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr == nullptr) {
+          continue;
+        }
+
+        std::vector<cv::Point3d> corners_f_map{};
+        std::vector<cv::Point2f> corners_f_image{};
+
+        cv_.append_corners_f_map(*marker_ptr, map.marker_length(), corners_f_map);
+        cv_.append_corners_f_image(observation, corners_f_image);
+
+        for (size_t j = 0; j < corners_f_image.size(); j += 1) {
+          gtsam::Point2 corner_f_image{corners_f_image[j].x, corners_f_image[j].y};
+          gtsam::Point3 corner_f_map{corners_f_map[j].x, corners_f_map[j].y, corners_f_map[j].z};
+
+          // Markers without corners or with exactly known corners just use the measurement noise.
+          auto corner_cov = marker_ptr->has_corners() ?
+                            to_corner_cov_sam(marker_ptr->corners_f_map()[j].cov()) :
+                            gtsam::Matrix3::Zero().eval();
+          auto sqrt_information = corner_cov.isZero() ?
+                                  corner_sqrt_information_ :
+                                  to_sqrt_information(
+                                    projected_corner_cov(camera_f_map_initial, corner_f_map, corner_cov));
+
+          batch_factor.add(corner_f_image, corner_f_map, sqrt_information);
+        }
+      }
+      batch_factor.finish_load();
+
+      // 3. Add the initial estimate for the camera pose
+      graph_template.set_initial(camera_key_, camera_f_map_initial);
+      graph_template.finish_load();
+
+      // 4. Optimize the graph using Levenberg-Marquardt
+      auto result = graph_template.optimize();
+
+      // 5. Extract the result
+      return extract_transform_with_covariance(graph_template.marginals(result), result, camera_key_);
+    }
+
+    // Load a graph with every corner of every known marker. All the corners use the same noise model.
+    // A null noise model => the corner measurement noise in one batch factor. Otherwise there is a
+    // factor for each corner so a robust noise model can down weight corners one at a time.
+    GraphTemplate &load_resectioning_graph(GraphKind kind,
+                                           const TransformWithCovariance &t_map_camera,
+                                           const Observations &observations,
+                                           Map &map,
+                                           const gtsam::SharedNoiseModel &noise_model)
+    {
+      // Find the graph template for the known markers in this set of observations
+      std::vector<std::uint64_t> topology{static_cast<std::uint64_t>(kind), camera_key_};
+      for (auto &observation : observations.observations()) {
+        if (map.find_marker(observation.id()) != nullptr) {
+          topology.emplace_back(static_cast<std::uint64_t>(observation.id()));
+        }
+      }
+      // Every factor is on the camera pose, so the order the markers are loaded in doesn't matter.
+      std::sort(topology.begin() + 2, topology.end());
+      auto &graph_template = find_graph_template(topology);
+      size_t resectioning_idx = 0;
+      size_t batch_idx = 0;
+      auto batch_factor = noise_model ?
+                          nullptr :
+                          &graph_template.next_batch_factor(batch_idx, camera_key_, batch_cal_);
+
+      // add or update the factors in the graph
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr == nullptr) {
+          continue;
+        }
+
+        std::vector<cv::Point3d> corners_f_map{};
+        std::vector<cv::Point2f> corners_f_image{};
+
+        cv_.append_corners_f_map(*marker_ptr, map.marker_length(), corners_f_map);
+        cv_.append_corners_f_image(observation, corners_f_image);
+
+        // The per corner factors give the corners of a marker whose pose is uncertain, like a
+        // provisional marker, the projection of their covariance as extra noise. The marker
+        // and corner solves weight such a marker the same way.
+        bool is_uncertain = noise_model &&
+                            !marker_ptr->is_fixed() &&
+                            map.map_style() != Map::MapStyles::pose &&
+                            marker_ptr->t_map_marker().cov()[0] != 0.0;
+
+        for (size_t j = 0; j < corners_f_image.size(); j += 1) {
+          gtsam::Point2 corner_f_image{corners_f_image[j].x, corners_f_image[j].y};
+          gtsam::Point3 corner_f_map{corners_f_map[j].x, corners_f_map[j].y, corners_f_map[j].z};
+          if (batch_factor != nullptr) {
+            batch_factor->add(corner_f_image, corner_f_map, corner_sqrt_information_);
+          } else if (is_uncertain) {
+            auto corner_cov = projected_corner_cov(to_pose3(t_map_camera.transform()), corner_f_map,
+                                                   corner_f_map_cov(*marker_ptr, j, map.marker_length()));
+            graph_template.set_resectioning_factor(resectioning_idx, *this, camera_key_,
+                                                   with_covariance(noise_model, corner_cov),
+                                                   corner_f_image, corner_f_map);
+          } else {
+            graph_template.set_resectioning_factor(resectioning_idx, *this, camera_key_, noise_model,
+                                                   corner_f_image, corner_f_map);
+          }
+        }
+      }
+      if (batch_factor != nullptr) {
+        batch_factor->finish_load();
+      }
+
+      // Add the initial estimate for the camera pose
+      graph_template.set_initial(camera_key_, to_pose3(t_map_camera.transform()));
+      graph_template.finish_load();
+      return graph_template;
+    }
+
+    // The Gauss-Newton information that the corner measurements give about a camera pose.
+    // camera_pose and corners are in the same frame.
+    gtsam::Matrix6 corners_information(const gtsam::Pose3 &camera_pose,
+                                       const std::vector<cv::Point3d> &corners_f_pose)
+    {
+      PointBatch corners{};
+      for (auto &corner : corners_f_pose) {
+        corners.add(corner.x, corner.y, corner.z);
+      }
+      ProjectionBatch projections{};
+      project_batch(to_batch_pose(camera_pose), batch_cal_, corners, projections, true);
+
+      gtsam::Matrix6 information = gtsam::Matrix6::Zero();
+      for (size_t i = 0; i < corners.size(); i += 1) {
+        gtsam::Matrix26 H_pose;
+        for (int c = 0; c < 6; c += 1) {
+          H_pose(0, c) = projections.h_[c][i];
+          H_pose(1, c) = projections.h_[6 + c][i];
+        }
+        information += H_pose.transpose() * H_pose;
+      }
+      return information / (corner_measurement_sigma_ * corner_measurement_sigma_);
+    }
+
+    // The covariance of camera_f_marker at a solution found by solvePnP. This is the inverse of
+    // the Gauss-Newton information of the corner measurements at the solution, so no
+    // optimization or marginals are needed.
+    gtsam::Matrix6 pnp_camera_f_marker_cov(const gtsam::Pose3 &camera_f_marker,
+                                           double marker_length)
+    {
+      std::vector<cv::Point3d> corners_f_marker{};
+      cv_.append_corners_f_marker(marker_length, corners_f_marker);
+      return corners_information(camera_f_marker, corners_f_marker).inverse();
+    }
+
+    // Update the map by fusing each marker measurement into the marker's pose. The fusion is
+    // information weighted in the tangent space of the marker's pose, so a far or oblique
+    // sighting counts for less than a close frontal one. This is O(1) per observation and
+    // writes real covariances to the map.
+    //
+    // The uncertainty of the camera pose is propagated into each measurement. The camera pose
+    // was solved from the corners of the known markers, so it is correlated with the
+    // measurements of those markers. A known marker's measurement therefore uses the camera
+    // covariance from the other known markers' corners only. If no other known marker is in
+    // view, the camera pose came from this marker alone and the measurement adds nothing.
+    void update_map_fused(const TransformWithCovariance &t_map_camera,
+                          const Observations &observations,
+                          Map &map)
+    {
+      if (!t_map_camera.is_valid()) {
+        return;
+      }
+
+      auto camera_f_map = to_pose3(t_map_camera.transform());
+
+      // The camera pose information from each known marker, and from all of them.
+      std::map<int, gtsam::Matrix6> marker_informations{};
+      gtsam::Matrix6 camera_information = gtsam::Matrix6::Zero();
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          std::vector<cv::Point3d> corners_f_map{};
+          cv_.append_corners_f_map(*marker_ptr, map.marker_length(), corners_f_map);
+          auto information = corners_information(camera_f_map, corners_f_map);
+          auto it = marker_informations.emplace(observation.id(), gtsam::Matrix6::Zero()).first;
+          it->second += information;
+          camera_information += information;
+        }
+      }
+
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr && marker_ptr->is_fixed()) {
+          continue;
+        }
+
+        // The camera pose covariance without this marker's corners.
+        gtsam::Matrix6 other_information = marker_ptr == nullptr ?
+                                           camera_information :
+                                           (camera_information - marker_informations[observation.id()]).eval();
+        Eigen::FullPivLU<gtsam::Matrix6> other_information_lu{other_information};
+        if (!other_information_lu.isInvertible()) {
+          continue;
+        }
+        gtsam::Matrix6 camera_f_map_cov = other_information_lu.inverse();
+
+        // The measurement of the marker pose and its covariance.
+        auto cv_t_camera_marker = cv_.solve_t_camera_marker(observation, map.marker_length());
+        auto camera_f_marker = to_pose3(cv_t_camera_marker.transform().inverse());
+        auto camera_f_marker_cov = pnp_camera_f_marker_cov(camera_f_marker, map.marker_length());
+
+        gtsam::Matrix6 H_inverse;
+        auto marker_f_camera = camera_f_marker.inverse(H_inverse);
+        gtsam::Matrix6 H_camera, H_marker;
+        auto marker_f_map = camera_f_map.compose(marker_f_camera, H_camera, H_marker);
+        gtsam::Matrix6 H_measurement = H_marker * H_inverse;
+        gtsam::Matrix6 marker_f_map_cov = H_camera * camera_f_map_cov * H_camera.transpose() +
+                                          H_measurement * camera_f_marker_cov * H_measurement.transpose();
+
+        // A new marker just gets the measurement.
+        if (marker_ptr == nullptr) {
+          map.add_marker(Marker{observation.id(), to_transform_with_covariance(marker_f_map, marker_f_map_cov)});
+          continue;
+        }
+
+        // A marker without a covariance is given the same weight as the measurement.
+        auto prior = to_pose3(marker_ptr->t_map_marker().transform());
+        auto prior_cov = to_cov_sam(marker_ptr->t_map_marker().cov());
+        if (prior_cov(0, 0) == 0.0) {
+          prior_cov = marker_f_map_cov;
+        }
+
+        gtsam::Matrix6 measurement_information = marker_f_map_cov.inverse();
+        gtsam::Matrix6 fused_cov = (prior_cov.inverse() + measurement_information).inverse();
+        gtsam::Vector6 delta = fused_cov * measurement_information * gtsam::Pose3::Logmap(prior.between(marker_f_map));
+        auto fused = prior.compose(gtsam::Pose3::Expmap(delta));
+
+        marker_ptr->set_t_map_marker(to_transform_with_covariance(fused, fused_cov));
+        marker_ptr->set_update_count(marker_ptr->update_count() + 1);
+      }
+    }
+
+    // Take one Gauss-Newton step from a previous camera pose. The covariance is not recalculated.
+    TransformWithCovariance refresh_t_map_camera(const TransformWithCovariance &t_map_camera,
+                                                 const Observations &observations,
+                                                 Map &map)
+    {
+      auto &graph_template = load_resectioning_graph(GraphKind::refresh, t_map_camera,
+                                                     observations, map, nullptr);
+      auto result = graph_template.gauss_newton_step();
+      return to_transform_with_covariance(result.at<gtsam::Pose3>(camera_key_), to_cov_sam(t_map_camera.cov()));
+    }
+
+    // Solve against the corners of the known markers with a Huber noise model on each corner so a
+    // single bad corner or marker can't pull the result far. The iteration count is capped so the
+    // solve time is bounded.
+    TransformWithCovariance solve_t_map_camera_robust(const Observations &observations,
+                                                      Map &map,
+                                                      const RobustSolveOptions &options)
+    {
+      // Get an estimate of camera_f_map.
+      auto cv_t_map_camera = cv_.solve_t_map_camera(observations,
+                                                    map);
+
+      // If we could not find an estimate, then there are no known markers in the image.
+      if (!cv_t_map_camera.is_valid()) {
+        return cv_t_map_camera;
+      }
+
+      // 1. Load the graph and initial estimate
+      auto &graph_template = load_resectioning_graph(GraphKind::robust, cv_t_map_camera,
+                                                     observations, map, robust_noise(options.huber_k_));
+
+      // 4. Optimize the graph using Levenberg-Marquardt with a limited number of iterations
+      auto result = graph_template.optimize(options.max_iterations_);
+
+      // 5. Extract the result
+      return extract_transform_with_covariance(graph_template.marginals(result), result, camera_key_);
+    }
+
+    // Where the known markers will be seen from a camera pose. All the corners of all the markers
+    // are projected in one batch. Markers that are partly behind the camera or entirely outside
+    // the image are left out.
+    Observations predict_observations(const TransformWithCovariance &t_map_camera,
+                                      Map &map,
+                                      int image_width,
+                                      int image_height)
+    {
+      PointBatch corners{};
+      std::vector<int> ids{};
+      for (auto &marker_pair : map.markers()) {
+        std::vector<cv::Point3d> corners_f_map{};
+        cv_.append_corners_f_map(marker_pair.second, map.marker_length(), corners_f_map);
+        for (auto &corner : corners_f_map) {
+          corners.add(corner.x, corner.y, corner.z);
+        }
+        ids.emplace_back(marker_pair.first);
+      }
+
+      ProjectionBatch projections{};
+      project_batch(to_batch_pose(to_pose3(t_map_camera.transform())), batch_cal_, corners, projections, false);
+
+      Observations observations{};
+      for (size_t m = 0; m < ids.size(); m += 1) {
+        auto i = m * 4;
+        bool in_front = true;
+        bool in_image = false;
+        for (size_t j = i; j < i + 4; j += 1) {
+          in_front = in_front && projections.depth_[j] > 0.;
+          in_image = in_image ||
+                     (projections.u_[j] >= 0. && projections.u_[j] < image_width &&
+                      projections.v_[j] >= 0. && projections.v_[j] < image_height);
+        }
+        if (in_front && in_image) {
+          observations.add(Observation(ids[m],
+                                       projections.u_[i], projections.v_[i],
+                                       projections.u_[i + 1], projections.v_[i + 1],
+                                       projections.u_[i + 2], projections.v_[i + 2],
+                                       projections.u_[i + 3], projections.v_[i + 3]));
+        }
+      }
+      return observations;
+    }
+
+    // Check the observations of known markers against each other. Each one gives a camera pose
+    // from its own corners. That pose is used to project the corners of the other known markers.
+    // Two observations agree if either one's pose puts all the corners of the other within
+    // max_error pixels of where they were seen. An observation that agrees with no other one is
+    // left out. If none agree, nothing is returned. Observations of unknown markers are kept if
+    // any known marker is kept. With fewer than two known markers there is nothing to check.
+    Observations gate_observations(const Observations &observations,
+                                   Map &map,
+                                   double max_error)
+    {
+      std::vector<const Observation *> known{};
+      PointBatch corners{};
+      std::vector<double> corners_f_image{};
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr == nullptr) {
+          continue;
+        }
+        std::vector<cv::Point3d> corners_f_map{};
+        cv_.append_corners_f_map(*marker_ptr, map.marker_length(), corners_f_map);
+        for (auto &corner : corners_f_map) {
+          corners.add(corner.x, corner.y, corner.z);
+        }
+        corners_f_image.insert(corners_f_image.end(),
+                               {observation.x0(), observation.y0(), observation.x1(), observation.y1(),
+                                observation.x2(), observation.y2(), observation.x3(), observation.y3()});
+        known.emplace_back(&observation);
+      }
+
+      auto n = known.size();
+      if (n < 2) {
+        return observations;
+      }
+
+      // agree[i * n + j] => the pose from observation i reprojects the corners of j.
+      std::vector<bool> agree(n * n, false);
+      ProjectionBatch projections{};
+      auto max_error_squared = max_error * max_error;
+      for (size_t i = 0; i < n; i += 1) {
+        auto t_camera_marker = cv_.solve_t_camera_marker(*known[i], map.marker_length());
+        if (!t_camera_marker.is_valid()) {
+          continue;
+        }
+        auto &t_map_marker = map.find_marker(known[i]->id())->t_map_marker();
+        auto camera_f_map = to_pose3(t_map_marker.transform() * t_camera_marker.transform().inverse());
+        project_batch(to_batch_pose(camera_f_map), batch_cal_, corners, projections, false);
+
+        for (size_t j = 0; j < n; j += 1) {
+          bool ok = j != i;
+          for (size_t k = j * 4; ok && k < j * 4 + 4; k += 1) {
+            auto du = projections.u_[k] - corners_f_image[2 * k];
+            auto dv = projections.v_[k] - corners_f_image[2 * k + 1];
+            ok = projections.depth_[k] > 0. && du * du + dv * dv <= max_error_squared;
+          }
+          agree[i * n + j] = ok;
+        }
+      }
+
+      std::vector<int> passed_ids{};
+      for (size_t i = 0; i < n; i += 1) {
+        for (size_t j = 0; j < n; j += 1) {
+          if (agree[i * n + j] || agree[j * n + i]) {
+            passed_ids.emplace_back(known[i]->id());
+            break;
+          }
+        }
+      }
+
+      Observations gated{};
+      if (passed_ids.empty()) {
+        return gated;
+      }
+      for (auto &observation : observations.observations()) {
+        if (map.find_marker(observation.id()) == nullptr ||
+            std::find(passed_ids.begin(), passed_ids.end(), observation.id()) != passed_ids.end()) {
+          gated.add(observation);
+        }
+      }
+      return gated;
+    }
+
+    // Figure the corners of a marker in the map frame and their covariances from the marker's pose.
+    void update_marker_corners(Marker &marker, double marker_length)
+    {
+      auto t_map_marker = to_pose3(marker.t_map_marker().transform());
+      auto t_map_marker_cov = to_cov_sam(marker.t_map_marker().cov());
+
+      std::vector<cv::Point3d> corners_f_marker{};
+      cv_.append_corners_f_marker(marker_length, corners_f_marker);
+
+      std::array<PointWithCovariance, 4> corners_f_map{};
+      for (size_t j = 0; j < corners_f_map.size(); j += 1) {
+        gtsam::Matrix36 H_pose;
+        auto corner_f_map = t_map_marker.transformFrom(
+          gtsam::Point3{corners_f_marker[j].x, corners_f_marker[j].y, corners_f_marker[j].z}, H_pose);
+        gtsam::Matrix3 corner_cov = H_pose * t_map_marker_cov * H_pose.transpose();
+
+        PointWithCovariance::cov_type cov;
+        for (int r = 0; r < 3; r += 1) {
+          for (int c = 0; c < 3; c += 1) {
+            cov[r * 3 + c] = corner_cov(r, c);
+          }
+        }
+        corners_f_map[j] = PointWithCovariance(tf2::Vector3(corner_f_map.x(), corner_f_map.y(), corner_f_map.z()),
+                                               cov);
+      }
+
+      marker.set_corners_f_map(corners_f_map);
     }
 
     TransformWithCovariance solve_t_map_camera(const Observations &observations,
@@ -696,24 +2061,24 @@ namespace fiducial_vlam
         return cv_t_map_camera;
       }
 
-      // 1. Allocate the graph and initial estimate
-      gtsam::NonlinearFactorGraph graph{};
-      gtsam::Values initial{};
+      // A map with corners is solved directly against the corners.
+      if (map.map_style() == Map::MapStyles::corners) {
+        return solve_t_map_camera_corners(cv_t_map_camera, observations, map);
+      }
 
-      // 2. add factors to the graph
-      load_graph_from_observations(cv_t_map_camera,
-                                   observations,
-                                   map,
-                                   camera_key_, false,
-                                   graph, initial);
+      // 1. Load the graph and initial estimate
+      auto &graph_template = load_graph_from_observations(cv_t_map_camera,
+                                                          observations,
+                                                          map,
+                                                          camera_key_, false);
 
       // 4. Optimize the graph using Levenberg-Marquardt
-      auto result = gtsam::LevenbergMarquardtOptimizer(graph, initial).optimize();
-//      std::cout << "initial error = " << graph.error(initial) << std::endl;
-//      std::cout << "final error = " << graph.error(result) << std::endl;
+      auto result = graph_template.optimize();
+//      std::cout << "initial error = " << graph_template.graph_.error(graph_template.initial_) << std::endl;
+//      std::cout << "final error = " << graph_template.graph_.error(result) << std::endl;
 
       // 5. Extract the result
-      return extract_transform_with_covariance(graph, result, camera_key_);
+      return extract_transform_with_covariance(graph_template.marginals(result), result, camera_key_);
     }
 
     void update_map(const TransformWithCovariance &t_map_camera,
@@ -727,26 +2092,82 @@ namespace fiducial_vlam
 
 //      std::cout << "update_map known markers: " << map.markers().size() << std::endl;
 
-      gtsam::NonlinearFactorGraph graph{};
-      gtsam::Values initial{};
       gtsam::Symbol camera_key{'c', 0};
 
-      load_graph_from_observations(t_map_camera,
-                                   observations,
-                                   map,
-                                   camera_key, true,
-                                   graph, initial);
+      auto &graph_template = load_graph_from_observations(t_map_camera,
+                                                          observations,
+                                                          map,
+                                                          camera_key, true);
 
       // Now optimize this graph
-      auto result = gtsam::LevenbergMarquardtOptimizer(graph, initial).optimize();
-//      std::cout << "initial error = " << graph.error(initial) << std::endl;
-//      std::cout << "final error = " << graph.error(result) << std::endl;
+      auto result = graph_template.optimize();
+      auto marginals = graph_template.marginals(result);
+//      std::cout << "initial error = " << graph_template.graph_.error(graph_template.initial_) << std::endl;
+//      std::cout << "final error = " << graph_template.graph_.error(result) << std::endl;
+
+      update_markers(marginals, result, observations, map);
+    }
+
+    // The pose of the rig base in each marker frame, measured through one camera of the rig.
+    std::vector<TransformWithCovariance> solve_base_f_markers(const Observations &observations,
+                                                              const TransformWithCovariance &t_base_camera,
+                                                              Map &map)
+    {
+      auto camera_f_markers = solve_camera_f_markers(observations, map, true);
+
+      // marker_f_base = marker_f_camera * camera_f_base. The camera covariance is on the right of
+      // marker_f_camera so it moves to the right of marker_f_base through the adjoint of base_f_camera.
+      auto base_f_camera = to_pose3(t_base_camera.transform());
+      auto camera_f_base = base_f_camera.inverse();
+      gtsam::Matrix6 adjoint = base_f_camera.AdjointMap();
+
+      std::vector<TransformWithCovariance> base_f_markers{};
+      for (auto &camera_f_marker : camera_f_markers) {
+        auto base_f_marker = to_pose3(camera_f_marker.transform()).compose(camera_f_base);
+        gtsam::Matrix6 cov = adjoint * to_cov_sam(camera_f_marker.cov()) * adjoint.transpose();
+        base_f_markers.emplace_back(to_transform_with_covariance(base_f_marker, cov));
+      }
+      return base_f_markers;
+    }
 
-      // Update the map
+    // Update the map from the observations of all the cameras of a rig at one time. The rig base
+    // pose is a single variable that all the measurements connect to.
+    void update_map_rig(const TransformWithCovariance &t_map_base,
+                        const Observations &observations,
+                        const std::vector<TransformWithCovariance> &base_f_markers,
+                        Map &map)
+    {
+      if (!t_map_base.is_valid() || observations.size() < 2) {
+        return;
+      }
+
+      gtsam::Symbol base_key{'b', 0};
+
+      auto &graph_template = load_graph_from_measurements(GraphKind::rig, t_map_base, observations, base_f_markers,
+                                                          map, base_key, true);
+
+      auto result = graph_template.optimize();
+      auto marginals = graph_template.marginals(result);
+
+      update_markers(marginals, result, observations, map);
+    }
+
+  private:
+    // Write the optimized poses of the observed markers to the map.
+    void update_markers(const gtsam::Marginals &marginals,
+                        const gtsam::Values &result,
+                        const Observations &observations,
+                        Map &map)
+    {
+      std::vector<int> updated_ids{};
       for (auto &observation : observations.observations()) {
+        if (std::find(updated_ids.begin(), updated_ids.end(), observation.id()) != updated_ids.end()) {
+          continue;
+        }
+        updated_ids.emplace_back(observation.id());
 
         gtsam::Symbol marker_key{'m', static_cast<std::uint64_t>(observation.id())};
-        auto t_map_marker = extract_transform_with_covariance(graph, result, marker_key);
+        auto t_map_marker = extract_transform_with_covariance(marginals, result, marker_key);
 
         // update an existing marker or add a new one.
         auto marker_ptr = map.find_marker(observation.id());
@@ -767,6 +2188,72 @@ namespace fiducial_vlam
     }
   };
 
+// ==============================================================================
+// FiducialMath::PoseMemo class
+// ==============================================================================
+
+  // The last solved set of observations and the result. A camera that isn't moving
+  // sees the same corners with a little jitter and gets the same pose.
+  class FiducialMath::PoseMemo
+  {
+    bool is_valid_{false};
+    Observations observations_{};
+    TransformWithCovariance t_map_camera_{};
+    std::vector<int> rejected_ids_{};
+
+  public:
+    void clear()
+    {
+      is_valid_ = false;
+    }
+
+    void save(const Observations &observations,
+              const TransformWithCovariance &t_map_camera,
+              const std::vector<int> &rejected_ids)
+    {
+      is_valid_ = t_map_camera.is_valid();
+      observations_ = observations;
+      t_map_camera_ = t_map_camera;
+      rejected_ids_ = rejected_ids;
+    }
+
+    // True if the observations are of the same markers, in the same order, and
+    // every corner is within tolerance of the saved corners.
+    bool matches(const Observations &observations, double corner_tolerance) const
+    {
+      if (!is_valid_ || observations.size() != observations_.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < observations.size(); i += 1) {
+        auto &a = observations.observations()[i];
+        auto &b = observations_.observations()[i];
+        if (a.id() != b.id() ||
+            std::abs(a.x0() - b.x0()) > corner_tolerance || std::abs(a.y0() - b.y0()) > corner_tolerance ||
+            std::abs(a.x1() - b.x1()) > corner_tolerance || std::abs(a.y1() - b.y1()) > corner_tolerance ||
+            std::abs(a.x2() - b.x2()) > corner_tolerance || std::abs(a.y2() - b.y2()) > corner_tolerance ||
+            std::abs(a.x3() - b.x3()) > corner_tolerance || std::abs(a.y3() - b.y3()) > corner_tolerance) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // True if the saved solve had an observation of this marker.
+    bool observed(int id) const
+    {
+      return is_valid_ &&
+             std::any_of(observations_.observations().begin(), observations_.observations().end(),
+                         [id](const Observation &observation) -> bool
+                         { return observation.id() == id; });
+    }
+
+    auto &t_map_camera() const
+    { return t_map_camera_; }
+
+    auto &rejected_ids() const
+    { return rejected_ids_; }
+  };
+
 // ==============================================================================
 // FiducialMath class
 // ==============================================================================
@@ -775,20 +2262,38 @@ namespace fiducial_vlam
                              double corner_measurement_sigma,
                              const CameraInfo &camera_info) :
     sam_not_cv_{sam_not_cv},
+    corner_measurement_sigma_{corner_measurement_sigma},
     cv_{std::make_unique<CvFiducialMath>(camera_info)},
-    sam_{std::make_unique<SamFiducialMath>(*cv_, corner_measurement_sigma)}
+    sam_{std::make_unique<SamFiducialMath>(*cv_, corner_measurement_sigma)},
+    memo_{std::make_unique<PoseMemo>()}
   {}
 
   FiducialMath::FiducialMath(bool sam_not_cv,
                              double corner_measurement_sigma,
                              const sensor_msgs::msg::CameraInfo &camera_info_msg) :
     sam_not_cv_{sam_not_cv},
+    corner_measurement_sigma_{corner_measurement_sigma},
     cv_{std::make_unique<CvFiducialMath>(camera_info_msg)},
-    sam_{std::make_unique<SamFiducialMath>(*cv_, corner_measurement_sigma)}
+    sam_{std::make_unique<SamFiducialMath>(*cv_, corner_measurement_sigma)},
+    memo_{std::make_unique<PoseMemo>()}
   {}
 
   FiducialMath::~FiducialMath() = default;
 
+  bool FiducialMath::is_built_from(bool sam_not_cv,
+                                   double corner_measurement_sigma,
+                                   const sensor_msgs::msg::CameraInfo &camera_info_msg) const
+  {
+    return sam_not_cv_ == sam_not_cv &&
+           corner_measurement_sigma_ == corner_measurement_sigma &&
+           cv_->ci_.is_built_from(camera_info_msg);
+  }
+
+  const CameraInfo &FiducialMath::camera_info() const
+  {
+    return cv_->ci_;
+  }
+
   TransformWithCovariance FiducialMath::solve_t_camera_marker(
     const Observation &observation,
     double marker_length)
@@ -796,18 +2301,126 @@ namespace fiducial_vlam
     return cv_->solve_t_camera_marker(observation, marker_length);
   }
 
+  void FiducialMath::set_pose_memo_options(double corner_tolerance, bool refresh)
+  {
+    memo_corner_tolerance_ = corner_tolerance;
+    memo_refresh_ = refresh;
+    if (memo_corner_tolerance_ <= 0.0) {
+      memo_->clear();
+    }
+  }
+
+  void FiducialMath::clear_pose_memo()
+  {
+    memo_->clear();
+  }
+
+  void FiducialMath::clear_pose_memo_if_observed(int id)
+  {
+    if (memo_->observed(id)) {
+      memo_->clear();
+    }
+  }
+
+  void FiducialMath::set_t_map_camera_guess(const TransformWithCovariance &t_map_camera)
+  {
+    cv_->t_map_camera_guess_ = t_map_camera;
+  }
+
+  void FiducialMath::set_cv_solve_only(bool cv_solve_only)
+  {
+    // The memo holds a pose from the other solver.
+    if (cv_solve_only != cv_solve_only_) {
+      memo_->clear();
+    }
+    cv_solve_only_ = cv_solve_only;
+  }
+
   TransformWithCovariance FiducialMath::solve_t_map_camera(const Observations &observations,
-                                                           Map &map)
+                                                           Map &map,
+                                                           std::vector<int> *rejected_ids)
   {
-    return sam_not_cv_ ?
+    metrics_.solves_ += 1;
+
+    if (memo_corner_tolerance_ <= 0.0) {
+      return solve_t_map_camera_no_memo(observations, map, rejected_ids);
+    }
+
+    // Reuse the last result if the observations haven't changed.
+    if (memo_->matches(observations, memo_corner_tolerance_)) {
+      metrics_.memo_hits_ += 1;
+      if (rejected_ids != nullptr) {
+        rejected_ids->insert(rejected_ids->end(), memo_->rejected_ids().begin(), memo_->rejected_ids().end());
+      }
+
+      // Only the SAM solver has a cheap refresh step.
+      if (!memo_refresh_ || !sam_not_cv_ || cv_solve_only_) {
+        return memo_->t_map_camera();
+      }
+
+      metrics_.memo_refreshes_ += 1;
+      Observations inliers{};
+      for (auto &observation : observations.observations()) {
+        if (std::find(memo_->rejected_ids().begin(), memo_->rejected_ids().end(), observation.id()) ==
+            memo_->rejected_ids().end()) {
+          inliers.add(observation);
+        }
+      }
+      return sam_->refresh_t_map_camera(memo_->t_map_camera(), inliers, map);
+    }
+
+    std::vector<int> memo_rejected_ids{};
+    auto t_map_camera = solve_t_map_camera_no_memo(observations, map, &memo_rejected_ids);
+    memo_->save(observations, t_map_camera, memo_rejected_ids);
+    if (rejected_ids != nullptr) {
+      rejected_ids->insert(rejected_ids->end(), memo_rejected_ids.begin(), memo_rejected_ids.end());
+    }
+    return t_map_camera;
+  }
+
+  TransformWithCovariance FiducialMath::solve_t_map_camera_no_memo(const Observations &observations,
+                                                                   Map &map,
+                                                                   std::vector<int> *rejected_ids)
+  {
+    auto use_sam = sam_not_cv_ && !cv_solve_only_;
+
+    if (robust_options_.enabled_) {
+      auto inliers = cv_->consistent_observations(observations, map, robust_options_, rejected_ids);
+      return use_sam ?
+             sam_->solve_t_map_camera_robust(inliers, map, robust_options_) :
+             cv_->solve_t_map_camera(inliers, map);
+    }
+
+    return use_sam ?
            sam_->solve_t_map_camera(observations, map) :
            cv_->solve_t_map_camera(observations, map);
   }
 
   Observations FiducialMath::detect_markers(std::shared_ptr<cv_bridge::CvImage> &color,
-                                            std::shared_ptr<cv_bridge::CvImage> &color_marked)
+                                            std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                            CornerRefinement corner_refinement)
+  {
+    return cv_->detect_markers(color, color_marked, corner_refinement, nullptr);
+  }
+
+  void FiducialMath::set_in_tree_decoder(bool in_tree_decoder)
+  {
+    cv_->use_in_tree_decoder_ = in_tree_decoder;
+  }
+
+  Observations FiducialMath::detect_markers_near(std::shared_ptr<cv_bridge::CvImage> &color,
+                                                 std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                                 CornerRefinement corner_refinement,
+                                                 const Observations &near_observations)
+  {
+    return cv_->detect_markers(color, color_marked, corner_refinement, &near_observations);
+  }
+
+  Observations FiducialMath::track_markers(std::shared_ptr<cv_bridge::CvImage> &color,
+                                           std::shared_ptr<cv_bridge::CvImage> &color_marked,
+                                           const Observations &previous_observations)
   {
-    return cv_->detect_markers(color, color_marked);
+    return cv_->track_markers(color, color_marked, previous_observations);
   }
 
   void FiducialMath::annotate_image_with_marker_axis(std::shared_ptr<cv_bridge::CvImage> &color_marked,
@@ -822,9 +2435,96 @@ namespace fiducial_vlam
   {
     if (sam_not_cv_) {
       sam_->update_map(t_map_camera, observations, map);
+    } else if (cv_map_fusion_) {
+      sam_->update_map_fused(t_map_camera, observations, map);
     } else {
       cv_->update_map(t_map_camera, observations, map);
     }
+
+    // A map with the corners style also holds the map frame corners of the markers.
+    if (map.map_style() == Map::MapStyles::corners) {
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          sam_->update_marker_corners(*marker_ptr, map.marker_length());
+        }
+      }
+    }
+  }
+
+  void FiducialMath::update_map_rig(const TransformWithCovariance &t_map_base,
+                                    const std::vector<RigView> &views,
+                                    Map &map)
+  {
+    if (!t_map_base.is_valid() || views.empty()) {
+      return;
+    }
+
+    auto &fm = *views.front().fm_;
+    if (!fm.sam_not_cv_) {
+      for (auto &view : views) {
+        auto t_map_camera = TransformWithCovariance{t_map_base.transform() * view.t_base_camera_->transform()};
+        view.fm_->update_map(t_map_camera, *view.observations_, map);
+      }
+      return;
+    }
+
+    // Each camera measures the base pose in the frames of the markers it sees.
+    Observations observations{};
+    std::vector<TransformWithCovariance> base_f_markers{};
+    for (auto &view : views) {
+      auto view_base_f_markers = view.fm_->sam_->solve_base_f_markers(*view.observations_, *view.t_base_camera_, map);
+      for (size_t i = 0; i < view_base_f_markers.size(); i += 1) {
+        observations.add(view.observations_->observations()[i]);
+        base_f_markers.emplace_back(view_base_f_markers[i]);
+      }
+    }
+
+    fm.sam_->update_map_rig(t_map_base, observations, base_f_markers, map);
+
+    if (map.map_style() == Map::MapStyles::corners) {
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          fm.sam_->update_marker_corners(*marker_ptr, map.marker_length());
+        }
+      }
+    }
   }
 
+  void FiducialMath::fuse_into_map(const TransformWithCovariance &t_map_camera,
+                                   const Observations &observations,
+                                   Map &map)
+  {
+    sam_->update_map_fused(t_map_camera, observations, map);
+
+    if (map.map_style() == Map::MapStyles::corners) {
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr) {
+          sam_->update_marker_corners(*marker_ptr, map.marker_length());
+        }
+      }
+    }
+  }
+
+  void FiducialMath::update_marker_corners(Marker &marker, double marker_length)
+  {
+    sam_->update_marker_corners(marker, marker_length);
+  }
+
+  Observations FiducialMath::predict_observations(const TransformWithCovariance &t_map_camera,
+                                                  Map &map,
+                                                  int image_width,
+                                                  int image_height)
+  {
+    return sam_->predict_observations(t_map_camera, map, image_width, image_height);
+  }
+
+  Observations FiducialMath::gate_observations(const Observations &observations,
+                                               Map &map,
+                                               double max_error)
+  {
+    return sam_->gate_observations(observations, map, max_error);
+  }
 }
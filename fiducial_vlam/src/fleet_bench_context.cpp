@@ -0,0 +1,35 @@
+#include "fleet_bench_context.hpp"
+
+#include <algorithm>
+
+#include "rclcpp/rclcpp.hpp"
+
+namespace fiducial_vlam
+{
+  void FleetBenchContext::load_parameters()
+  {
+#undef CXT_MACRO_MEMBER
+#define CXT_MACRO_MEMBER(n, t, d) CXT_MACRO_LOAD_PARAMETER(node_, (*this), n, t, d)
+    CXT_MACRO_INIT_PARAMETERS(FLEET_BENCH_ALL_PARAMS, validate_parameters)
+
+
+#undef CXT_MACRO_MEMBER
+#define CXT_MACRO_MEMBER(n, t, d) CXT_MACRO_PARAMETER_CHANGED((*this), n, t)
+    CXT_MACRO_REGISTER_PARAMETERS_CHANGED(node_, FLEET_BENCH_ALL_PARAMS, validate_parameters)
+
+    RCLCPP_INFO(node_.get_logger(), "FleetBenchNode Parameters");
+
+#undef CXT_MACRO_MEMBER
+#define CXT_MACRO_MEMBER(n, t, d) CXT_MACRO_LOG_PARAMETER(RCLCPP_INFO, node_.get_logger(), (*this), n, t, d)
+    FLEET_BENCH_ALL_PARAMS
+  }
+
+  void FleetBenchContext::validate_parameters()
+  {
+    drones_ = std::max(drones_, 1);
+    frame_count_ = std::max(frame_count_, 1);
+    if (frame_rate_hz_ < 1.e-3) {
+      frame_rate_hz_ = 30.;
+    }
+  }
+}
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "rclcpp/rclcpp.hpp"
+
+#include "fleet_bench_context.hpp"
+
+#include "cv_bridge/cv_bridge.h"
+#include "geometry_msgs/msg/pose_with_covariance_stamped.hpp"
+#include "opencv2/aruco.hpp"
+#include "opencv2/imgproc.hpp"
+#include "sensor_msgs/msg/camera_info.hpp"
+#include "sensor_msgs/msg/image.hpp"
+#include "std_msgs/msg/header.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// LatencyStats class
+// ==============================================================================
+
+  // Latency samples in seconds.
+  class LatencyStats
+  {
+    std::vector<double> samples_{};
+
+  public:
+    void add(double sample)
+    { samples_.emplace_back(sample); }
+
+    void clear()
+    { samples_.clear(); }
+
+    auto size() const
+    { return samples_.size(); }
+
+    // p in [0, 1]. 0 if there are no samples.
+    double percentile(double p) const
+    {
+      if (samples_.empty()) {
+        return 0.;
+      }
+      auto sorted = samples_;
+      auto n = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+      std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+      return sorted[n];
+    }
+
+    double max() const
+    { return samples_.empty() ? 0. : *std::max_element(samples_.begin(), samples_.end()); }
+  };
+
+// ==============================================================================
+// FleetBenchNode class
+// ==============================================================================
+
+  // Feed N vloc_nodes with synthetic images of a wall of markers and measure how the
+  // pipelines and one vmap_node keep up. Each drone flies the same loop, starting at a
+  // different point. The images are rendered once at startup so the benchmark itself
+  // uses little CPU while it runs.
+  //
+  // After warmup_s, for duration_s, the node records:
+  //  - the latency from an image stamp to the camera pose of that image
+  //  - the lag from an image stamp to vmap_node finishing with its observations
+  // Then it appends one row to summary_filename and exits.
+  class FleetBenchNode : public rclcpp::Node
+  {
+    struct Drone
+    {
+      std::string frame_id_{};
+      std::size_t frame_idx_{0};
+      LatencyStats latency_{};
+      rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr image_pub_{};
+      rclcpp::Publisher<sensor_msgs::msg::CameraInfo>::SharedPtr camera_info_pub_{};
+      rclcpp::Subscription<geometry_msgs::msg::PoseWithCovarianceStamped>::SharedPtr camera_pose_sub_{};
+    };
+
+    FleetBenchContext cxt_;
+    std::vector<sensor_msgs::msg::Image> frames_{};
+    sensor_msgs::msg::CameraInfo camera_info_msg_{};
+    std::vector<std::unique_ptr<Drone>> drones_{};
+    LatencyStats fleet_latency_{};
+    LatencyStats ingest_lag_{};
+
+    rclcpp::Subscription<std_msgs::msg::Header>::SharedPtr ingest_stamp_sub_{};
+    rclcpp::TimerBase::SharedPtr frame_timer_{};
+
+    std::int64_t start_ns_{0};
+    bool measuring_{false};
+    std::uint64_t images_published_{0};
+
+    std::int64_t age_ns(const builtin_interfaces::msg::Time &stamp)
+    {
+      return now().nanoseconds() - rclcpp::Time(stamp).nanoseconds();
+    }
+
+    sensor_msgs::msg::CameraInfo make_camera_info()
+    {
+      sensor_msgs::msg::CameraInfo msg{};
+      msg.width = static_cast<std::uint32_t>(cxt_.image_width_);
+      msg.height = static_cast<std::uint32_t>(cxt_.image_height_);
+      msg.distortion_model = "plumb_bob";
+      msg.d = std::vector<double>(5, 0.);
+      auto cx = cxt_.image_width_ / 2.;
+      auto cy = cxt_.image_height_ / 2.;
+      msg.k = {cxt_.camera_f_, 0., cx,
+               0., cxt_.camera_f_, cy,
+               0., 0., 1.};
+      msg.r = {1., 0., 0.,
+               0., 1., 0.,
+               0., 0., 1.};
+      msg.p = {cxt_.camera_f_, 0., cx, 0.,
+               0., cxt_.camera_f_, cy, 0.,
+               0., 0., 1., 0.};
+      return msg;
+    }
+
+    // The wall is the x-y plane of the top left marker with the markers facing +z. The camera
+    // looks straight at the middle of the wall from camera_distance and moves around a circle
+    // of radius camera_sweep. Its x axis is the wall's x axis and its y axis points down.
+    cv::Mat render_frame(std::size_t frame_idx, const std::vector<cv::Mat> &bitmaps)
+    {
+      auto angle = 2. * M_PI * static_cast<double>(frame_idx) / static_cast<double>(cxt_.frame_count_);
+      auto camera_x = (cxt_.marker_columns_ - 1) * cxt_.marker_spacing_ / 2. + cxt_.camera_sweep_ * std::cos(angle);
+      auto camera_y = -(cxt_.marker_rows_ - 1) * cxt_.marker_spacing_ / 2. + cxt_.camera_sweep_ * std::sin(angle);
+      auto cx = cxt_.image_width_ / 2.;
+      auto cy = cxt_.image_height_ / 2.;
+
+      cv::Mat image(cxt_.image_height_, cxt_.image_width_, CV_8UC3, cv::Scalar(255, 255, 255));
+
+      for (int k = 0; k < static_cast<int>(bitmaps.size()); k += 1) {
+        auto center_x = (k % cxt_.marker_columns_) * cxt_.marker_spacing_;
+        auto center_y = -(k / cxt_.marker_columns_) * cxt_.marker_spacing_;
+        auto half = cxt_.marker_length_ / 2.;
+
+        // The corners in the aruco order: top left, top right, bottom right, bottom left.
+        std::vector<cv::Point2f> corners_f_image{};
+        for (auto &corner : std::vector<cv::Point2d>{{-half, half}, {half, half}, {half, -half}, {-half, -half}}) {
+          auto x = center_x + corner.x - camera_x;
+          auto y = -(center_y + corner.y - camera_y);
+          corners_f_image.emplace_back(cv::Point2f(static_cast<float>(cxt_.camera_f_ * x / cxt_.camera_distance_ + cx),
+                                                   static_cast<float>(cxt_.camera_f_ * y / cxt_.camera_distance_ + cy)));
+        }
+
+        // Markers that are not entirely in the image are left out.
+        cv::Rect2f image_rect(0.f, 0.f, static_cast<float>(cxt_.image_width_), static_cast<float>(cxt_.image_height_));
+        if (!std::all_of(corners_f_image.begin(), corners_f_image.end(),
+                         [&image_rect](const cv::Point2f &p) -> bool
+                         { return image_rect.contains(p); })) {
+          continue;
+        }
+
+        auto side = static_cast<float>(bitmaps[k].cols);
+        std::vector<cv::Point2f> corners_f_bitmap{{0.f, 0.f}, {side, 0.f}, {side, side}, {0.f, side}};
+        auto homography = cv::getPerspectiveTransform(corners_f_bitmap, corners_f_image);
+        cv::warpPerspective(bitmaps[k], image, homography, image.size(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+      }
+
+      return image;
+    }
+
+    void render_frames()
+    {
+      auto dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
+      std::vector<cv::Mat> bitmaps{};
+      for (int k = 0; k < cxt_.marker_columns_ * cxt_.marker_rows_; k += 1) {
+        cv::Mat bitmap{};
+        cv::aruco::drawMarker(dictionary, cxt_.map_init_id_ + k, 160, bitmap, 1);
+        cv::Mat bitmap_bgr{};
+        cv::cvtColor(bitmap, bitmap_bgr, cv::COLOR_GRAY2BGR);
+        bitmaps.emplace_back(bitmap_bgr);
+      }
+
+      for (int i = 0; i < cxt_.frame_count_; i += 1) {
+        std_msgs::msg::Header header{};
+        frames_.emplace_back(*cv_bridge::CvImage(header, "bgr8", render_frame(i, bitmaps)).toImageMsg());
+      }
+    }
+
+    void publish_frames()
+    {
+      auto elapsed_s = (now().nanoseconds() - start_ns_) * 1.e-9;
+      if (!measuring_ && elapsed_s >= cxt_.warmup_s_) {
+        start_measuring();
+      }
+      if (measuring_ && elapsed_s >= cxt_.warmup_s_ + cxt_.duration_s_) {
+        finish();
+        return;
+      }
+
+      for (auto &drone : drones_) {
+        auto stamp = now();
+
+        camera_info_msg_.header.stamp = stamp;
+        camera_info_msg_.header.frame_id = drone->frame_id_;
+        drone->camera_info_pub_->publish(camera_info_msg_);
+
+        auto image_msg = frames_[drone->frame_idx_];
+        image_msg.header.stamp = stamp;
+        image_msg.header.frame_id = drone->frame_id_;
+        drone->image_pub_->publish(image_msg);
+
+        drone->frame_idx_ = (drone->frame_idx_ + 1) % frames_.size();
+        if (measuring_) {
+          images_published_ += 1;
+        }
+      }
+    }
+
+    void start_measuring()
+    {
+      measuring_ = true;
+      images_published_ = 0;
+      fleet_latency_.clear();
+      ingest_lag_.clear();
+      for (auto &drone : drones_) {
+        drone->latency_.clear();
+      }
+      RCLCPP_INFO(get_logger(), "Measuring for %.1f s", cxt_.duration_s_);
+    }
+
+    void finish()
+    {
+      measuring_ = false;
+      frame_timer_->cancel();
+
+      // The fleet latency percentiles are over all the poses of all the drones. The worst
+      // drone shows whether some pipelines are starved while others keep up.
+      double worst_drone_p95{0.};
+      for (auto &drone : drones_) {
+        worst_drone_p95 = std::max(worst_drone_p95, drone->latency_.percentile(0.95));
+        RCLCPP_INFO(get_logger(), "%s: %d poses, latency p50 %.1f ms, p95 %.1f ms, max %.1f ms",
+                    drone->frame_id_.c_str(), static_cast<int>(drone->latency_.size()),
+                    drone->latency_.percentile(0.5) * 1.e3, drone->latency_.percentile(0.95) * 1.e3,
+                    drone->latency_.max() * 1.e3);
+      }
+
+      std::ostringstream row{};
+      auto offered_fps = images_published_ / cxt_.duration_s_;
+      auto throughput_fps = fleet_latency_.size() / cxt_.duration_s_;
+      row << std::fixed << std::setprecision(3)
+          << drones_.size() << ","
+          << cxt_.frame_rate_hz_ << ","
+          << cxt_.duration_s_ << ","
+          << offered_fps << ","
+          << throughput_fps << ","
+          << (offered_fps > 0. ? throughput_fps / offered_fps : 0.) << ","
+          << fleet_latency_.percentile(0.5) * 1.e3 << ","
+          << fleet_latency_.percentile(0.95) * 1.e3 << ","
+          << fleet_latency_.max() * 1.e3 << ","
+          << worst_drone_p95 * 1.e3 << ","
+          << ingest_lag_.size() / cxt_.duration_s_ << ","
+          << ingest_lag_.percentile(0.5) * 1.e3 << ","
+          << ingest_lag_.percentile(0.95) * 1.e3;
+
+      bool new_file = !std::ifstream{cxt_.summary_filename_}.good();
+      std::ofstream summary{cxt_.summary_filename_, std::ios::app};
+      if (new_file) {
+        summary << "drones,frame_rate_hz,duration_s,offered_fps,throughput_fps,efficiency,"
+                   "latency_p50_ms,latency_p95_ms,latency_max_ms,worst_drone_p95_ms,"
+                   "vmap_ingest_fps,vmap_lag_p50_ms,vmap_lag_p95_ms" << std::endl;
+      }
+      summary << row.str() << std::endl;
+      if (!summary.good()) {
+        RCLCPP_ERROR(get_logger(), "Can not write to '%s'", cxt_.summary_filename_.c_str());
+      }
+
+      RCLCPP_INFO(get_logger(), "%d drones: offered %.1f fps, throughput %.1f fps, latency p95 %.1f ms, "
+                                "vmap ingest %.1f fps, vmap lag p95 %.1f ms",
+                  static_cast<int>(drones_.size()), offered_fps, throughput_fps,
+                  fleet_latency_.percentile(0.95) * 1.e3,
+                  ingest_lag_.size() / cxt_.duration_s_, ingest_lag_.percentile(0.95) * 1.e3);
+      rclcpp::shutdown();
+    }
+
+  public:
+    FleetBenchNode()
+      : Node("fleet_bench_node"), cxt_{*this}
+    {
+      // Get parameters from the command line
+      cxt_.load_parameters();
+
+      camera_info_msg_ = make_camera_info();
+      render_frames();
+
+      for (int i = 0; i < cxt_.drones_; i += 1) {
+        auto drone = std::make_unique<Drone>();
+        auto ns = cxt_.drone_prefix_ + std::to_string(i + 1);
+        drone->frame_id_ = ns + "_camera";
+        drone->frame_idx_ = static_cast<std::size_t>(i) * frames_.size() / static_cast<std::size_t>(cxt_.drones_);
+        drone->image_pub_ = create_publisher<sensor_msgs::msg::Image>("/" + ns + "/image_raw", 1);
+        drone->camera_info_pub_ = create_publisher<sensor_msgs::msg::CameraInfo>("/" + ns + "/camera_info", 1);
+
+        auto drone_ptr = drone.get();
+        drone->camera_pose_sub_ = create_subscription<geometry_msgs::msg::PoseWithCovarianceStamped>(
+          "/" + ns + "/" + cxt_.camera_pose_sub_topic_,
+          16,
+          [this, drone_ptr](const geometry_msgs::msg::PoseWithCovarianceStamped::UniquePtr msg) -> void
+          {
+            if (measuring_) {
+              auto latency_s = age_ns(msg->header.stamp) * 1.e-9;
+              drone_ptr->latency_.add(latency_s);
+              fleet_latency_.add(latency_s);
+            }
+          });
+
+        drones_.emplace_back(std::move(drone));
+      }
+
+      ingest_stamp_sub_ = create_subscription<std_msgs::msg::Header>(
+        cxt_.ingest_stamp_sub_topic_,
+        64,
+        [this](const std_msgs::msg::Header::UniquePtr msg) -> void
+        {
+          if (measuring_) {
+            ingest_lag_.add(age_ns(msg->stamp) * 1.e-9);
+          }
+        });
+
+      start_ns_ = now().nanoseconds();
+      frame_timer_ = create_wall_timer(
+        std::chrono::microseconds(static_cast<int64_t>(1.e6 / cxt_.frame_rate_hz_)),
+        [this]() -> void
+        {
+          publish_frames();
+        });
+
+      (void) ingest_stamp_sub_;
+      RCLCPP_INFO(get_logger(), "fleet_bench_node ready with %d drones and %d frames",
+                  cxt_.drones_, static_cast<int>(frames_.size()));
+    }
+  };
+}
+
+// ==============================================================================
+// main()
+// ==============================================================================
+
+int main(int argc, char **argv)
+{
+  // Force flush of the stdout buffer
+  setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
+
+  // Init ROS
+  rclcpp::init(argc, argv);
+
+  // Create node
+  auto node = std::make_shared<fiducial_vlam::FleetBenchNode>();
+  auto result = rcutils_logging_set_logger_level(node->get_logger().get_name(), RCUTILS_LOG_SEVERITY_INFO);
+  (void) result;
+
+  // Spin until the measurement is done and the node shuts ROS down
+  rclcpp::spin(node);
+
+  // Shut down ROS
+  rclcpp::shutdown();
+
+  return 0;
+}
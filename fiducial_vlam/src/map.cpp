@@ -1,6 +1,11 @@
 
 #include "map.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
 #include "fiducial_math.hpp"
 #include "observation.hpp"
 
@@ -24,15 +29,24 @@ namespace fiducial_vlam
 
   fiducial_vlam_msgs::msg::Observations Observations::to_msg(std_msgs::msg::Header::_stamp_type stamp,
                                                              const std_msgs::msg::Header::_frame_id_type &frame_id,
-                                                             const sensor_msgs::msg::CameraInfo &camera_info_msg)
+                                                             const sensor_msgs::msg::CameraInfo &camera_info_msg) const
   {
     fiducial_vlam_msgs::msg::Observations msg;
+    msg.camera_info = camera_info_msg;
+    to_msg(stamp, frame_id, msg);
+    return msg;
+  }
+
+  void Observations::to_msg(std_msgs::msg::Header::_stamp_type stamp,
+                            const std_msgs::msg::Header::_frame_id_type &frame_id,
+                            fiducial_vlam_msgs::msg::Observations &msg) const
+  {
     msg.header.frame_id = frame_id;
     msg.header.stamp = stamp;
-    msg.camera_info = camera_info_msg;
-    for (
-      auto observation: observations_) {
-      fiducial_vlam_msgs::msg::Observation obs_msg;
+    msg.observations.resize(observations_.size());
+    for (int i = 0; i < observations_.size(); i += 1) {
+      auto &observation = observations_[i];
+      auto &obs_msg = msg.observations[i];
       obs_msg.id = observation.id();
       obs_msg.x0 = observation.x0();
       obs_msg.x1 = observation.x1();
@@ -42,11 +56,7 @@ namespace fiducial_vlam
       obs_msg.y1 = observation.y1();
       obs_msg.y2 = observation.y2();
       obs_msg.y3 = observation.y3();
-      msg.observations.
-        emplace_back(obs_msg);
     }
-    return
-      msg;
   }
 
 // ==============================================================================
@@ -60,9 +70,24 @@ namespace fiducial_vlam
   Map::Map(const fiducial_vlam_msgs::msg::Map &msg) :
     map_style_{static_cast<Map::MapStyles>(msg.map_style)}, marker_length_{msg.marker_length}
   {
+    // Corners are only present in maps with the corners style.
+    bool has_corners = map_style_ == MapStyles::corners &&
+                       msg.corners.size() == 4 * msg.ids.size() &&
+                       msg.corners_cov.size() == 9 * msg.corners.size();
+
     for (int i = 0; i < msg.ids.size(); i += 1) {
       Marker marker(msg.ids[i], to_TransformWithCovariance(msg.poses[i]));
       marker.set_is_fixed(msg.fixed_flags[i] != 0);
+      if (has_corners) {
+        std::array<PointWithCovariance, 4> corners_f_map{};
+        for (int j = 0; j < 4; j += 1) {
+          auto &corner_msg = msg.corners[i * 4 + j];
+          PointWithCovariance::cov_type cov{};
+          std::copy_n(msg.corners_cov.begin() + (i * 4 + j) * 9, 9, cov.begin());
+          corners_f_map[j] = PointWithCovariance(tf2::Vector3(corner_msg.x, corner_msg.y, corner_msg.z), cov);
+        }
+        marker.set_corners_f_map(corners_f_map);
+      }
       add_marker(std::move(marker));
     }
   }
@@ -78,6 +103,23 @@ namespace fiducial_vlam
       map_msg.poses.emplace_back(to_PoseWithCovariance_msg(marker.t_map_marker()));
       map_msg.fixed_flags.emplace_back(marker.is_fixed() ? 1 : 0);
     }
+
+    // Send the corners if every marker has them. Otherwise the receiver uses the marker poses.
+    auto all_have_corners = std::all_of(markers_.begin(), markers_.end(),
+                                        [](const std::pair<const int, Marker> &marker_pair) -> bool
+                                        { return marker_pair.second.has_corners(); });
+    if (map_style_ == MapStyles::corners && all_have_corners) {
+      for (auto &marker_pair : markers_) {
+        for (auto &corner_f_map : marker_pair.second.corners_f_map()) {
+          geometry_msgs::msg::Point corner_msg;
+          corner_msg.x = corner_f_map.point().x();
+          corner_msg.y = corner_f_map.point().y();
+          corner_msg.z = corner_f_map.point().z();
+          map_msg.corners.emplace_back(corner_msg);
+          map_msg.corners_cov.insert(map_msg.corners_cov.end(), corner_f_map.cov().begin(), corner_f_map.cov().end());
+        }
+      }
+    }
     map_msg.header = header_msg;
     map_msg.marker_length = marker_length_;
     map_msg.map_style = map_style_;
@@ -107,6 +149,231 @@ namespace fiducial_vlam
     return t_map_markers;
   }
 
+// ==============================================================================
+// Binary snapshots
+// ==============================================================================
+
+  // Snapshots are written in the native byte order. They are a cache for a
+  // restart on the same machine, not an interchange format.
+  static const char snapshot_magic[8]{'F', 'V', 'L', 'A', 'M', 'S', 'N', 'P'};
+  static const std::uint32_t snapshot_version{2};
+
+  enum class SnapshotKind : std::uint32_t
+  {
+    map = 1,
+    pose = 2,
+  };
+
+  template<typename T>
+  static void write_value(std::ostream &out, const T &value)
+  {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  template<typename T>
+  static bool read_value(std::istream &in, T &value)
+  {
+    in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return in.good();
+  }
+
+  static void write_transform_with_covariance(std::ostream &out, const TransformWithCovariance &twc)
+  {
+    auto &t = twc.transform().getOrigin();
+    auto q = twc.transform().getRotation();
+    std::array<double, 7> pose{t.x(), t.y(), t.z(), q.x(), q.y(), q.z(), q.w()};
+    write_value(out, pose);
+    write_value(out, twc.cov());
+  }
+
+  static bool read_transform_with_covariance(std::istream &in, TransformWithCovariance &twc)
+  {
+    std::array<double, 7> pose{};
+    TransformWithCovariance::cov_type cov{};
+    if (!read_value(in, pose) || !read_value(in, cov)) {
+      return false;
+    }
+    twc = TransformWithCovariance(tf2::Transform(tf2::Quaternion(pose[3], pose[4], pose[5], pose[6]),
+                                                 tf2::Vector3(pose[0], pose[1], pose[2])),
+                                  cov);
+    return true;
+  }
+
+  static void write_snapshot_header(std::ostream &out, SnapshotKind kind)
+  {
+    out.write(snapshot_magic, sizeof(snapshot_magic));
+    write_value(out, snapshot_version);
+    write_value(out, kind);
+  }
+
+  static bool read_snapshot_header(std::istream &in, SnapshotKind kind)
+  {
+    char magic[sizeof(snapshot_magic)]{};
+    std::uint32_t version{};
+    SnapshotKind file_kind{};
+    in.read(magic, sizeof(magic));
+    return in.good() && std::equal(std::begin(magic), std::end(magic), std::begin(snapshot_magic)) &&
+           read_value(in, version) && version == snapshot_version &&
+           read_value(in, file_kind) && file_kind == kind;
+  }
+
+  // Write to a temporary file and then rename it so a reboot while writing
+  // never leaves a truncated snapshot behind.
+  template<typename WRITER>
+  static std::string to_snapshot_file(const std::string &filename, SnapshotKind kind, WRITER writer)
+  {
+    auto temp_filename = filename + ".tmp";
+    {
+      std::ofstream out(temp_filename, std::ios::binary | std::ios::trunc);
+      if (!out) {
+        return std::string{"Cache error: can not open cache file for writing: "}.append(temp_filename);
+      }
+      write_snapshot_header(out, kind);
+      writer(out);
+      if (!out.good()) {
+        return std::string{"Cache error: error writing cache file: "}.append(temp_filename);
+      }
+    }
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+      return std::string{"Cache error: can not rename cache file to: "}.append(filename);
+    }
+    return std::string{};
+  }
+
+  template<typename READER>
+  static std::string from_snapshot_file(const std::string &filename, SnapshotKind kind, READER reader)
+  {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good()) {
+      return std::string{"Cache error: can not open cache file for reading: "}.append(filename);
+    }
+
+    if (!read_snapshot_header(in, kind)) {
+      return std::string{"Cache error: not a compatible cache file: "}.append(filename);
+    }
+
+    if (!reader(in)) {
+      return std::string{"Cache error: error reading cache file: "}.append(filename);
+    }
+    return std::string{};
+  }
+
+  static void write_map(std::ostream &out, const Map &map)
+  {
+    write_value(out, static_cast<std::int32_t>(map.map_style()));
+    write_value(out, map.marker_length());
+    write_value(out, static_cast<std::uint32_t>(map.markers().size()));
+    for (auto &marker_pair : map.markers()) {
+      auto &marker = marker_pair.second;
+      write_value(out, static_cast<std::int32_t>(marker.id()));
+      write_value(out, static_cast<std::int32_t>(marker.is_fixed() ? 1 : 0));
+      write_value(out, static_cast<std::int32_t>(marker.update_count()));
+      write_transform_with_covariance(out, marker.t_map_marker());
+      write_value(out, static_cast<std::int32_t>(marker.has_corners() ? 1 : 0));
+      if (marker.has_corners()) {
+        for (auto &corner_f_map : marker.corners_f_map()) {
+          auto &p = corner_f_map.point();
+          write_value(out, std::array<double, 3>{p.x(), p.y(), p.z()});
+          write_value(out, corner_f_map.cov());
+        }
+      }
+    }
+  }
+
+  static bool read_map(std::istream &in, std::unique_ptr<Map> &map)
+  {
+    std::int32_t map_style{};
+    double marker_length{};
+    std::uint32_t marker_count{};
+    if (!read_value(in, map_style) || !read_value(in, marker_length) || !read_value(in, marker_count)) {
+      return false;
+    }
+
+    auto map_temp = std::make_unique<Map>(static_cast<Map::MapStyles>(map_style), marker_length);
+    for (std::uint32_t i = 0; i < marker_count; i += 1) {
+      std::int32_t id{}, is_fixed{}, update_count{};
+      TransformWithCovariance t_map_marker{};
+      if (!read_value(in, id) || !read_value(in, is_fixed) || !read_value(in, update_count) ||
+          !read_transform_with_covariance(in, t_map_marker)) {
+        return false;
+      }
+      Marker marker(id, std::move(t_map_marker));
+      marker.set_is_fixed(is_fixed != 0);
+      marker.set_update_count(update_count);
+
+      std::int32_t has_corners{};
+      if (!read_value(in, has_corners)) {
+        return false;
+      }
+      if (has_corners) {
+        std::array<PointWithCovariance, 4> corners_f_map{};
+        for (auto &corner_f_map : corners_f_map) {
+          std::array<double, 3> p{};
+          PointWithCovariance::cov_type cov{};
+          if (!read_value(in, p) || !read_value(in, cov)) {
+            return false;
+          }
+          corner_f_map = PointWithCovariance(tf2::Vector3(p[0], p[1], p[2]), cov);
+        }
+        marker.set_corners_f_map(corners_f_map);
+      }
+
+      map_temp->add_marker(std::move(marker));
+    }
+
+    map.swap(map_temp);
+    return true;
+  }
+
+  std::string to_binary_file(const Map &map, const std::string &filename)
+  {
+    return to_snapshot_file(filename, SnapshotKind::map, [&map](std::ostream &out) -> void
+    {
+      write_map(out, map);
+    });
+  }
+
+  std::string from_binary_file(const std::string &filename, std::unique_ptr<Map> &map)
+  {
+    return from_snapshot_file(filename, SnapshotKind::map, [&map](std::istream &in) -> bool
+    {
+      return read_map(in, map);
+    });
+  }
+
+  std::string to_binary_string(const Map &map)
+  {
+    std::ostringstream out{std::ios::binary};
+    write_snapshot_header(out, SnapshotKind::map);
+    write_map(out, map);
+    return out.str();
+  }
+
+  std::string from_binary_string(const std::string &buffer, std::unique_ptr<Map> &map)
+  {
+    std::istringstream in{buffer, std::ios::binary};
+    if (!read_snapshot_header(in, SnapshotKind::map) || !read_map(in, map)) {
+      return std::string{"Map error: not a valid map snapshot"};
+    }
+    return std::string{};
+  }
+
+  std::string to_binary_file(const TransformWithCovariance &twc, const std::string &filename)
+  {
+    return to_snapshot_file(filename, SnapshotKind::pose, [&twc](std::ostream &out) -> void
+    {
+      write_transform_with_covariance(out, twc);
+    });
+  }
+
+  std::string from_binary_file(const std::string &filename, TransformWithCovariance &twc)
+  {
+    return from_snapshot_file(filename, SnapshotKind::pose, [&twc](std::istream &in) -> bool
+    {
+      return read_transform_with_covariance(in, twc);
+    });
+  }
+
 // ==============================================================================
 // Utility
 // ==============================================================================
@@ -0,0 +1,340 @@
+#include "map_shm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "map.hpp"
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Segment layout
+// ==============================================================================
+
+  // The header at the start of the segment. The map snapshot follows at header_size.
+  // All the fields are atomics because the reader looks at them while the writer
+  // may be changing them.
+  struct SegmentHeader
+  {
+    char magic_[8];
+    // Odd while the writer is updating the segment.
+    std::atomic<std::uint64_t> sequence_;
+    // Incremented each time a map is written. 0 => no map yet.
+    std::atomic<std::uint64_t> version_;
+    std::atomic<std::uint64_t> data_capacity_;
+    std::atomic<std::uint64_t> data_size_;
+    // Different for every writer. Set before the magic and never changed.
+    std::atomic<std::uint64_t> session_;
+    std::atomic<std::uint64_t> writer_pid_;
+  };
+
+  static constexpr char segment_magic[8] = {'F', 'V', 'L', 'A', 'M', 'S', 'H', 'M'};
+  static constexpr std::size_t header_size = 64;
+  static_assert(sizeof(SegmentHeader) <= header_size, "SegmentHeader does not fit");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory atomics must be lock free");
+
+  // The reader checks the segment and the writer on every this many reads.
+  static constexpr int writer_check_period = 64;
+
+  static std::string errno_message(const char *what, const std::string &name)
+  {
+    return std::string{"Map shm error: "}.append(what).append(" '").append(name).append("': ")
+      .append(std::strerror(errno));
+  }
+
+  static std::uint64_t new_session_id()
+  {
+    std::random_device rd{};
+    auto session = (static_cast<std::uint64_t>(rd()) << 32) ^ rd() ^
+                   static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    return session != 0 ? session : 1;
+  }
+
+  // A crashed writer leaves its segment behind. Its map is stale.
+  static bool is_writer_alive(const SegmentHeader *header)
+  {
+    auto pid = static_cast<pid_t>(header->writer_pid_.load(std::memory_order_relaxed));
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+  }
+
+  // True if both descriptors refer to the same shared memory object.
+  static bool is_same_object(int fd_a, int fd_b)
+  {
+    struct stat st_a{};
+    struct stat st_b{};
+    return fstat(fd_a, &st_a) == 0 && fstat(fd_b, &st_b) == 0 &&
+           st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+  }
+
+// ==============================================================================
+// MapShmWriter class
+// ==============================================================================
+
+  MapShmWriter::MapShmWriter(std::string name) :
+    name_{std::move(name)}, session_{new_session_id()}
+  {}
+
+  MapShmWriter::~MapShmWriter()
+  {
+    if (addr_) {
+      munmap(addr_, mapped_size_);
+    }
+    if (fd_ >= 0) {
+      // Remove the segment unless another writer has already replaced it.
+      auto fd = shm_open(name_.c_str(), O_RDONLY, 0);
+      if (fd >= 0) {
+        if (is_same_object(fd, fd_)) {
+          shm_unlink(name_.c_str());
+        }
+        close(fd);
+      }
+      close(fd_);
+    }
+  }
+
+  std::string MapShmWriter::map_segment(std::size_t data_capacity)
+  {
+    // Replace any segment left by an earlier writer. Readers that still have the
+    // old segment mapped notice that it is no longer current and switch over.
+    if (fd_ < 0) {
+      if (shm_unlink(name_.c_str()) != 0 && errno != ENOENT) {
+        return errno_message("can not remove", name_);
+      }
+      fd_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+      if (fd_ < 0) {
+        return errno_message("can not open", name_);
+      }
+    }
+
+    struct stat st{};
+    if (fstat(fd_, &st) != 0) {
+      return errno_message("can not stat", name_);
+    }
+    auto current_size = static_cast<std::size_t>(st.st_size);
+    auto segment_size = std::max(header_size + data_capacity, current_size);
+    if (current_size < segment_size && ftruncate(fd_, static_cast<off_t>(segment_size)) != 0) {
+      return errno_message("can not resize", name_);
+    }
+
+    if (addr_) {
+      munmap(addr_, mapped_size_);
+      addr_ = nullptr;
+    }
+    auto addr = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+      return errno_message("can not map", name_);
+    }
+    addr_ = addr;
+    mapped_size_ = segment_size;
+
+    // A new segment is zero filled. Set it up. A segment that is only being
+    // grown keeps its header.
+    auto header = static_cast<SegmentHeader *>(addr_);
+    if (current_size < header_size) {
+      header->sequence_.store(0, std::memory_order_relaxed);
+      header->version_.store(0, std::memory_order_relaxed);
+      header->data_size_.store(0, std::memory_order_relaxed);
+      header->session_.store(session_, std::memory_order_relaxed);
+      header->writer_pid_.store(static_cast<std::uint64_t>(getpid()), std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      std::copy(std::begin(segment_magic), std::end(segment_magic), header->magic_);
+    }
+    header->data_capacity_.store(segment_size - header_size, std::memory_order_release);
+    return std::string{};
+  }
+
+  std::string MapShmWriter::write(const Map &map)
+  {
+    auto buffer = to_binary_string(map);
+
+    // Leave some room to grow so the segment is not resized on every new marker.
+    if (!addr_ || header_size + buffer.size() > mapped_size_) {
+      auto err_msg = map_segment(buffer.size() * 2);
+      if (!err_msg.empty()) {
+        return err_msg;
+      }
+    }
+
+    // The sequence is odd until this write completes.
+    auto header = static_cast<SegmentHeader *>(addr_);
+    auto sequence = header->sequence_.load(std::memory_order_relaxed) | 1u;
+    header->sequence_.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::memcpy(static_cast<char *>(addr_) + header_size, buffer.data(), buffer.size());
+    header->data_size_.store(buffer.size(), std::memory_order_relaxed);
+    header->version_.store(header->version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    header->sequence_.store(sequence + 1, std::memory_order_release);
+    return std::string{};
+  }
+
+// ==============================================================================
+// MapShmReader class
+// ==============================================================================
+
+  MapShmReader::MapShmReader(std::string name) :
+    name_{std::move(name)}
+  {}
+
+  MapShmReader::~MapShmReader()
+  {
+    close_segment();
+  }
+
+  void MapShmReader::unmap_segment()
+  {
+    if (addr_) {
+      munmap(const_cast<void *>(addr_), mapped_size_);
+      addr_ = nullptr;
+      mapped_size_ = 0;
+    }
+  }
+
+  void MapShmReader::close_segment()
+  {
+    unmap_segment();
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  std::string MapShmReader::check_segment()
+  {
+    reads_until_check_ = writer_check_period;
+
+    // Drop the segment if a new writer has replaced it or the writer has removed it.
+    if (fd_ >= 0) {
+      auto fd = shm_open(name_.c_str(), O_RDONLY, 0);
+      auto is_current = fd >= 0 && is_same_object(fd, fd_);
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (!is_current) {
+        close_segment();
+      }
+    }
+
+    if (!addr_) {
+      auto err_msg = map_segment();
+      if (!err_msg.empty() || !addr_) {
+        return err_msg;
+      }
+    }
+
+    // Don't read a map left by a writer that has died. Check again later because a
+    // new writer will replace the segment.
+    if (!is_writer_alive(static_cast<const SegmentHeader *>(addr_))) {
+      close_segment();
+    }
+    return std::string{};
+  }
+
+  std::string MapShmReader::map_segment()
+  {
+    // The segment not existing yet is not an error. The writer may not have started.
+    if (fd_ < 0) {
+      fd_ = shm_open(name_.c_str(), O_RDONLY, 0);
+      if (fd_ < 0) {
+        return errno == ENOENT ? std::string{} : errno_message("can not open", name_);
+      }
+    }
+
+    struct stat st{};
+    if (fstat(fd_, &st) != 0) {
+      return errno_message("can not stat", name_);
+    }
+    auto segment_size = static_cast<std::size_t>(st.st_size);
+    if (segment_size < header_size) {
+      return std::string{};
+    }
+
+    auto addr = mmap(nullptr, segment_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+      return errno_message("can not map", name_);
+    }
+    addr_ = addr;
+    mapped_size_ = segment_size;
+
+    // The writer sets the magic last. Until then, treat the segment as not there yet.
+    auto header = static_cast<const SegmentHeader *>(addr_);
+    if (!std::equal(std::begin(segment_magic), std::end(segment_magic), header->magic_)) {
+      unmap_segment();
+      return std::string{};
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::string{};
+  }
+
+  std::string MapShmReader::read(std::unique_ptr<Map> &map)
+  {
+    if (reads_until_check_ > 0) {
+      reads_until_check_ -= 1;
+      if (!addr_) {
+        return std::string{};
+      }
+    } else {
+      auto err_msg = check_segment();
+      if (!err_msg.empty() || !addr_) {
+        return err_msg;
+      }
+    }
+
+    // Retry a few times if the writer is busy. If it stays busy, try again on the next call.
+    for (int tries = 0; tries < 16; tries += 1) {
+      auto header = static_cast<const SegmentHeader *>(addr_);
+      auto sequence = header->sequence_.load(std::memory_order_acquire);
+      if (sequence & 1u) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      // Versions restart with each writer.
+      auto session = header->session_.load(std::memory_order_relaxed);
+      auto version = header->version_.load(std::memory_order_relaxed);
+      if (version == 0 || (session == session_ && version == version_)) {
+        return std::string{};
+      }
+
+      // The writer grew the segment. Map the new size and start over.
+      auto data_capacity = header->data_capacity_.load(std::memory_order_relaxed);
+      if (header_size + data_capacity > mapped_size_) {
+        unmap_segment();
+        auto err_msg = map_segment();
+        if (!err_msg.empty() || !addr_) {
+          return err_msg;
+        }
+        continue;
+      }
+
+      auto data_size = header->data_size_.load(std::memory_order_relaxed);
+      if (data_size > data_capacity) {
+        continue;
+      }
+      buffer_.assign(static_cast<const char *>(addr_) + header_size, data_size);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header->sequence_.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+
+      // Only try to decode each version once.
+      session_ = session;
+      version_ = version;
+      return from_binary_string(buffer_, map);
+    }
+    return std::string{};
+  }
+}
@@ -0,0 +1,309 @@
+#include "marker_decoder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "opencv2/aruco.hpp"
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgproc.hpp"
+
+namespace fiducial_vlam
+{
+  // The marker is 6x6 bits with a one cell border.
+  static constexpr int marker_bits = 6;
+  static constexpr int marker_cells = marker_bits + 2;
+
+  // Same defaults as cv::aruco::DetectorParameters
+  static constexpr int adaptive_thresh_win_size = 23;
+  static constexpr double adaptive_thresh_constant = 7.0;
+  static constexpr double min_marker_perimeter_rate = 0.03;
+  static constexpr double max_marker_perimeter_rate = 4.0;
+  static constexpr double polygonal_approx_accuracy_rate = 0.03;
+  static constexpr double max_erroneous_bits_in_border_rate = 0.35;
+  static constexpr int min_contrast = 10;
+
+  // Each cell is read from a grid of cell_samples x cell_samples pixels over the center half of
+  // the cell. The cell is white if most of its samples are.
+  static constexpr int cell_samples = 3;
+
+  // Two decodes are of the same marker if their corners are on average closer than this
+  // fraction of the side of the larger one. The two edges of the black border are 1/8 of a
+  // side apart along each axis.
+  static constexpr double same_marker_distance_rate = 0.25;
+
+  using Code = std::uint64_t;
+
+  struct CodeMatch
+  {
+    int id_;
+    int rotation_;
+  };
+
+// ==============================================================================
+// CodeTable
+// ==============================================================================
+
+  // All the codewords of the dictionary, in all four rotations, plus every
+  // codeword with a single bit error. Codewords that would be ambiguous are left out.
+  class CodeTable
+  {
+    std::unordered_map<Code, CodeMatch> table_{};
+    std::unordered_set<Code> ambiguous_{};
+
+    void add(Code code, CodeMatch match)
+    {
+      if (ambiguous_.count(code)) {
+        return;
+      }
+      auto it = table_.find(code);
+      if (it == table_.end()) {
+        table_.emplace(code, match);
+      } else if (it->second.id_ != match.id_ || it->second.rotation_ != match.rotation_) {
+        table_.erase(it);
+        ambiguous_.emplace(code);
+      }
+    }
+
+  public:
+    CodeTable()
+    {
+      auto dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
+      std::vector<std::pair<Code, CodeMatch>> exact{};
+
+      for (int id = 0; id < dictionary->bytesList.rows; id += 1) {
+        cv::Mat bits = cv::aruco::Dictionary::getBitsFromByteList(dictionary->bytesList.rowRange(id, id + 1),
+                                                                   dictionary->markerSize);
+
+        // The rotations are the same as in cv::aruco::Dictionary::getByteListFromBits.
+        for (int rotation = 0; rotation < 4; rotation += 1) {
+          Code code = 0;
+          for (int row = 0; row < marker_bits; row += 1) {
+            for (int col = 0; col < marker_bits; col += 1) {
+              uchar bit = rotation == 0 ? bits.at<uchar>(row, col) :
+                          rotation == 1 ? bits.at<uchar>(col, marker_bits - 1 - row) :
+                          rotation == 2 ? bits.at<uchar>(marker_bits - 1 - row, marker_bits - 1 - col) :
+                          bits.at<uchar>(marker_bits - 1 - col, row);
+              code = (code << 1) | (bit ? 1 : 0);
+            }
+          }
+          exact.emplace_back(code, CodeMatch{id, rotation});
+        }
+      }
+
+      // Exact codes first so a single bit error can't hide an exact match.
+      std::unordered_set<Code> exact_codes{};
+      for (auto &code_match : exact) {
+        table_[code_match.first] = code_match.second;
+        exact_codes.emplace(code_match.first);
+      }
+      for (auto &code_match : exact) {
+        for (int b = 0; b < marker_bits * marker_bits; b += 1) {
+          auto code = code_match.first ^ (Code{1} << b);
+          if (!exact_codes.count(code)) {
+            add(code, code_match.second);
+          }
+        }
+      }
+    }
+
+    const CodeMatch *find(Code code) const
+    {
+      auto it = table_.find(code);
+      return it == table_.end() ? nullptr : &it->second;
+    }
+  };
+
+  static const CodeTable &code_table()
+  {
+    static const CodeTable table{};
+    return table;
+  }
+
+// ==============================================================================
+// Candidate search and decoding
+// ==============================================================================
+
+  // Find the convex quads in the thresholded image. The corners are in clockwise order.
+  static void find_candidates(const cv::Mat &gray, std::vector<std::vector<cv::Point2f>> &candidates)
+  {
+    cv::Mat thresholded;
+    cv::adaptiveThreshold(gray, thresholded, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV,
+                          adaptive_thresh_win_size, adaptive_thresh_constant);
+
+    std::vector<std::vector<cv::Point>> contours;
+    cv::findContours(thresholded, contours, cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+
+    auto max_dimension = static_cast<double>(std::max(gray.cols, gray.rows));
+    auto min_perimeter = min_marker_perimeter_rate * max_dimension;
+    auto max_perimeter = max_marker_perimeter_rate * max_dimension;
+
+    std::vector<cv::Point> approx;
+    for (auto &contour : contours) {
+      if (contour.size() < min_perimeter || contour.size() > max_perimeter) {
+        continue;
+      }
+
+      cv::approxPolyDP(contour, approx, contour.size() * polygonal_approx_accuracy_rate, true);
+      if (approx.size() != 4 || !cv::isContourConvex(approx)) {
+        continue;
+      }
+
+      std::vector<cv::Point2f> quad{approx.begin(), approx.end()};
+
+      // Make the corners clockwise, the same as cv::aruco.
+      auto d1 = quad[1] - quad[0];
+      auto d2 = quad[2] - quad[0];
+      if (d1.x * d2.y - d1.y * d2.x < 0.0) {
+        std::swap(quad[1], quad[3]);
+      }
+
+      candidates.emplace_back(std::move(quad));
+    }
+  }
+
+  // Sample the cell centers through the homography of the quad, read each cell by a majority
+  // of its samples, and look up the code.
+  static const CodeMatch *decode_candidate(const cv::Mat &gray, const std::vector<cv::Point2f> &quad)
+  {
+    static constexpr float side = marker_cells;
+    static const std::vector<cv::Point2f> canonical{{0.f, 0.f}, {side, 0.f}, {side, side}, {0.f, side}};
+    cv::Matx33d h = cv::getPerspectiveTransform(canonical, quad);
+
+    static constexpr int samples_per_cell = cell_samples * cell_samples;
+    std::array<std::array<uchar, samples_per_cell>, marker_cells * marker_cells> samples{};
+    int min_mean = 255 * samples_per_cell;
+    int max_mean = 0;
+    for (int row = 0; row < marker_cells; row += 1) {
+      for (int col = 0; col < marker_cells; col += 1) {
+        auto &cell = samples[row * marker_cells + col];
+        int sum = 0;
+        for (int i = 0; i < samples_per_cell; i += 1) {
+          auto u = col + 0.25 + 0.5 * (i % cell_samples + 0.5) / cell_samples;
+          auto v = row + 0.25 + 0.5 * (i / cell_samples + 0.5) / cell_samples;
+          cv::Vec3d p = h * cv::Vec3d{u, v, 1.0};
+          auto x = static_cast<int>(p[0] / p[2] + 0.5);
+          auto y = static_cast<int>(p[1] / p[2] + 0.5);
+          if (x < 0 || y < 0 || x >= gray.cols || y >= gray.rows) {
+            return nullptr;
+          }
+          cell[i] = gray.at<uchar>(y, x);
+          sum += cell[i];
+        }
+        min_mean = std::min(min_mean, sum);
+        max_mean = std::max(max_mean, sum);
+      }
+    }
+
+    // The threshold is halfway between the darkest and the lightest cell.
+    if (max_mean - min_mean < min_contrast * samples_per_cell) {
+      return nullptr;
+    }
+    int threshold = (min_mean + max_mean) / (2 * samples_per_cell);
+
+    std::array<bool, marker_cells * marker_cells> is_white{};
+    for (std::size_t c = 0; c < samples.size(); c += 1) {
+      auto white_samples = std::count_if(samples[c].begin(), samples[c].end(), [threshold](uchar sample) -> bool
+      { return sample > threshold; });
+      is_white[c] = white_samples * 2 > samples_per_cell;
+    }
+
+    // The border should be black.
+    int border_errors = 0;
+    for (int row = 0; row < marker_cells; row += 1) {
+      for (int col = 0; col < marker_cells; col += 1) {
+        bool is_border = row == 0 || col == 0 || row == marker_cells - 1 || col == marker_cells - 1;
+        if (is_border && is_white[row * marker_cells + col]) {
+          border_errors += 1;
+        }
+      }
+    }
+    if (border_errors > static_cast<int>(max_erroneous_bits_in_border_rate * (marker_cells - 1) * 4)) {
+      return nullptr;
+    }
+
+    Code code = 0;
+    for (int row = 1; row <= marker_bits; row += 1) {
+      for (int col = 1; col <= marker_bits; col += 1) {
+        code = (code << 1) | (is_white[row * marker_cells + col] ? 1 : 0);
+      }
+    }
+
+    return code_table().find(code);
+  }
+
+  // The mean distance between the corners of two quads, for the rotation of one that brings
+  // them closest.
+  static double mean_corner_distance(const std::vector<cv::Point2f> &a, const std::vector<cv::Point2f> &b)
+  {
+    double best = std::numeric_limits<double>::max();
+    for (std::size_t shift = 0; shift < 4; shift += 1) {
+      double sum = 0.;
+      for (std::size_t j = 0; j < 4; j += 1) {
+        sum += cv::norm(a[j] - b[(j + shift) % 4]);
+      }
+      best = std::min(best, sum / 4.);
+    }
+    return best;
+  }
+
+// ==============================================================================
+// MarkerDecoder class
+// ==============================================================================
+
+  void MarkerDecoder::detect_markers(const cv::Mat &gray,
+                                     std::vector<std::vector<cv::Point2f>> &corners,
+                                     std::vector<int> &ids,
+                                     bool refine_corners) const
+  {
+    corners.clear();
+    ids.clear();
+
+    std::vector<std::vector<cv::Point2f>> candidates;
+    find_candidates(gray, candidates);
+
+    std::vector<double> perimeters;
+    for (auto &candidate : candidates) {
+      auto match = decode_candidate(gray, candidate);
+      if (match == nullptr) {
+        continue;
+      }
+
+      // Put the first corner at the top left of the marker, the same as cv::aruco.
+      std::rotate(candidate.begin(), candidate.begin() + 4 - match->rotation_, candidate.end());
+      auto perimeter = cv::arcLength(candidate, true);
+
+      // Both edges of the black border can decode as one marker. Keep the outer one. Markers
+      // are told apart by where they are, so two copies of one id are both kept.
+      auto same = std::find_if(corners.begin(), corners.end(), [&](const std::vector<cv::Point2f> &other) -> bool
+      {
+        auto i = &other - corners.data();
+        auto larger_side = std::max(perimeter, perimeters[i]) / 4.;
+        return mean_corner_distance(candidate, other) < same_marker_distance_rate * larger_side;
+      });
+      if (same != corners.end()) {
+        auto i = same - corners.begin();
+        if (perimeter > perimeters[i]) {
+          ids[i] = match->id_;
+          corners[i] = candidate;
+          perimeters[i] = perimeter;
+        }
+        continue;
+      }
+
+      ids.emplace_back(match->id_);
+      corners.emplace_back(candidate);
+      perimeters.emplace_back(perimeter);
+    }
+
+    if (refine_corners) {
+      for (auto &marker_corners : corners) {
+        cv::cornerSubPix(gray, marker_corners, cv::Size{5, 5}, cv::Size{-1, -1},
+                         cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 30, 0.1));
+      }
+    }
+  }
+}
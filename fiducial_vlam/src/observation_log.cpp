@@ -0,0 +1,181 @@
+#include "observation_log.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace fiducial_vlam
+{
+  static const char log_magic[8]{'F', 'V', 'L', 'A', 'M', 'O', 'B', 'S'};
+  static const std::uint32_t log_version{1};
+
+  template<typename T>
+  static void write_value(std::ostream &out, const T &value)
+  {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  template<typename T>
+  static bool read_value(std::istream &in, T &value)
+  {
+    in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return in.good();
+  }
+
+  static void write_string(std::ostream &out, const std::string &s)
+  {
+    write_value(out, static_cast<std::uint32_t>(s.size()));
+    out.write(s.data(), s.size());
+  }
+
+  static bool read_string(std::istream &in, std::string &s)
+  {
+    std::uint32_t size{};
+    if (!read_value(in, size)) {
+      return false;
+    }
+    s.resize(size);
+    in.read(&s[0], size);
+    return in.good();
+  }
+
+  static void write_header(std::ostream &out, const std_msgs::msg::Header &header)
+  {
+    write_value(out, header.stamp.sec);
+    write_value(out, header.stamp.nanosec);
+    write_string(out, header.frame_id);
+  }
+
+  static bool read_header(std::istream &in, std_msgs::msg::Header &header)
+  {
+    return read_value(in, header.stamp.sec) &&
+           read_value(in, header.stamp.nanosec) &&
+           read_string(in, header.frame_id);
+  }
+
+  static void write_camera_info(std::ostream &out, const sensor_msgs::msg::CameraInfo &msg)
+  {
+    write_header(out, msg.header);
+    write_value(out, msg.height);
+    write_value(out, msg.width);
+    write_string(out, msg.distortion_model);
+    write_value(out, static_cast<std::uint32_t>(msg.d.size()));
+    for (auto d : msg.d) {
+      write_value(out, d);
+    }
+    write_value(out, msg.k);
+    write_value(out, msg.r);
+    write_value(out, msg.p);
+    write_value(out, msg.binning_x);
+    write_value(out, msg.binning_y);
+    write_value(out, msg.roi.x_offset);
+    write_value(out, msg.roi.y_offset);
+    write_value(out, msg.roi.height);
+    write_value(out, msg.roi.width);
+    write_value(out, static_cast<std::uint8_t>(msg.roi.do_rectify ? 1 : 0));
+  }
+
+  static bool read_camera_info(std::istream &in, sensor_msgs::msg::CameraInfo &msg)
+  {
+    std::uint32_t d_size{};
+    if (!read_header(in, msg.header) ||
+        !read_value(in, msg.height) ||
+        !read_value(in, msg.width) ||
+        !read_string(in, msg.distortion_model) ||
+        !read_value(in, d_size)) {
+      return false;
+    }
+    msg.d.resize(d_size);
+    for (auto &d : msg.d) {
+      if (!read_value(in, d)) {
+        return false;
+      }
+    }
+    std::uint8_t do_rectify{};
+    if (!read_value(in, msg.k) ||
+        !read_value(in, msg.r) ||
+        !read_value(in, msg.p) ||
+        !read_value(in, msg.binning_x) ||
+        !read_value(in, msg.binning_y) ||
+        !read_value(in, msg.roi.x_offset) ||
+        !read_value(in, msg.roi.y_offset) ||
+        !read_value(in, msg.roi.height) ||
+        !read_value(in, msg.roi.width) ||
+        !read_value(in, do_rectify)) {
+      return false;
+    }
+    msg.roi.do_rectify = do_rectify != 0;
+    return true;
+  }
+
+// ==============================================================================
+// ObservationLogWriter class
+// ==============================================================================
+
+  ObservationLogWriter::ObservationLogWriter(const std::string &filename) :
+    out_{filename, std::ios::binary | std::ios::trunc}
+  {
+    out_.write(log_magic, sizeof(log_magic));
+    write_value(out_, log_version);
+  }
+
+  void ObservationLogWriter::write(const fiducial_vlam_msgs::msg::Observations &msg)
+  {
+    write_header(out_, msg.header);
+    write_camera_info(out_, msg.camera_info);
+    write_value(out_, static_cast<std::uint32_t>(msg.observations.size()));
+    for (auto &obs : msg.observations) {
+      write_value(out_, obs.id);
+      write_value(out_, std::array<double, 8>{obs.x0, obs.y0, obs.x1, obs.y1, obs.x2, obs.y2, obs.x3, obs.y3});
+    }
+  }
+
+// ==============================================================================
+// Replay
+// ==============================================================================
+
+  std::string from_observation_log(const std::string &filename,
+                                   const std::function<void(const fiducial_vlam_msgs::msg::Observations &)> &callback)
+  {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+      return std::string{"Replay error: can not open observation log: "}.append(filename);
+    }
+
+    char magic[sizeof(log_magic)]{};
+    std::uint32_t version{};
+    in.read(magic, sizeof(magic));
+    if (!in.good() || !std::equal(std::begin(magic), std::end(magic), std::begin(log_magic)) ||
+        !read_value(in, version) || version != log_version) {
+      return std::string{"Replay error: not a compatible observation log: "}.append(filename);
+    }
+
+    // The message is reused. Every field is overwritten by each read.
+    fiducial_vlam_msgs::msg::Observations msg{};
+    while (in.peek() != std::ifstream::traits_type::eof()) {
+      std::uint32_t count{};
+      if (!read_header(in, msg.header) || !read_camera_info(in, msg.camera_info) || !read_value(in, count)) {
+        return std::string{"Replay error: truncated observation log: "}.append(filename);
+      }
+
+      msg.observations.resize(count);
+      for (auto &obs : msg.observations) {
+        std::array<double, 8> corners{};
+        if (!read_value(in, obs.id) || !read_value(in, corners)) {
+          return std::string{"Replay error: truncated observation log: "}.append(filename);
+        }
+        obs.x0 = corners[0];
+        obs.y0 = corners[1];
+        obs.x1 = corners[2];
+        obs.y1 = corners[3];
+        obs.x2 = corners[4];
+        obs.y2 = corners[5];
+        obs.x3 = corners[6];
+        obs.y3 = corners[7];
+      }
+
+      callback(msg);
+    }
+    return std::string{};
+  }
+}
@@ -0,0 +1,71 @@
+#include "quality_governor.hpp"
+
+#include <algorithm>
+
+namespace fiducial_vlam
+{
+  // The weight of the newest sample in the smoothed latency and CPU usage.
+  static constexpr double smoothing = 0.1;
+
+  QualityGovernor::QualityGovernor(int max_tier, double target_latency, double target_cpu,
+                                   double hysteresis, int hold_frames) :
+    max_tier_{std::max(0, max_tier)},
+    target_latency_{target_latency},
+    target_cpu_{target_cpu},
+    hysteresis_{hysteresis},
+    hold_frames_{hold_frames}
+  {}
+
+  void QualityGovernor::start_frame()
+  {
+    frame_start_ = std::chrono::steady_clock::now();
+  }
+
+  bool QualityGovernor::end_frame()
+  {
+    auto now = std::chrono::steady_clock::now();
+    auto now_cpu = std::clock();
+
+    // The latency is the processing time of this frame. The CPU usage is measured over the
+    // time since the end of the last frame so it includes the work done by other threads.
+    double latency = std::chrono::duration<double>(now - frame_start_).count();
+    if (!has_samples_) {
+      has_samples_ = true;
+      latency_ = latency;
+    } else {
+      double wall = std::chrono::duration<double>(now - last_frame_end_).count();
+      double cpu = wall > 0.0 ? static_cast<double>(now_cpu - last_frame_end_cpu_) / CLOCKS_PER_SEC / wall : cpu_;
+      latency_ += smoothing * (latency - latency_);
+      cpu_ += smoothing * (cpu - cpu_);
+    }
+    last_frame_end_ = now;
+    last_frame_end_cpu_ = now_cpu;
+
+    frames_since_change_ += 1;
+    if (frames_since_change_ < hold_frames_) {
+      return false;
+    }
+
+    // The load is the largest fraction of a target in use.
+    double load = 0.0;
+    if (target_latency_ > 0.0) {
+      load = std::max(load, latency_ / target_latency_);
+    }
+    if (target_cpu_ > 0.0) {
+      load = std::max(load, cpu_ / target_cpu_);
+    }
+
+    auto old_tier = tier_;
+    if (load > 1.0 && tier_ < max_tier_) {
+      tier_ += 1;
+    } else if (load < 1.0 - hysteresis_ && tier_ > 0) {
+      tier_ -= 1;
+    }
+
+    if (tier_ == old_tier) {
+      return false;
+    }
+    frames_since_change_ = 0;
+    return true;
+  }
+}
@@ -0,0 +1,48 @@
+#include "rig.hpp"
+
+#include <sstream>
+
+namespace fiducial_vlam
+{
+  std::string Rig::from_string(const std::string &extrinsics, std::unique_ptr<Rig> &rig)
+  {
+    auto new_rig = std::make_unique<Rig>();
+    std::istringstream cameras{extrinsics};
+    std::string camera{};
+
+    while (std::getline(cameras, camera, ';')) {
+      std::istringstream fields{camera};
+      std::string frame_id{};
+      if (!(fields >> frame_id)) {
+        continue; // Allow empty entries, e.g. a trailing ';'
+      }
+
+      TransformWithCovariance::mu_type mu{};
+      for (auto &value : mu) {
+        if (!(fields >> value)) {
+          return std::string{"Rig error: expected x y z roll pitch yaw for camera "}.append(frame_id);
+        }
+      }
+      std::string extra{};
+      if (fields >> extra) {
+        return std::string{"Rig error: unexpected '"}.append(extra).append("' for camera ").append(frame_id);
+      }
+      if (!new_rig->t_base_cameras_.emplace(frame_id, TransformWithCovariance{mu}).second) {
+        return std::string{"Rig error: camera listed twice: "}.append(frame_id);
+      }
+    }
+
+    if (new_rig->t_base_cameras_.empty()) {
+      return std::string{"Rig error: no cameras"};
+    }
+
+    rig = std::move(new_rig);
+    return std::string{};
+  }
+
+  const TransformWithCovariance *Rig::find_t_base_camera(const std::string &frame_id) const
+  {
+    auto it = t_base_cameras_.find(frame_id);
+    return it == t_base_cameras_.end() ? nullptr : &it->second;
+  }
+}
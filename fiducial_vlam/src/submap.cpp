@@ -0,0 +1,323 @@
+#include "submap.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <set>
+
+#include "fiducial_math.hpp"
+#include "map.hpp"
+#include "observation.hpp"
+#include "sam_util.hpp"
+#include "task_scheduler.hpp"
+#include "transform_with_covariance.hpp"
+
+#include <gtsam/geometry/Pose3.h>
+#include "gtsam/inference/Symbol.h"
+#include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+
+namespace fiducial_vlam
+{
+  // A submap frame that moves less than this, in meters and radians, keeps its pose so
+  // its markers don't have to be copied into the map again.
+  static constexpr double submap_move_tolerance = 1.0e-4;
+
+// ==============================================================================
+// Submaps::Submap class
+// ==============================================================================
+
+  class Submaps::Submap
+  {
+  public:
+    // The pose of the submap frame in the map frame. The top-level graph moves this.
+    gtsam::Pose3 t_map_submap_;
+
+    // The markers of this submap, both home and guest, in the submap frame.
+    Map map_;
+
+    // A submap that holds a fixed marker does not move in the top-level graph.
+    bool is_anchored_{false};
+
+    std::unique_ptr<FiducialMath> fm_{};
+
+    Submap(const gtsam::Pose3 &t_map_submap, Map::MapStyles map_style, double marker_length) :
+      t_map_submap_{t_map_submap}, map_{map_style, marker_length}
+    {}
+
+    void prepare_fiducial_math(const FiducialMathFactory &fm_factory,
+                               const sensor_msgs::msg::CameraInfo &camera_info_msg)
+    {
+      if (!fm_ || !fm_->camera_info().is_built_from(camera_info_msg)) {
+        fm_ = fm_factory(camera_info_msg);
+      }
+    }
+
+    void update_map(const TransformWithCovariance &t_map_camera, const Observations &observations)
+    {
+      auto t_submap_camera = t_map_submap_.inverse() * to_pose3(t_map_camera.transform());
+      fm_->update_map(TransformWithCovariance{to_tf2_transform(t_submap_camera), t_map_camera.cov()},
+                      observations, map_);
+    }
+  };
+
+// ==============================================================================
+// Submaps class
+// ==============================================================================
+
+  Submaps::Submaps(double radius, FiducialMathFactory fm_factory, const Map &map) :
+    radius_{radius}, fm_factory_{std::move(fm_factory)}
+  {
+    for (auto &marker_pair : map.markers()) {
+      auto &marker = marker_pair.second;
+      auto submap_idx = find_home(marker.t_map_marker(), map);
+      home_.emplace(marker.id(), submap_idx);
+      add_marker(submap_idx, marker.t_map_marker(), marker.id(), marker.is_fixed(), marker.update_count());
+    }
+  }
+
+  Submaps::~Submaps() = default;
+
+  std::size_t Submaps::find_home(const TransformWithCovariance &t_map_marker, const Map &map)
+  {
+    auto &c = t_map_marker.transform().getOrigin();
+    gtsam::Point3 marker_f_map{c.x(), c.y(), c.z()};
+
+    auto best_distance = std::numeric_limits<double>::max();
+    std::size_t best_idx = 0;
+    for (std::size_t i = 0; i < submaps_.size(); i += 1) {
+      auto distance = (submaps_[i]->t_map_submap_.translation() - marker_f_map).norm();
+      if (distance < best_distance) {
+        best_distance = distance;
+        best_idx = i;
+      }
+    }
+
+    if (best_distance <= radius_) {
+      return best_idx;
+    }
+
+    // Start a new submap with its frame at this marker.
+    submaps_.emplace_back(std::make_unique<Submap>(to_pose3(t_map_marker.transform()),
+                                                   map.map_style(), map.marker_length()));
+    links_.emplace_back();
+    return submaps_.size() - 1;
+  }
+
+  void Submaps::add_marker(std::size_t submap_idx, const TransformWithCovariance &t_map_marker,
+                           int id, bool is_fixed, int update_count)
+  {
+    auto &submap = *submaps_[submap_idx];
+    auto t_submap_marker = submap.t_map_submap_.inverse() * to_pose3(t_map_marker.transform());
+    Marker marker{id, TransformWithCovariance{to_tf2_transform(t_submap_marker), t_map_marker.cov()}};
+    marker.set_is_fixed(is_fixed);
+    marker.set_update_count(update_count);
+    submap.map_.add_marker(std::move(marker));
+
+    auto home_it = home_.find(id);
+    if (home_it == home_.end()) {
+      return;
+    }
+    if (home_it->second != submap_idx) {
+      links_[home_it->second].insert(submap_idx);
+      links_[submap_idx].insert(home_it->second);
+    } else if (is_fixed) {
+      submap.is_anchored_ = true;
+    }
+  }
+
+  void Submaps::update_map(const TransformWithCovariance &t_map_camera,
+                           const Observations &observations,
+                           const sensor_msgs::msg::CameraInfo &camera_info_msg,
+                           FiducialMath &fm,
+                           Map &map)
+  {
+    if (!t_map_camera.is_valid() || observations.size() < 2) {
+      return;
+    }
+
+    // Find the submaps that this frame touches. A new marker goes to the nearest
+    // submap or starts a new one.
+    std::vector<std::size_t> touched{};
+    for (auto &observation : observations.observations()) {
+      auto home_it = home_.find(observation.id());
+      if (home_it == home_.end()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        auto t_map_marker = marker_ptr != nullptr ? marker_ptr->t_map_marker() :
+                            TransformWithCovariance{t_map_camera.transform() *
+                                                    fm.solve_t_camera_marker(observation, map.marker_length())
+                                                      .transform()};
+        home_it = home_.emplace(observation.id(), find_home(t_map_marker, map)).first;
+      }
+      if (std::find(touched.begin(), touched.end(), home_it->second) == touched.end()) {
+        touched.emplace_back(home_it->second);
+      }
+    }
+
+    // A touched submap takes the other observed markers that are already in the map as guests.
+    // New markers are added to every touched submap by the update.
+    for (auto submap_idx : touched) {
+      auto &submap = *submaps_[submap_idx];
+      submap.prepare_fiducial_math(fm_factory_, camera_info_msg);
+      for (auto &observation : observations.observations()) {
+        auto marker_ptr = map.find_marker(observation.id());
+        if (marker_ptr != nullptr && submap.map_.find_marker(observation.id()) == nullptr) {
+          add_marker(submap_idx, marker_ptr->t_map_marker(), marker_ptr->id(),
+                     marker_ptr->is_fixed(), marker_ptr->update_count());
+        }
+      }
+    }
+
+    // Update the touched submaps in parallel. Each has its own FiducialMath.
+    auto &scheduler = TaskScheduler::instance();
+    std::vector<std::future<void>> futures{};
+    for (std::size_t i = 1; i < touched.size(); i += 1) {
+      auto &submap = *submaps_[touched[i]];
+      futures.emplace_back(scheduler.submit(TaskPriority::normal, [&submap, &t_map_camera, &observations]() -> void
+      {
+        submap.update_map(t_map_camera, observations);
+      }));
+    }
+    submaps_[touched[0]]->update_map(t_map_camera, observations);
+    for (auto &future : futures) {
+      scheduler.wait(future, TaskPriority::normal);
+    }
+
+    // Only realign if a touched submap shares markers with another submap.
+    std::vector<std::size_t> moved{};
+    if (std::any_of(touched.begin(), touched.end(), [this](std::size_t submap_idx) -> bool
+    {
+      return !links_[submap_idx].empty();
+    })) {
+      moved = align_submaps(touched);
+    }
+
+    // Copy the markers of the touched and moved submaps into the map.
+    for (auto submap_idx : moved) {
+      if (std::find(touched.begin(), touched.end(), submap_idx) == touched.end()) {
+        touched.emplace_back(submap_idx);
+      }
+    }
+    for (auto submap_idx : touched) {
+      compose_into_map(submap_idx, fm, map);
+    }
+  }
+
+  // Solve for the frames of the touched submaps and their direct neighbours with a between
+  // factor for each marker that is in two submaps. The submaps linked to these from outside
+  // hold their frames and tie the solve to the rest of the map. Returns the submaps whose
+  // frames moved.
+  std::vector<std::size_t> Submaps::align_submaps(const std::vector<std::size_t> &touched)
+  {
+    // Used when the markers have no covariance.
+    static const gtsam::SharedNoiseModel default_noise = gtsam::noiseModel::Diagonal::Sigmas(
+      (gtsam::Vector6{} << 0.01, 0.01, 0.01, 0.01, 0.01, 0.01).finished());
+    // Keeps a submap that has no shared markers from making the graph singular.
+    static const gtsam::SharedNoiseModel loose_noise = gtsam::noiseModel::Isotropic::Sigma(6, 100.0);
+    static const gtsam::SharedNoiseModel anchored_noise = gtsam::noiseModel::Constrained::All(6);
+
+    std::set<std::size_t> solved{touched.begin(), touched.end()};
+    for (auto submap_idx : touched) {
+      solved.insert(links_[submap_idx].begin(), links_[submap_idx].end());
+    }
+    std::set<std::size_t> held{};
+    for (auto submap_idx : solved) {
+      for (auto link_idx : links_[submap_idx]) {
+        if (solved.count(link_idx) == 0) {
+          held.insert(link_idx);
+        }
+      }
+    }
+    std::set<std::size_t> in_graph{solved};
+    in_graph.insert(held.begin(), held.end());
+
+    gtsam::NonlinearFactorGraph graph{};
+    gtsam::Values initial{};
+    bool any_anchored = !held.empty() || std::any_of(solved.begin(), solved.end(), [this](std::size_t submap_idx)
+    {
+      return submaps_[submap_idx]->is_anchored_;
+    });
+
+    for (auto b : in_graph) {
+      auto &submap = *submaps_[b];
+      gtsam::Symbol key_b{'s', b};
+      initial.insert(key_b, submap.t_map_submap_);
+
+      bool is_anchored = submap.is_anchored_ || held.count(b) != 0 || (!any_anchored && b == *solved.begin());
+      graph.emplace_shared<gtsam::PriorFactor<gtsam::Pose3>>(
+        key_b, submap.t_map_submap_,
+        is_anchored ? anchored_noise : loose_noise);
+
+      // For a guest marker m from submap a: t_a_b = t_a_m * t_m_b. The covariance of the
+      // marker in each submap is moved into the tangent space of t_a_b. A link between two
+      // held submaps does not constrain anything.
+      for (auto &marker_pair : submap.map_.markers()) {
+        auto a = home_.at(marker_pair.first);
+        if (a == b || in_graph.count(a) == 0 || (held.count(a) != 0 && held.count(b) != 0)) {
+          continue;
+        }
+        auto home_marker_ptr = submaps_[a]->map_.find_marker(marker_pair.first);
+        if (home_marker_ptr == nullptr) {
+          continue;
+        }
+
+        auto t_a_marker = to_pose3(home_marker_ptr->t_map_marker().transform());
+        auto t_b_marker = to_pose3(marker_pair.second.t_map_marker().transform());
+        gtsam::Matrix6 cov = to_cov_sam(home_marker_ptr->t_map_marker().cov()) +
+                             to_cov_sam(marker_pair.second.t_map_marker().cov());
+        gtsam::Matrix6 adjoint = t_b_marker.AdjointMap();
+
+        graph.emplace_shared<gtsam::BetweenFactor<gtsam::Pose3>>(
+          gtsam::Symbol{'s', a}, key_b, t_a_marker * t_b_marker.inverse(),
+          cov(0, 0) == 0.0 ? default_noise :
+          gtsam::SharedNoiseModel{gtsam::noiseModel::Gaussian::Covariance(adjoint * cov * adjoint.transpose())});
+      }
+    }
+
+    auto result = gtsam::LevenbergMarquardtOptimizer(graph, initial).optimize();
+
+    std::vector<std::size_t> moved{};
+    for (auto i : solved) {
+      auto t_map_submap = result.at<gtsam::Pose3>(gtsam::Symbol{'s', i});
+      gtsam::Vector6 move = gtsam::Pose3::Logmap(submaps_[i]->t_map_submap_.between(t_map_submap));
+      if (move.cwiseAbs().maxCoeff() > submap_move_tolerance) {
+        submaps_[i]->t_map_submap_ = t_map_submap;
+        moved.emplace_back(i);
+      }
+    }
+    return moved;
+  }
+
+  // Copy the home markers of a submap into the map frame. The covariances are in the tangent
+  // space of the marker pose so they don't change when the pose moves to the map frame.
+  void Submaps::compose_into_map(std::size_t submap_idx, FiducialMath &fm, Map &map)
+  {
+    auto &submap = *submaps_[submap_idx];
+    for (auto &marker_pair : submap.map_.markers()) {
+      if (home_.at(marker_pair.first) != submap_idx) {
+        continue;
+      }
+
+      auto &local = marker_pair.second;
+      auto t_map_marker = TransformWithCovariance{
+        to_tf2_transform(submap.t_map_submap_ * to_pose3(local.t_map_marker().transform())),
+        local.t_map_marker().cov()};
+
+      auto marker_ptr = map.find_marker(local.id());
+      if (marker_ptr == nullptr) {
+        map.add_marker(Marker{local.id(), t_map_marker});
+        marker_ptr = map.find_marker(local.id());
+      } else if (marker_ptr->is_fixed()) {
+        continue;
+      } else {
+        marker_ptr->set_t_map_marker(t_map_marker);
+      }
+      marker_ptr->set_update_count(local.update_count());
+
+      if (map.map_style() == Map::MapStyles::corners) {
+        fm.update_marker_corners(*marker_ptr, map.marker_length());
+      }
+    }
+  }
+}
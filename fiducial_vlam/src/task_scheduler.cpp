@@ -0,0 +1,139 @@
+#include "task_scheduler.hpp"
+
+#include <algorithm>
+
+namespace fiducial_vlam
+{
+  // The worker queue of the current thread. 0 => not a worker thread.
+  static thread_local const TaskScheduler *current_scheduler{nullptr};
+  static thread_local std::size_t current_queue{0};
+
+  static std::mutex instance_mutex{};
+  static std::unique_ptr<TaskScheduler> instance_scheduler{};
+
+  static std::size_t default_thread_count()
+  {
+    auto cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 1;
+  }
+
+// ==============================================================================
+// TaskScheduler class
+// ==============================================================================
+
+  TaskScheduler::TaskScheduler(std::size_t thread_count)
+  {
+    thread_count = std::max(thread_count, std::size_t{1});
+    for (std::size_t i = 0; i <= thread_count; i += 1) {
+      queues_.emplace_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 1; i <= thread_count; i += 1) {
+      threads_.emplace_back([this, i]() -> void
+                            { run(i); });
+    }
+  }
+
+  TaskScheduler::~TaskScheduler()
+  {
+    {
+      std::lock_guard<std::mutex> lock{sleep_mutex_};
+      stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  TaskScheduler &TaskScheduler::instance()
+  {
+    std::lock_guard<std::mutex> lock{instance_mutex};
+    if (!instance_scheduler) {
+      instance_scheduler = std::make_unique<TaskScheduler>(default_thread_count());
+    }
+    return *instance_scheduler;
+  }
+
+  bool TaskScheduler::configure(std::size_t thread_count)
+  {
+    std::lock_guard<std::mutex> lock{instance_mutex};
+    if (thread_count == 0) {
+      thread_count = default_thread_count();
+    }
+    if (!instance_scheduler) {
+      instance_scheduler = std::make_unique<TaskScheduler>(thread_count);
+    }
+    return instance_scheduler->thread_count() == thread_count;
+  }
+
+  std::size_t TaskScheduler::this_queue() const
+  {
+    return current_scheduler == this ? current_queue : 0;
+  }
+
+  // Count the task before a worker can see it so the count never drops below the number
+  // of queued tasks.
+  void TaskScheduler::push(TaskPriority priority, Task task)
+  {
+    {
+      std::lock_guard<std::mutex> lock{sleep_mutex_};
+      pending_ += 1;
+    }
+    auto &queue = *queues_[this_queue()];
+    {
+      std::lock_guard<std::mutex> lock{queue.mutex_};
+      queue.tasks_[static_cast<std::size_t>(priority)].emplace_back(std::move(task));
+    }
+    sleep_cv_.notify_one();
+  }
+
+  // Run one task. A worker takes the newest task from its own queue, which is the most
+  // likely to have its data in cache, and the oldest task from the other queues.
+  bool TaskScheduler::try_run(TaskPriority lowest_priority)
+  {
+    auto home = this_queue();
+    for (std::size_t p = 0; p <= static_cast<std::size_t>(lowest_priority); p += 1) {
+      for (std::size_t i = 0; i < queues_.size(); i += 1) {
+        auto queue_idx = (home + i) % queues_.size();
+        auto &queue = *queues_[queue_idx];
+        Task task{};
+        {
+          std::lock_guard<std::mutex> lock{queue.mutex_};
+          auto &tasks = queue.tasks_[p];
+          if (tasks.empty()) {
+            continue;
+          }
+          if (queue_idx == home && home != 0) {
+            task = std::move(tasks.back());
+            tasks.pop_back();
+          } else {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+          }
+        }
+        pending_ -= 1;
+        task();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void TaskScheduler::run(std::size_t queue_idx)
+  {
+    current_scheduler = this;
+    current_queue = queue_idx;
+
+    while (true) {
+      if (try_run(TaskPriority::background)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock{sleep_mutex_};
+      sleep_cv_.wait(lock, [this]() -> bool
+      { return stop_ || pending_ > 0; });
+      if (stop_ && pending_ == 0) {
+        return;
+      }
+    }
+  }
+}
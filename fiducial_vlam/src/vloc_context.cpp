@@ -27,6 +27,12 @@ namespace fiducial_vlam
     t_camera_base_ = TransformWithCovariance(TransformWithCovariance::mu_type{
       t_camera_base_x_, t_camera_base_y_, t_camera_base_z_,
       t_camera_base_roll_, t_camera_base_pitch_, t_camera_base_yaw_});
+
+    robust_solve_options_.enabled_ = robust_solve_ != 0;
+    robust_solve_options_.max_position_deviation_ = robust_max_position_deviation_;
+    robust_solve_options_.max_angle_deviation_ = robust_max_angle_deviation_;
+    robust_solve_options_.huber_k_ = robust_huber_k_;
+    robust_solve_options_.max_iterations_ = robust_max_iterations_;
   }
 }
 
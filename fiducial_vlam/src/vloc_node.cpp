@@ -1,11 +1,23 @@
-
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
 
 #include "rclcpp/rclcpp.hpp"
 
+#include "change_detector.hpp"
 #include "fiducial_math.hpp"
 #include "map.hpp"
+#include "map_shm.hpp"
 #include "observation.hpp"
+#include "quality_governor.hpp"
+#include "task_scheduler.hpp"
+#include "tracing.hpp"
 #include "vloc_context.hpp"
 
 #include "cv_bridge/cv_bridge.h"
@@ -42,6 +54,18 @@ namespace fiducial_vlam
     }
   }
 
+  static Observations without_markers(const Observations &observations,
+                                      const std::vector<int> &ids)
+  {
+    Observations kept{};
+    for (auto &observation : observations.observations()) {
+      if (std::find(ids.begin(), ids.end(), observation.id()) == ids.end()) {
+        kept.add(observation);
+      }
+    }
+    return kept;
+  }
+
   static std::vector<TransformWithCovariance> markers_t_map_cameras(
     const Observations &observations,
     Map &map,
@@ -52,7 +76,7 @@ namespace fiducial_vlam
     for (auto &observation : observations.observations()) {
       Observations single_observation{};
       single_observation.add(observation);
-      auto t_map_camera = fm.solve_t_map_camera(single_observation, map);
+      auto t_map_camera = fm.solve_t_map_camera_no_memo(single_observation, map);
       if (t_map_camera.is_valid()) {
         t_map_cameras.emplace_back(t_map_camera);
       }
@@ -62,6 +86,111 @@ namespace fiducial_vlam
   }
 
 
+// ==============================================================================
+// ProcessingTier enum
+// ==============================================================================
+
+  // The processing tiers that the quality governor steps between. Best quality first.
+  enum class ProcessingTier
+  {
+    full_apriltag = 0,  // detect in the whole image, AprilTag corner refinement, SAM solve
+    full_subpix = 1,    // detect in the whole image, subpixel corner refinement, SAM solve
+    roi_subpix = 2,     // detect near the last markers, subpixel corner refinement, SAM solve
+    roi_cv = 3,         // detect near the last markers, subpixel corner refinement, OpenCV solve
+    tracking_cv = 4,    // track the corners of the last markers, OpenCV solve
+  };
+
+  static const char *to_string(ProcessingTier tier)
+  {
+    static const char *names[] = {"full_apriltag", "full_subpix", "roi_subpix", "roi_cv", "tracking_cv"};
+    return names[static_cast<int>(tier)];
+  }
+
+// ==============================================================================
+// PublishJob class
+// ==============================================================================
+
+  // Everything that is published for one image.
+  struct PublishJob
+  {
+    std_msgs::msg::Header::_stamp_type stamp{};
+    std_msgs::msg::Header image_header{};
+    TransformWithCovariance t_map_camera{};
+    TransformWithCovariance t_map_base{};
+    Observations observations{};
+    std::vector<TransformWithCovariance> t_map_cameras{};
+    std::shared_ptr<const sensor_msgs::msg::CameraInfo> camera_info_msg{};
+    cv_bridge::CvImagePtr color_marked{};
+
+    bool publish_camera_pose{false};
+    bool publish_base_pose{false};
+    bool publish_camera_odom{false};
+    bool publish_base_odom{false};
+    bool publish_tfs{false};
+    bool publish_observations{false};
+    bool save_pose_cache{false};
+  };
+
+// ==============================================================================
+// PublishStage class
+// ==============================================================================
+
+  // Runs jobs in order as background tasks on the scheduler so the next image can be
+  // processed while the messages from the previous image are serialized and sent. Only one
+  // drain task is queued or running at a time, which keeps the jobs in order.
+  class PublishStage
+  {
+    const std::size_t max_queued_;
+    std::mutex mutex_{};
+    std::deque<std::function<void()>> jobs_{};
+    bool draining_{false};
+    std::future<void> drain_future_{};
+
+    void drain()
+    {
+      while (true) {
+        std::function<void()> job{};
+        {
+          std::lock_guard<std::mutex> lock{mutex_};
+          if (jobs_.empty()) {
+            draining_ = false;
+            return;
+          }
+          job = std::move(jobs_.front());
+          jobs_.pop_front();
+        }
+        job();
+      }
+    }
+
+  public:
+    explicit PublishStage(std::size_t max_queued)
+      : max_queued_{max_queued}
+    {}
+
+    ~PublishStage()
+    {
+      if (drain_future_.valid()) {
+        TaskScheduler::instance().wait(drain_future_, TaskPriority::background);
+      }
+    }
+
+    // If publishing falls behind, drop the oldest job. Stale poses are of no use.
+    void submit(std::function<void()> job)
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (jobs_.size() >= max_queued_) {
+        jobs_.pop_front();
+      }
+      jobs_.emplace_back(std::move(job));
+      if (!draining_) {
+        draining_ = true;
+        drain_future_ = TaskScheduler::instance().submit(TaskPriority::background, [this]() -> void
+        { drain(); });
+      }
+    }
+  };
+
 // ==============================================================================
 // VlocNode class
 // ==============================================================================
@@ -70,9 +199,26 @@ namespace fiducial_vlam
   {
     VlocContext cxt_;
     std::unique_ptr<Map> map_{};
+    std::unique_ptr<Map> provisional_map_{};
+    std::unique_ptr<Map> solve_map_{};
     std::unique_ptr<CameraInfo> camera_info_{};
-    std::unique_ptr<sensor_msgs::msg::CameraInfo> camera_info_msg_{};
+    std::shared_ptr<const sensor_msgs::msg::CameraInfo> camera_info_msg_{};
+    std::unique_ptr<FiducialMath> fm_{};
+    std::unique_ptr<ChangeDetector> change_detector_{};
+    std::unique_ptr<QualityGovernor> governor_{};
+    std::unique_ptr<MapShmReader> map_shm_reader_{};
+    Observations last_observations_{};
+    TransformWithCovariance last_t_map_camera_{};
     std_msgs::msg::Header::_stamp_type last_image_stamp_{};
+    std::chrono::steady_clock::time_point last_pose_cache_save_{};
+    // The markers the robust solve rejected since they were last logged, with their counts.
+    std::map<int, int> rejected_counts_{};
+    std::chrono::steady_clock::time_point last_rejected_log_{};
+    std::future<std::string> pose_cache_save_future_{};
+    TransformWithCovariance cached_t_map_camera_{};
+    bool pose_published_{false};
+    std::uint64_t image_count_{0};
+    std::uint64_t pose_count_{0};
 
     rclcpp::Publisher<fiducial_vlam_msgs::msg::Observations>::SharedPtr observations_pub_{};
     rclcpp::Publisher<geometry_msgs::msg::PoseWithCovarianceStamped>::SharedPtr camera_pose_pub_{};
@@ -85,6 +231,23 @@ namespace fiducial_vlam
     rclcpp::Subscription<sensor_msgs::msg::CameraInfo>::SharedPtr camera_info_sub_;
     rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr image_raw_sub_;
     rclcpp::Subscription<fiducial_vlam_msgs::msg::Map>::SharedPtr map_sub_;
+    rclcpp::TimerBase::SharedPtr cached_pose_timer_{};
+    rclcpp::TimerBase::SharedPtr metrics_timer_{};
+
+    // Messages reused by the publish stage.
+    geometry_msgs::msg::PoseWithCovarianceStamped camera_pose_msg_{};
+    geometry_msgs::msg::PoseWithCovarianceStamped base_pose_msg_{};
+    nav_msgs::msg::Odometry camera_odom_msg_{};
+    nav_msgs::msg::Odometry base_odom_msg_{};
+    tf2_msgs::msg::TFMessage tf_msg_{};
+    tf2_msgs::msg::TFMessage markers_tf_msg_{};
+    fiducial_vlam_msgs::msg::Observations observations_msg_{};
+    // The camera_info last copied into observations_msg_. A new one is made for every calibration change.
+    std::shared_ptr<const sensor_msgs::msg::CameraInfo> observations_msg_camera_info_{};
+    sensor_msgs::msg::Image image_marked_msg_{};
+
+    // Declared last so it is destroyed first, before the publishers and messages it uses.
+    std::unique_ptr<PublishStage> publish_stage_{};
 
 
   public:
@@ -94,9 +257,17 @@ namespace fiducial_vlam
       // Get parameters from the command line
       cxt_.load_parameters();
 
+      // All the parallel work in this process shares one pool of threads.
+      if (!TaskScheduler::configure(static_cast<std::size_t>(std::max(cxt_.scheduler_threads_, 0)))) {
+        RCLCPP_WARN(get_logger(), "The task scheduler is already running with %d threads, scheduler_threads ignored",
+                    static_cast<int>(TaskScheduler::instance().thread_count()));
+      }
+
       // ROS publishers. Initialize after parameters have been loaded.
-      observations_pub_ = create_publisher<fiducial_vlam_msgs::msg::Observations>(
-        cxt_.fiducial_observations_pub_topic_, 16);
+      if (cxt_.publish_observations_) {
+        observations_pub_ = create_publisher<fiducial_vlam_msgs::msg::Observations>(
+          cxt_.fiducial_observations_pub_topic_, 16);
+      }
 
       if (cxt_.publish_camera_pose_) {
         camera_pose_pub_ = create_publisher<geometry_msgs::msg::PoseWithCovarianceStamped>(
@@ -123,6 +294,29 @@ namespace fiducial_vlam
           cxt_.image_marked_pub_topic_, 16);
       }
 
+      if (cxt_.change_detection_) {
+        change_detector_ = std::make_unique<ChangeDetector>(cxt_.change_detection_decimation_,
+                                                            cxt_.change_detection_threshold_,
+                                                            cxt_.change_detection_max_skipped_frames_);
+      }
+
+      if (cxt_.quality_governor_) {
+        governor_ = std::make_unique<QualityGovernor>(
+          std::min(cxt_.governor_max_tier_, static_cast<int>(ProcessingTier::tracking_cv)),
+          cxt_.governor_target_latency_s_,
+          cxt_.governor_target_cpu_,
+          cxt_.governor_hysteresis_,
+          cxt_.governor_hold_frames_);
+      }
+
+      if (cxt_.publish_in_background_) {
+        publish_stage_ = std::make_unique<PublishStage>(4);
+      }
+
+      // Start with the map and pose from the last run so localization can start
+      // with the first image instead of waiting for a map from vmap_node.
+      load_caches();
+
       // ROS subscriptions
       auto camera_info_qos = cxt_.sub_camera_info_best_effort_not_reliable_ ?
                              rclcpp::QoS{rclcpp::SensorDataQoS()} :
@@ -132,10 +326,19 @@ namespace fiducial_vlam
         camera_info_qos,
         [this](const sensor_msgs::msg::CameraInfo::UniquePtr msg) -> void
         {
-          if (!camera_info_) {
-            camera_info_ = std::make_unique<CameraInfo>(*msg);
+          // If the images are rectified, then use the projection matrix and ignore the
+          // distortion. The rectified info is passed along with the observations so
+          // vmap_node also uses the pinhole model.
+          auto info_msg = cxt_.images_are_rectified_ ? CameraInfo::to_rectified_msg(*msg) : *msg;
+
+          // Only rebuild the calibration when it has changed (zoom, recalibration).
+          if (!camera_info_ || !camera_info_->is_built_from(info_msg)) {
+            if (camera_info_) {
+              RCLCPP_INFO(get_logger(), "camera_info calibration has changed");
+            }
+            camera_info_ = std::make_unique<CameraInfo>(info_msg);
             // Save the info message because we pass it along with the observations.
-            camera_info_msg_ = std::make_unique<sensor_msgs::msg::CameraInfo>(*msg);
+            camera_info_msg_ = std::make_shared<const sensor_msgs::msg::CameraInfo>(info_msg);
           }
         });
 
@@ -146,6 +349,7 @@ namespace fiducial_vlam
         {
           // the stamp to use for all published messages derived from this image message.
           auto stamp{msg->header.stamp};
+          FVLAM_TRACE3(frame_ingest, trace_stamp(stamp), msg->width, msg->height);
 
           if (!camera_info_) {
             RCLCPP_DEBUG(get_logger(), "Ignore image message because no camera_info has been received yet.");
@@ -164,13 +368,32 @@ namespace fiducial_vlam
           last_image_stamp_ = stamp;
         });
 
-      map_sub_ = create_subscription<fiducial_vlam_msgs::msg::Map>(
-        cxt_.fiducial_map_sub_topic_,
-        16,
-        [this](const fiducial_vlam_msgs::msg::Map::UniquePtr msg) -> void
-        {
-          map_ = std::make_unique<Map>(*msg);
-        });
+      // A vmap_node on the same host can share the map through shared memory. The
+      // segment is checked for a new map before each image is processed.
+      if (!cxt_.map_shm_name_.empty()) {
+        map_shm_reader_ = std::make_unique<MapShmReader>(cxt_.map_shm_name_);
+
+      } else {
+        // A transient_local subscription gets the latest map right away from a transient_local
+        // vmap_node, but it doesn't match volatile publishers (bag playback, other map sources).
+        map_sub_ = create_subscription<fiducial_vlam_msgs::msg::Map>(
+          cxt_.fiducial_map_sub_topic_,
+          cxt_.fiducial_map_sub_transient_local_ ? rclcpp::QoS{1}.transient_local() : rclcpp::QoS{16},
+          [this](const fiducial_vlam_msgs::msg::Map::UniquePtr msg) -> void
+          {
+            set_map(std::make_unique<Map>(*msg));
+          });
+      }
+
+      // Periodically log the solver metrics.
+      if (cxt_.metrics_log_period_s_ > 0.0) {
+        metrics_timer_ = create_wall_timer(
+          std::chrono::duration<double>(cxt_.metrics_log_period_s_),
+          [this]() -> void
+          {
+            log_metrics();
+          });
+      }
 
       (void) camera_info_sub_;
       (void) image_raw_sub_;
@@ -179,7 +402,336 @@ namespace fiducial_vlam
     }
 
   private:
+    // The map used to solve for the camera pose. This is the map from vmap_node plus the
+    // provisional markers that vloc_node has estimated on its own. The provisional markers
+    // have their covariance inflated so they count for less than the mapped markers.
+    Map &solve_map(FiducialMath &fm)
+    {
+      if (!provisional_map_ || provisional_map_->markers().empty()) {
+        return *map_;
+      }
+
+      if (!solve_map_) {
+        // A pose map has no covariances so use a covariance map to carry the provisional covariances.
+        // The mapped markers have zero covariance and are treated as exact.
+        auto map_style = map_->map_style() == Map::MapStyles::pose ? Map::MapStyles::covariance : map_->map_style();
+        solve_map_ = std::make_unique<Map>(map_style, map_->marker_length());
+        for (auto &id_marker : map_->markers()) {
+          solve_map_->add_marker(id_marker.second);
+        }
+
+        // The memo holds a pose solved without the provisional markers.
+        for (auto &id_marker : provisional_map_->markers()) {
+          if (put_provisional_marker(fm, id_marker.second)) {
+            fm.clear_pose_memo_if_observed(id_marker.first);
+          }
+        }
+      }
+
+      return *solve_map_;
+    }
+
+    // Add a provisional marker to the solve map, or update it there. Its covariance is scaled
+    // up so it counts for less than the mapped markers. Returns false if the marker isn't used.
+    bool put_provisional_marker(FiducialMath &fm, const Marker &marker)
+    {
+      if (marker.update_count() < cxt_.provisional_min_updates_ ||
+          map_->find_marker(marker.id()) != nullptr) {
+        return false;
+      }
+
+      auto cov = marker.t_map_marker().cov();
+      for (auto &c : cov) {
+        c *= cxt_.provisional_cov_scale_;
+      }
+      Marker down_weighted{marker.id(), TransformWithCovariance{marker.t_map_marker().transform(), cov}};
+      if (solve_map_->map_style() == Map::MapStyles::corners) {
+        fm.update_marker_corners(down_weighted, map_->marker_length());
+      }
+
+      auto solve_marker_ptr = solve_map_->find_marker(marker.id());
+      if (solve_marker_ptr == nullptr) {
+        solve_map_->add_marker(down_weighted);
+      } else {
+        *solve_marker_ptr = down_weighted;
+      }
+      return true;
+    }
+
+    void update_provisional_map(FiducialMath &fm,
+                                const TransformWithCovariance &t_map_camera,
+                                const Observations &observations)
+    {
+      Observations unknown_observations{};
+      for (auto &observation : observations.observations()) {
+        if (map_->find_marker(observation.id()) == nullptr) {
+          unknown_observations.add(observation);
+        }
+      }
+
+      if (unknown_observations.size() == 0) {
+        return;
+      }
+
+      if (!provisional_map_) {
+        provisional_map_ = std::make_unique<Map>(Map::MapStyles::covariance, map_->marker_length());
+      }
+      fm.fuse_into_map(t_map_camera, unknown_observations, *provisional_map_);
+
+      // Only the provisional markers that were just fused change in the solve map. The memo
+      // is only stale if its solve saw one of them.
+      if (solve_map_) {
+        for (auto &observation : unknown_observations.observations()) {
+          auto marker_ptr = provisional_map_->find_marker(observation.id());
+          if (marker_ptr != nullptr && put_provisional_marker(fm, *marker_ptr)) {
+            fm.clear_pose_memo_if_observed(observation.id());
+          }
+        }
+      }
+    }
+
+    // Remove the provisional markers that are in the map from vmap_node.
+    void prune_provisional_map()
+    {
+      solve_map_.reset();
+      if (!provisional_map_) {
+        return;
+      }
+
+      auto pruned = std::make_unique<Map>(Map::MapStyles::covariance, map_->marker_length());
+      if (provisional_map_->marker_length() == map_->marker_length()) {
+        for (auto &id_marker : provisional_map_->markers()) {
+          if (map_->find_marker(id_marker.first) == nullptr) {
+            pruned->add_marker(id_marker.second);
+          }
+        }
+      }
+      provisional_map_ = std::move(pruned);
+    }
+
+    // Log the markers that the robust solve rejected, at most once a period so a marker
+    // that is always rejected doesn't flood the log.
+    void log_rejected_markers()
+    {
+      if (rejected_counts_.empty()) {
+        return;
+      }
+      auto time_now = std::chrono::steady_clock::now();
+      if (time_now - last_rejected_log_ < std::chrono::duration<double>(cxt_.robust_rejected_log_period_s_)) {
+        return;
+      }
+      last_rejected_log_ = time_now;
+
+      std::ostringstream ss{};
+      for (auto &id_count : rejected_counts_) {
+        ss << " " << id_count.first << " (" << id_count.second << "x)";
+      }
+      RCLCPP_INFO(get_logger(), "Markers rejected by the robust solve:%s", ss.str().c_str());
+      rejected_counts_.clear();
+    }
+
+    void log_metrics()
+    {
+      if (!fm_) {
+        return;
+      }
+      auto &metrics = fm_->metrics();
+      RCLCPP_INFO(get_logger(), "solves: %lu, memo hits: %lu (%.1f%%), memo refreshes: %lu, tier: %s",
+                  static_cast<unsigned long>(metrics.solves_),
+                  static_cast<unsigned long>(metrics.memo_hits_),
+                  metrics.solves_ > 0 ? 100.0 * metrics.memo_hits_ / metrics.solves_ : 0.0,
+                  static_cast<unsigned long>(metrics.memo_refreshes_),
+                  governor_ ? to_string(static_cast<ProcessingTier>(governor_->tier())) : "off");
+    }
+
+    void load_caches()
+    {
+      if (!cxt_.map_cache_full_filename_.empty()) {
+        auto err_msg = from_binary_file(cxt_.map_cache_full_filename_, map_);
+        if (err_msg.empty()) {
+          RCLCPP_INFO(get_logger(), "Loaded %d markers from map cache '%s'",
+                      static_cast<int>(map_->markers().size()), cxt_.map_cache_full_filename_.c_str());
+        } else {
+          RCLCPP_INFO(get_logger(), err_msg.c_str());
+        }
+      }
+
+      if (!cxt_.pose_cache_full_filename_.empty()) {
+        auto err_msg = from_binary_file(cxt_.pose_cache_full_filename_, cached_t_map_camera_);
+        if (!err_msg.empty()) {
+          RCLCPP_INFO(get_logger(), err_msg.c_str());
+          return;
+        }
+        RCLCPP_INFO(get_logger(), "Loaded camera pose from pose cache '%s'", cxt_.pose_cache_full_filename_.c_str());
+
+        // Publish the last known pose once, after the publishers have been discovered, unless
+        // a live pose has been published by then. This gives consumers a starting pose.
+        cached_pose_timer_ = create_wall_timer(
+          std::chrono::seconds(1),
+          [this]() -> void
+          {
+            cached_pose_timer_->cancel();
+            if (!pose_published_) {
+              publish_cached_pose();
+            }
+          });
+      }
+    }
+
+    void publish_cached_pose()
+    {
+      PublishJob job{};
+      job.stamp = builtin_interfaces::msg::Time(now());
+      job.t_map_camera = cached_t_map_camera_;
+      job.t_map_base = TransformWithCovariance{cached_t_map_camera_.transform() * cxt_.t_camera_base_.transform()};
+      job.publish_camera_pose = cxt_.publish_camera_pose_ != 0;
+      job.publish_base_pose = cxt_.publish_base_pose_ != 0;
+      job.publish_tfs = cxt_.publish_tfs_ != 0;
+      submit_publish_job(std::move(job));
+    }
+
+    // Write the pose cache in the background. If the last write hasn't finished, skip this one.
+    void save_pose_cache(const TransformWithCovariance &t_map_camera)
+    {
+      if (pose_cache_save_future_.valid()) {
+        if (pose_cache_save_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+          return;
+        }
+        auto err_msg = pose_cache_save_future_.get();
+        if (!err_msg.empty()) {
+          RCLCPP_ERROR(get_logger(), err_msg.c_str());
+        }
+      }
+      pose_cache_save_future_ = TaskScheduler::instance().submit(
+        TaskPriority::background,
+        [t_map_camera, filename = cxt_.pose_cache_full_filename_]() -> std::string
+        {
+          return to_binary_file(t_map_camera, filename);
+        });
+    }
+
+    bool is_pose_cache_save_due()
+    {
+      if (cxt_.pose_cache_full_filename_.empty()) {
+        return false;
+      }
+
+      // Limit how often the file is written.
+      auto time_now = std::chrono::steady_clock::now();
+      if (time_now - last_pose_cache_save_ < std::chrono::duration<double>(cxt_.pose_cache_save_period_s_)) {
+        return false;
+      }
+      last_pose_cache_save_ = time_now;
+      return true;
+    }
+
+    // The publish_xxx parameters are decimation factors: n => publish every n-th frame, 0 => never.
+    static bool is_nth(int publish_every_n, std::uint64_t count)
+    {
+      return publish_every_n > 0 && count % publish_every_n == 0;
+    }
+
+    void set_map(std::unique_ptr<Map> map)
+    {
+      // The live map always replaces a map loaded from the cache.
+      map_ = std::move(map);
+
+      // A pose solved against the old map can't be reused.
+      if (fm_) {
+        fm_->clear_pose_memo();
+      }
+
+      // The provisional markers that are now in the map are no longer needed.
+      prune_provisional_map();
+
+      if (!cxt_.map_cache_full_filename_.empty()) {
+        auto err_msg = to_binary_file(*map_, cxt_.map_cache_full_filename_);
+        if (!err_msg.empty()) {
+          RCLCPP_ERROR(get_logger(), err_msg.c_str());
+        }
+      }
+    }
+
+    void read_map_shm()
+    {
+      std::unique_ptr<Map> map{};
+      auto err_msg = map_shm_reader_->read(map);
+      if (!err_msg.empty()) {
+        RCLCPP_ERROR(get_logger(), err_msg.c_str());
+      }
+      if (map) {
+        set_map(std::move(map));
+      }
+    }
+
     void process_image(const sensor_msgs::msg::Image &image_msg, std_msgs::msg::Header::_stamp_type stamp)
+    {
+      if (map_shm_reader_) {
+        read_map_shm();
+      }
+
+      if (governor_) {
+        governor_->start_frame();
+      }
+
+      process_image_at_tier(image_msg, stamp,
+                            governor_ ? static_cast<ProcessingTier>(governor_->tier()) : ProcessingTier::full_apriltag);
+
+      if (governor_ && governor_->end_frame()) {
+        RCLCPP_INFO(get_logger(), "Processing tier: %s (latency %.1f ms, cpu %.2f)",
+                    to_string(static_cast<ProcessingTier>(governor_->tier())),
+                    governor_->latency() * 1000.0, governor_->cpu());
+      }
+    }
+
+    // The regions to search in the roi tiers. These are the last observations plus the map markers
+    // that should be in view from the last camera pose, so markers that come into view are found.
+    Observations near_observations(FiducialMath &fm, const cv::Mat &image)
+    {
+      if (!map_ || !last_t_map_camera_.is_valid()) {
+        return last_observations_;
+      }
+      auto near = last_observations_;
+      auto predicted = fm.predict_observations(last_t_map_camera_, *map_, image.cols, image.rows);
+      for (auto &observation : predicted.observations()) {
+        auto &last = last_observations_.observations();
+        if (std::none_of(last.begin(), last.end(), [&observation](const Observation &o) -> bool
+        { return o.id() == observation.id(); })) {
+          near.add(observation);
+        }
+      }
+      return near;
+    }
+
+    Observations find_markers(FiducialMath &fm, ProcessingTier tier,
+                              cv_bridge::CvImagePtr &color, cv_bridge::CvImagePtr &color_marked)
+    {
+      switch (tier) {
+        case ProcessingTier::full_apriltag:
+          return fm.detect_markers(color, color_marked, CornerRefinement::apriltag);
+
+        case ProcessingTier::full_subpix:
+          return fm.detect_markers(color, color_marked, CornerRefinement::subpix);
+
+        case ProcessingTier::roi_subpix:
+        case ProcessingTier::roi_cv:
+          return fm.detect_markers_near(color, color_marked, CornerRefinement::subpix,
+                                        near_observations(fm, color->image));
+
+        case ProcessingTier::tracking_cv: {
+          // If all the markers have been lost, then find them again.
+          auto observations = fm.track_markers(color, color_marked, last_observations_);
+          if (observations.size() > 0) {
+            return observations;
+          }
+          return fm.detect_markers(color, color_marked, CornerRefinement::subpix);
+        }
+      }
+      return Observations{};
+    }
+
+    void process_image_at_tier(const sensor_msgs::msg::Image &image_msg, std_msgs::msg::Header::_stamp_type stamp,
+                               ProcessingTier tier)
     {
       // Convert ROS to OpenCV
       cv_bridge::CvImagePtr color = cv_bridge::toCvCopy(image_msg);
@@ -189,16 +741,51 @@ namespace fiducial_vlam
       // then just make an empty image pointer. The routines need to check
       // that the pointer is valid before drawing into it.
       cv_bridge::CvImagePtr color_marked;
-      if (cxt_.publish_image_marked_ &&
+      if (is_nth(cxt_.publish_image_marked_, image_count_) &&
           count_subscribers(cxt_.image_marked_pub_topic_) > 0) {
         color_marked = color;
       }
+      image_count_ += 1;
+
+      // Only rebuild the fiducial math when the calibration or the solver parameters change.
+      if (!fm_ || !fm_->is_built_from(cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_, *camera_info_msg_)) {
+        fm_ = std::make_unique<FiducialMath>(cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_, *camera_info_);
 
-      FiducialMath fm(cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_, *camera_info_);
+        // Until there is a live pose, start from the pose saved by the last run.
+        if (!pose_published_ && cached_t_map_camera_.is_valid()) {
+          fm_->set_t_map_camera_guess(cached_t_map_camera_);
+        }
+      }
+      auto &fm = *fm_;
+      fm.set_robust_solve_options(cxt_.robust_solve_options_);
+      fm.set_pose_memo_options(cxt_.pose_memo_corner_tolerance_, cxt_.pose_memo_refresh_ != 0);
+      fm.set_cv_solve_only(tier >= ProcessingTier::roi_cv);
+      fm.set_in_tree_decoder(cxt_.in_tree_decoder_ != 0);
 
       // Detect the markers in this image and create a list of
-      // observations.
-      auto observations = fm.detect_markers(color, color_marked);
+      // observations. If the image hasn't changed since the last detection,
+      // then reuse the last observations. Reused observations are not new measurements, so
+      // they only give a pose. They are not published or used for mapping.
+      Observations observations{};
+      bool observations_reused = false;
+      if (change_detector_ && !change_detector_->needs_detection(color)) {
+        observations = last_observations_;
+        observations_reused = true;
+      } else {
+        FVLAM_TRACE1(detect_start, trace_stamp(stamp));
+        observations = find_markers(fm, tier, color, color_marked);
+        FVLAM_TRACE2(detect_end, trace_stamp(stamp), static_cast<int>(observations.size()));
+        if (change_detector_) {
+          change_detector_->detected(observations);
+        }
+      }
+      last_observations_ = observations;
+
+      // Everything that gets published for this image is collected here and
+      // handed to the publish stage.
+      PublishJob job{};
+      job.stamp = stamp;
+      job.image_header = image_msg.header;
 
       // If there is a map, find t_map_marker for each detected
       // marker. The t_map_markers has an entry for each element
@@ -208,6 +795,7 @@ namespace fiducial_vlam
       // in green, then they haven't been detected. If the markers in
       // color_marked are outlined but they have no axes drawn, then vmap_node
       // is not running or has not been able to find the starting node.
+      last_t_map_camera_ = TransformWithCovariance{};
       if (map_) {
         TransformWithCovariance t_map_camera;
 
@@ -225,10 +813,30 @@ namespace fiducial_vlam
 //        }
 
           // Find the camera pose from the observations.
-          t_map_camera = fm.solve_t_map_camera(observations, *map_);
+          std::vector<int> rejected_ids{};
+          FVLAM_TRACE2(solve_start, trace_stamp(stamp), static_cast<int>(observations.size()));
+          t_map_camera = fm.solve_t_map_camera(observations, solve_map(fm), &rejected_ids);
+          FVLAM_TRACE3(solve_end, trace_stamp(stamp), static_cast<int>(observations.size()),
+                       t_map_camera.is_valid() ? 1 : 0);
+          last_t_map_camera_ = t_map_camera;
+
+          // The robust solve can reject markers that don't agree with the others. Leave
+          // them out of the annotations and the published observations.
+          if (!rejected_ids.empty()) {
+            observations = without_markers(observations, rejected_ids);
+            for (auto id : rejected_ids) {
+              rejected_counts_[id] += 1;
+            }
+          }
+          log_rejected_markers();
 
           if (t_map_camera.is_valid()) {
 
+            // Learn about the markers that are not in the map yet.
+            if (cxt_.provisional_mapping_ && !observations_reused) {
+              update_provisional_map(fm, t_map_camera, observations);
+            }
+
             // If annotated images have been requested, then add the annotations now.
             if (color_marked) {
               auto t_map_markers = map_->find_t_map_markers(observations);
@@ -236,113 +844,179 @@ namespace fiducial_vlam
             }
 
             // Find the transform from the base of the robot to the map.
-            TransformWithCovariance t_map_base{t_map_camera.transform() * cxt_.t_camera_base_.transform()};
-
-            // Publish the camera an/or base pose in the map frame
-            if (cxt_.publish_camera_pose_) {
-              auto pose_msg = to_PoseWithCovarianceStamped_msg(t_map_camera, stamp, cxt_.map_frame_id_);
-              // add some fixed variance for now.
-              add_fixed_covariance(pose_msg.pose);
-              camera_pose_pub_->publish(pose_msg);
-            }
-            if (cxt_.publish_base_pose_) {
-              auto pose_msg = to_PoseWithCovarianceStamped_msg(t_map_base, stamp, cxt_.map_frame_id_);
-              // add some fixed variance for now.
-              add_fixed_covariance(pose_msg.pose);
-              base_pose_pub_->publish(pose_msg);
+            job.t_map_camera = t_map_camera;
+            job.t_map_base = TransformWithCovariance{t_map_camera.transform() * cxt_.t_camera_base_.transform()};
+
+            // Decide which messages get published for this frame.
+            job.publish_camera_pose = is_nth(cxt_.publish_camera_pose_, pose_count_);
+            job.publish_base_pose = is_nth(cxt_.publish_base_pose_, pose_count_);
+            job.publish_camera_odom = is_nth(cxt_.publish_camera_odom_, pose_count_);
+            job.publish_base_odom = is_nth(cxt_.publish_base_odom_, pose_count_);
+            job.publish_tfs = is_nth(cxt_.publish_tfs_, pose_count_);
+            job.publish_observations = !observations_reused && is_nth(cxt_.publish_observations_, pose_count_);
+            job.save_pose_cache = is_pose_cache_save_due();
+
+            // if requested, find the camera tf as determined from each marker.
+            if (tf_message_pub_ && !observations_reused && is_nth(cxt_.publish_tfs_per_marker_, pose_count_)) {
+              job.t_map_cameras = markers_t_map_cameras(observations, *map_, fm);
             }
+            pose_count_ += 1;
 
-            // Publish odometry of the camera and/or the base.
-            if (cxt_.publish_camera_odom_) {
-              auto odom_msg = to_odom_message(stamp, cxt_.camera_frame_id_, t_map_camera);
-              add_fixed_covariance(odom_msg.pose);
-              camera_odometry_pub_->publish(odom_msg);
-            }
-            if (cxt_.publish_base_odom_) {
-              auto odom_msg = to_odom_message(stamp, cxt_.base_frame_id_, t_map_base);
-              add_fixed_covariance(odom_msg.pose);
-              base_odometry_pub_->publish(odom_msg);
-            }
+            // The observations go along with the camera_info.
+            job.camera_info_msg = camera_info_msg_;
+            job.observations = std::move(observations);
 
-            // Also publish the camera's tf
-            if (cxt_.publish_tfs_) {
-              auto tf_message = to_tf_message(stamp, t_map_camera, t_map_base);
-              tf_message_pub_->publish(tf_message);
-            }
+            pose_published_ = true;
+          }
+        }
+      }
 
-            // if requested, publish the camera tf as determined from each marker.
-            if (cxt_.publish_tfs_per_marker_) {
-              auto t_map_cameras = markers_t_map_cameras(observations, *map_, fm);
-              auto tf_message = to_markers_tf_message(stamp, observations, t_map_cameras);
-              if (!tf_message.transforms.empty()) {
-                tf_message_pub_->publish(tf_message);
-              }
-            }
+      // Publish an annotated image if requested. Even if there is no map.
+      job.color_marked = color_marked;
 
-            // Publish the observations
-            auto observations_msg = observations.to_msg(stamp, image_msg.header.frame_id, *camera_info_msg_);
-            observations_pub_->publish(observations_msg);
+      submit_publish_job(std::move(job));
+    }
+
+    void submit_publish_job(PublishJob job)
+    {
+      if (publish_stage_) {
+        publish_stage_->submit([this, job = std::move(job)]() -> void
+                               {
+                                 publish(job);
+                               });
+      } else {
+        publish(job);
+      }
+    }
+
+    // Publish the messages for one frame. This runs on the publish stage thread. The
+    // message objects are members that are reused so their buffers are only allocated once.
+    void publish(const PublishJob &job)
+    {
+      auto &stamp = job.stamp;
+
+      if (job.t_map_camera.is_valid()) {
+
+        // Publish the camera an/or base pose in the map frame
+        if (job.publish_camera_pose) {
+          to_pose_msg(stamp, job.t_map_camera, camera_pose_msg_);
+          // add some fixed variance for now.
+          add_fixed_covariance(camera_pose_msg_.pose);
+          camera_pose_pub_->publish(camera_pose_msg_);
+        }
+        if (job.publish_base_pose) {
+          to_pose_msg(stamp, job.t_map_base, base_pose_msg_);
+          // add some fixed variance for now.
+          add_fixed_covariance(base_pose_msg_.pose);
+          base_pose_pub_->publish(base_pose_msg_);
+        }
+
+        // Publish odometry of the camera and/or the base.
+        if (job.publish_camera_odom) {
+          to_odom_message(stamp, cxt_.camera_frame_id_, job.t_map_camera, camera_odom_msg_);
+          add_fixed_covariance(camera_odom_msg_.pose);
+          camera_odometry_pub_->publish(camera_odom_msg_);
+        }
+        if (job.publish_base_odom) {
+          to_odom_message(stamp, cxt_.base_frame_id_, job.t_map_base, base_odom_msg_);
+          add_fixed_covariance(base_odom_msg_.pose);
+          base_odometry_pub_->publish(base_odom_msg_);
+        }
+
+        // Also publish the camera's tf
+        if (job.publish_tfs) {
+          to_tf_message(stamp, job.t_map_camera, job.t_map_base, tf_msg_);
+          tf_message_pub_->publish(tf_msg_);
+        }
+
+        // if requested, publish the camera tf as determined from each marker.
+        if (!job.t_map_cameras.empty()) {
+          to_markers_tf_message(stamp, job.observations, job.t_map_cameras, markers_tf_msg_);
+          if (!markers_tf_msg_.transforms.empty()) {
+            tf_message_pub_->publish(markers_tf_msg_);
           }
         }
+
+        // Publish the observations. The camera_info is only copied when it changes.
+        if (job.publish_observations) {
+          if (observations_msg_camera_info_ != job.camera_info_msg) {
+            observations_msg_.camera_info = *job.camera_info_msg;
+            observations_msg_camera_info_ = job.camera_info_msg;
+          }
+          job.observations.to_msg(stamp, job.image_header.frame_id, observations_msg_);
+          observations_pub_->publish(observations_msg_);
+        }
+
+        // Remember this pose for the next start.
+        if (job.save_pose_cache) {
+          save_pose_cache(job.t_map_camera);
+        }
       }
 
-      // Publish an annotated image if requested. Even if there is no map.
-      if (color_marked) {
-        auto marked_image_msg{color->toImageMsg()};
-        marked_image_msg->header = image_msg.header;
-        image_marked_pub_->publish(*marked_image_msg);
+      // Publish an annotated image if requested.
+      if (job.color_marked) {
+        job.color_marked->toImageMsg(image_marked_msg_);
+        image_marked_msg_.header = job.image_header;
+        image_marked_pub_->publish(image_marked_msg_);
       }
     }
 
-    nav_msgs::msg::Odometry to_odom_message(std_msgs::msg::Header::_stamp_type stamp,
-                                            const std::string &child_frame_id,
-                                            const TransformWithCovariance &t)
+    void to_pose_msg(std_msgs::msg::Header::_stamp_type stamp,
+                     const TransformWithCovariance &t,
+                     geometry_msgs::msg::PoseWithCovarianceStamped &pose_message)
     {
-      nav_msgs::msg::Odometry odom_message;
+      pose_message.header.stamp = stamp;
+      pose_message.header.frame_id = cxt_.map_frame_id_;
+      pose_message.pose = to_PoseWithCovariance_msg(t);
+    }
 
+    void to_odom_message(std_msgs::msg::Header::_stamp_type stamp,
+                         const std::string &child_frame_id,
+                         const TransformWithCovariance &t,
+                         nav_msgs::msg::Odometry &odom_message)
+    {
       odom_message.header.stamp = stamp;
       odom_message.header.frame_id = cxt_.map_frame_id_;
       odom_message.child_frame_id = child_frame_id;
       odom_message.pose = to_PoseWithCovariance_msg(t);
-      return odom_message;
     }
 
-    tf2_msgs::msg::TFMessage to_tf_message(std_msgs::msg::Header::_stamp_type stamp,
-                                           const TransformWithCovariance &t_map_camera,
-                                           const TransformWithCovariance &t_map_base)
+    void to_tf_message(std_msgs::msg::Header::_stamp_type stamp,
+                       const TransformWithCovariance &t_map_camera,
+                       const TransformWithCovariance &t_map_base,
+                       tf2_msgs::msg::TFMessage &tf_message)
     {
-      tf2_msgs::msg::TFMessage tf_message;
-
-      geometry_msgs::msg::TransformStamped msg;
-      msg.header.stamp = stamp;
-      msg.header.frame_id = cxt_.map_frame_id_;
-
       // The camera_frame_id parameter is non-empty to publish the camera tf.
       // The base_frame_id parameter is non-empty to publish the base tf.
+      std::size_t n = 0;
+      tf_message.transforms.resize(2);
+
       if (!cxt_.camera_frame_id_.empty()) {
+        auto &msg = tf_message.transforms[n++];
+        msg.header.stamp = stamp;
+        msg.header.frame_id = cxt_.map_frame_id_;
         msg.child_frame_id = cxt_.camera_frame_id_;
         msg.transform = tf2::toMsg(t_map_camera.transform());
-        tf_message.transforms.emplace_back(msg);
       }
       if (!cxt_.base_frame_id_.empty()) {
+        auto &msg = tf_message.transforms[n++];
+        msg.header.stamp = stamp;
+        msg.header.frame_id = cxt_.map_frame_id_;
         msg.child_frame_id = cxt_.base_frame_id_;
         msg.transform = tf2::toMsg(t_map_base.transform());
-        tf_message.transforms.emplace_back(msg);
       }
 
-      return tf_message;
+      tf_message.transforms.resize(n);
     }
 
-    tf2_msgs::msg::TFMessage to_markers_tf_message(
+    void to_markers_tf_message(
       std_msgs::msg::Header::_stamp_type stamp,
       const Observations &observations,
-      const std::vector<TransformWithCovariance> &t_map_cameras)
+      const std::vector<TransformWithCovariance> &t_map_cameras,
+      tf2_msgs::msg::TFMessage &tf_message)
     {
-      tf2_msgs::msg::TFMessage tf_message;
-
-      geometry_msgs::msg::TransformStamped msg;
-      msg.header.stamp = stamp;
-      msg.header.frame_id = cxt_.map_frame_id_;
+      std::size_t n = 0;
+      tf_message.transforms.resize(observations.size());
 
       for (int i = 0; i < observations.size(); i += 1) {
         auto &observation = observations.observations()[i];
@@ -354,14 +1028,16 @@ namespace fiducial_vlam
             std::ostringstream oss_child_frame_id;
             oss_child_frame_id << cxt_.camera_frame_id_ << "_m" << std::setfill('0') << std::setw(3)
                                << observation.id();
+            auto &msg = tf_message.transforms[n++];
+            msg.header.stamp = stamp;
+            msg.header.frame_id = cxt_.map_frame_id_;
             msg.child_frame_id = oss_child_frame_id.str();
             msg.transform = tf2::toMsg(t_map_camera.transform());
-            tf_message.transforms.emplace_back(msg);
           }
         }
       }
 
-      return tf_message;
+      tf_message.transforms.resize(n);
     }
 
     void add_fixed_covariance(geometry_msgs::msg::PoseWithCovariance &pwc)
@@ -1,11 +1,21 @@
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <list>
+#include <numeric>
 
 #include "rclcpp/rclcpp.hpp"
 
 #include "fiducial_math.hpp"
 #include "map.hpp"
+#include "map_shm.hpp"
 #include "observation.hpp"
+#include "observation_log.hpp"
+#include "rig.hpp"
+#include "submap.hpp"
+#include "task_scheduler.hpp"
+#include "tracing.hpp"
 #include "vmap_context.hpp"
 
 #include "tf2_geometry_msgs/tf2_geometry_msgs.h"
@@ -59,6 +69,23 @@ namespace fiducial_vlam
         emitter_ << YAML::EndSeq;;
       }
 
+      // Save the corners if appropriate for the map_style
+      if (map_.map_style() == Map::MapStyles::corners && marker.has_corners()) {
+        emitter_ << YAML::Key << "corners" << YAML::Value << YAML::Flow << YAML::BeginSeq;
+        for (auto &corner_f_map : marker.corners_f_map()) {
+          auto &p = corner_f_map.point();
+          emitter_ << p.x() << p.y() << p.z();
+        }
+        emitter_ << YAML::EndSeq;
+        emitter_ << YAML::Key << "corners_cov" << YAML::Value << YAML::Flow << YAML::BeginSeq;
+        for (auto &corner_f_map : marker.corners_f_map()) {
+          for (auto cov_element : corner_f_map.cov()) {
+            emitter_ << cov_element;
+          }
+        }
+        emitter_ << YAML::EndSeq;
+      }
+
       emitter_ << YAML::EndMap;
     }
 
@@ -189,10 +216,60 @@ namespace fiducial_vlam
       Marker marker(id_node.as<int>(), TransformWithCovariance(mu, cov));
       marker.set_is_fixed(is_fixed_node.as<int>());
       marker.set_update_count(update_count_node.as<int>());
+
+      // The corners are optional. They are calculated when the marker is next observed.
+      if (map_->map_style() == Map::MapStyles::corners && marker_node["corners"]) {
+        if (!from_corners(marker_node, marker)) {
+          return false;
+        }
+      }
+
       map_->add_marker(std::move(marker));
       return true;
     }
 
+    bool from_corners(YAML::Node &marker_node, Marker &marker)
+    {
+      auto corners_node = marker_node["corners"];
+      if (!corners_node.IsSequence()) {
+        return yaml_error("marker.corners failed IsSequence()");
+      }
+      if (corners_node.size() != 4 * 3) {
+        return yaml_error("marker.corners incorrect size");
+      }
+      auto corners_cov_node = marker_node["corners_cov"];
+      if (!corners_cov_node.IsSequence()) {
+        return yaml_error("marker.corners_cov failed IsSequence()");
+      }
+      if (corners_cov_node.size() != 4 * 9) {
+        return yaml_error("marker.corners_cov incorrect size");
+      }
+
+      std::array<PointWithCovariance, 4> corners_f_map{};
+      for (int j = 0; j < corners_f_map.size(); j += 1) {
+        std::array<double, 3> xyz_data{};
+        for (int i = 0; i < xyz_data.size(); i += 1) {
+          auto i_node = corners_node[j * 3 + i];
+          if (!i_node.IsScalar()) {
+            return yaml_error("marker.corners[i] failed IsScalar()");
+          }
+          xyz_data[i] = i_node.as<double>();
+        }
+        PointWithCovariance::cov_type cov{};
+        for (int i = 0; i < cov.size(); i += 1) {
+          auto i_node = corners_cov_node[j * 9 + i];
+          if (!i_node.IsScalar()) {
+            return yaml_error("marker.corners_cov[i] failed IsScalar()");
+          }
+          cov[i] = i_node.as<double>();
+        }
+        corners_f_map[j] = PointWithCovariance(tf2::Vector3(xyz_data[0], xyz_data[1], xyz_data[2]), cov);
+      }
+
+      marker.set_corners_f_map(corners_f_map);
+      return true;
+    }
+
     bool from_markers(YAML::Node &markers_node)
     {
       for (YAML::const_iterator it = markers_node.begin(); it != markers_node.end(); ++it) {
@@ -284,17 +361,36 @@ namespace fiducial_vlam
   {
     VmapContext cxt_;
     std::unique_ptr<Map> map_{};
+    // One FiducialMath for each camera calibration seen recently, the most recent first.
+    std::list<std::shared_ptr<FiducialMath>> fms_{};
+    std::unique_ptr<Submaps> submaps_{};
+
+    // The rig cameras and the messages from them that share the stamp of the first one.
+    std::unique_ptr<Rig> rig_{};
+    std::vector<fiducial_vlam_msgs::msg::Observations> rig_msgs_{};
+    bool rig_msgs_aged_{false};
 
     int callbacks_processed_{0};
 
+    // What the ingest gate has seen and dropped, and the dropped counts at the last report.
+    std::uint64_t gate_messages_{0};
+    std::uint64_t gate_messages_dropped_{0};
+    std::uint64_t gate_observations_{0};
+    std::uint64_t gate_observations_dropped_{0};
+    std::uint64_t gate_reported_dropped_{0};
+
     // ROS publishers
     rclcpp::Publisher<fiducial_vlam_msgs::msg::Map>::SharedPtr fiducial_map_pub_{};
     rclcpp::Publisher<visualization_msgs::msg::MarkerArray>::SharedPtr fiducial_markers_pub_{};
     rclcpp::Publisher<tf2_msgs::msg::TFMessage>::SharedPtr tf_message_pub_{};
+    rclcpp::Publisher<std_msgs::msg::Header>::SharedPtr ingest_stamp_pub_{};
 
     rclcpp::Subscription<fiducial_vlam_msgs::msg::Observations>::SharedPtr observations_sub_{};
     rclcpp::TimerBase::SharedPtr map_pub_timer_{};
 
+    std::unique_ptr<MapShmWriter> map_shm_writer_{};
+    std::unique_ptr<ObservationLogWriter> observation_log_writer_{};
+    std::future<std::string> map_save_future_{};
 
     // Special "initialize map from camera location" mode
     void initialize_map_from_observations(const Observations &observations, FiducialMath &fm)
@@ -327,6 +423,12 @@ namespace fiducial_vlam
       // Get parameters from the command line
       cxt_.load_parameters();
 
+      // All the parallel work in this process shares one pool of threads.
+      if (!TaskScheduler::configure(static_cast<std::size_t>(std::max(cxt_.scheduler_threads_, 0)))) {
+        RCLCPP_WARN(get_logger(), "The task scheduler is already running with %d threads, scheduler_threads ignored",
+                    static_cast<int>(TaskScheduler::instance().thread_count()));
+      }
+
       // Initialize the map. Load from file or otherwise.
       map_ = initialize_map();
 
@@ -334,8 +436,12 @@ namespace fiducial_vlam
 //      auto m = from_YAML_string(s, "test");
 
       // ROS publishers.
+      // With transient_local durability, vloc_nodes that start later and subscribe transient_local
+      // get the latest map immediately instead of waiting for the timer. Volatile subscribers
+      // match either way.
       fiducial_map_pub_ = create_publisher<fiducial_vlam_msgs::msg::Map>(
-        cxt_.fiducial_map_pub_topic_, 16);
+        cxt_.fiducial_map_pub_topic_,
+        cxt_.fiducial_map_pub_transient_local_ ? rclcpp::QoS{1}.transient_local() : rclcpp::QoS{16});
 
       if (cxt_.publish_marker_visualizations_) {
         fiducial_markers_pub_ = create_publisher<visualization_msgs::msg::MarkerArray>(
@@ -346,6 +452,38 @@ namespace fiducial_vlam
         tf_message_pub_ = create_publisher<tf2_msgs::msg::TFMessage>("tf", 16);
       }
 
+      if (!cxt_.map_shm_name_.empty()) {
+        map_shm_writer_ = std::make_unique<MapShmWriter>(cxt_.map_shm_name_);
+      }
+
+      if (!cxt_.rig_extrinsics_.empty()) {
+        auto err_msg = Rig::from_string(cxt_.rig_extrinsics_, rig_);
+        if (!err_msg.empty()) {
+          RCLCPP_ERROR(get_logger(), err_msg.c_str());
+        }
+      }
+
+      // A replay is driven by replay() with the time from the log. Nothing
+      // is received and the map is not published on a wall timer.
+      if (is_replay()) {
+        RCLCPP_INFO(get_logger(), "vmap_node ready to replay '%s'", cxt_.observation_log_replay_filename_.c_str());
+        return;
+      }
+
+      if (!cxt_.observation_log_record_filename_.empty()) {
+        observation_log_writer_ = std::make_unique<ObservationLogWriter>(cxt_.observation_log_record_filename_);
+        if (!observation_log_writer_->is_open()) {
+          RCLCPP_ERROR(get_logger(), "Can not open observation log '%s' for recording",
+                       cxt_.observation_log_record_filename_.c_str());
+          observation_log_writer_.reset();
+        }
+      }
+
+      // Lets a benchmark measure how far behind the map is.
+      if (!cxt_.ingest_stamp_pub_topic_.empty()) {
+        ingest_stamp_pub_ = create_publisher<std_msgs::msg::Header>(cxt_.ingest_stamp_pub_topic_, 16);
+      }
+
       // ROS subscriptions
       // If we are not making a map, don't bother subscribing to the observations.
       if (cxt_.make_not_use_map_) {
@@ -354,7 +492,13 @@ namespace fiducial_vlam
           16,
           [this](const fiducial_vlam_msgs::msg::Observations::UniquePtr msg) -> void
           {
+            if (observation_log_writer_) {
+              observation_log_writer_->write(*msg);
+            }
             this->observations_callback(msg);
+            if (ingest_stamp_pub_) {
+              ingest_stamp_pub_->publish(msg->header);
+            }
           });
       }
 
@@ -368,21 +512,119 @@ namespace fiducial_vlam
           if (map_) {
             this->publish_map_and_visualization();
           }
+          report_ingest_gate();
+
+          // Don't wait forever for a rig camera that has stopped publishing.
+          if (rig_msgs_aged_) {
+            process_rig_msgs();
+          }
+          rig_msgs_aged_ = !rig_msgs_.empty();
         });
 
+      // Publish a loaded map right away. If the publisher is transient_local,
+      // subscribers that show up later get it as well.
+      if (map_) {
+        publish_map();
+      }
+
       (void) observations_sub_;
       (void) map_pub_timer_;
       RCLCPP_INFO(get_logger(), "vmap_node ready");
     }
 
+    bool is_replay() const
+    {
+      return !cxt_.observation_log_replay_filename_.empty();
+    }
+
+    // Run every message in the observation log through observations_callback as fast as
+    // possible. Time comes from the message stamps, so the map is published and saved at
+    // the same points in the data as it would be in a live run. The results only depend
+    // on the log and the parameters.
+    void replay()
+    {
+      std::ofstream timing{};
+      if (!cxt_.replay_timing_filename_.empty()) {
+        timing.open(cxt_.replay_timing_filename_);
+        timing << "index,stamp_s,observations,markers,callback_s" << std::endl;
+      }
+
+      auto publish_period = 1. / cxt_.marker_map_publish_frequency_hz_;
+      double next_publish_s{0.};
+      std::uint64_t count{0};
+      double callback_total_s{0.};
+      double first_stamp_s{0.};
+      double last_stamp_s{0.};
+      auto replay_start = std::chrono::steady_clock::now();
+
+      auto err_msg = from_observation_log(
+        cxt_.observation_log_replay_filename_,
+        [&](const fiducial_vlam_msgs::msg::Observations &msg) -> void
+        {
+          auto stamp_s = msg.header.stamp.sec + msg.header.stamp.nanosec * 1.e-9;
+          if (count == 0) {
+            first_stamp_s = stamp_s;
+            next_publish_s = stamp_s + publish_period;
+          }
+          last_stamp_s = stamp_s;
+
+          auto msg_unique = std::make_unique<fiducial_vlam_msgs::msg::Observations>(msg);
+          auto start = std::chrono::steady_clock::now();
+          observations_callback(msg_unique);
+          auto callback_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          callback_total_s += callback_s;
+
+          if (timing.is_open()) {
+            timing << count << "," << std::fixed << std::setprecision(9) << stamp_s << ","
+                   << msg.observations.size() << "," << (map_ ? map_->markers().size() : 0) << ","
+                   << callback_s << "\n";
+          }
+          count += 1;
+
+          // Publish on simulated time.
+          if (stamp_s >= next_publish_s) {
+            if (map_) {
+              publish_map_and_visualization();
+            }
+            while (next_publish_s <= stamp_s) {
+              next_publish_s += publish_period;
+            }
+          }
+        });
+
+      if (!err_msg.empty()) {
+        RCLCPP_ERROR(get_logger(), err_msg.c_str());
+      }
+      process_rig_msgs();
+
+      // Publish and save the final map. Wait for a save that is still running
+      // so the final one is not skipped.
+      if (map_save_future_.valid()) {
+        log_map_save_result();
+      }
+      if (map_) {
+        publish_map_and_visualization();
+      }
+      if (map_save_future_.valid()) {
+        log_map_save_result();
+      }
+
+      report_ingest_gate();
+
+      auto replay_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+      RCLCPP_INFO(get_logger(), "Replayed %d messages covering %.1f s in %.1f s (callbacks %.1f s), %d markers",
+                  static_cast<int>(count), last_stamp_s - first_stamp_s, replay_s, callback_total_s,
+                  static_cast<int>(map_ ? map_->markers().size() : 0));
+    }
+
   private:
 
     void observations_callback(const fiducial_vlam_msgs::msg::Observations::UniquePtr &msg)
     {
       callbacks_processed_ += 1;
 
-      CameraInfo ci{msg->camera_info};
-      FiducialMath fm{cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_, ci};
+      auto fm_ptr = fiducial_math(msg->camera_info);
+      auto &fm = *fm_ptr;
 
       // Get observations from the message.
       Observations observations(*msg);
@@ -393,20 +635,212 @@ namespace fiducial_vlam
         initialize_map_from_observations(observations, fm);
       }
 
+      // Observations from a rig camera are held until the other cameras' observations with
+      // the same stamp have arrived. A single marker is worth keeping because the rig relates
+      // it to the markers the other cameras see.
+      if (rig_ && map_ && rig_->find_t_base_camera(msg->header.frame_id) != nullptr) {
+        add_rig_msg(*msg);
+        return;
+      }
+
       // There is nothing to do at this point unless we have more than one observation.
       if (observations.size() < 2) {
         return;
       }
 
+      // Drop observations that don't agree with the map before any graph is built.
+      if (!pass_ingest_gate(fm, observations, 2)) {
+        return;
+      }
+
       // Estimate the camera pose using the latest map estimate
       auto t_map_camera = fm.solve_t_map_camera(observations, *map_);
 
       // We get an invalid pose if none of the visible markers pose's are known.
       if (t_map_camera.is_valid()) {
 
-        // Update our map with the observations
-        fm.update_map(t_map_camera, observations, *map_);
+        // Update our map with the observations. With submaps, only the submaps that
+        // hold the observed markers are optimized.
+        FVLAM_TRACE2(map_update_start, trace_stamp(msg->header.stamp), static_cast<int>(observations.size()));
+        if (cxt_.submap_radius_ > 0.) {
+          submaps().update_map(t_map_camera, observations, msg->camera_info, fm, *map_);
+
+        } else {
+          fm.update_map(t_map_camera, observations, *map_);
+        }
+        FVLAM_TRACE3(map_update_end, trace_stamp(msg->header.stamp), static_cast<int>(observations.size()),
+                     static_cast<int>(map_->markers().size()));
+      }
+    }
+
+    // Drop the observations that don't agree with the map. false => drop the whole message
+    // because fewer than min_size observations are left.
+    bool pass_ingest_gate(FiducialMath &fm, Observations &observations, std::size_t min_size)
+    {
+      if (cxt_.ingest_gate_max_error_ <= 0.) {
+        return true;
+      }
+      auto gated = fm.gate_observations(observations, *map_, cxt_.ingest_gate_max_error_);
+      gate_messages_ += 1;
+      gate_observations_ += observations.size();
+      gate_observations_dropped_ += observations.size() - gated.size();
+      if (gated.size() < min_size) {
+        gate_messages_dropped_ += 1;
+        return false;
+      }
+      observations = gated;
+      return true;
+    }
+
+    static double stamp_seconds(const std_msgs::msg::Header::_stamp_type &stamp)
+    {
+      return stamp.sec + stamp.nanosec * 1.e-9;
+    }
+
+    // Cameras that are not hardware synchronized stamp the same instant a little differently.
+    void add_rig_msg(const fiducial_vlam_msgs::msg::Observations &msg)
+    {
+      if (!rig_msgs_.empty() &&
+          std::abs(stamp_seconds(msg.header.stamp) - stamp_seconds(rig_msgs_.front().header.stamp)) >
+          cxt_.rig_stamp_tolerance_) {
+        process_rig_msgs();
+      }
+
+      // A camera that repeats a stamp replaces its earlier message.
+      auto it = std::find_if(rig_msgs_.begin(), rig_msgs_.end(),
+                             [&msg](const fiducial_vlam_msgs::msg::Observations &m) -> bool
+                             { return m.header.frame_id == msg.header.frame_id; });
+      if (it != rig_msgs_.end()) {
+        *it = msg;
+      } else {
+        rig_msgs_.emplace_back(msg);
+      }
+
+      if (rig_msgs_.size() == rig_->size()) {
+        process_rig_msgs();
+      }
+    }
+
+    // Update the map from the held rig messages with one rig pose.
+    void process_rig_msgs()
+    {
+      if (rig_msgs_.empty()) {
+        return;
+      }
+      rig_msgs_aged_ = false;
+
+      // The views point into these.
+      std::vector<Observations> observations_list{};
+      observations_list.reserve(rig_msgs_.size());
+      std::vector<FiducialMath::RigView> views{};
+      std::vector<std::shared_ptr<FiducialMath>> fms{};
+      std::vector<const sensor_msgs::msg::CameraInfo *> camera_info_msgs{};
+      std::size_t observation_count = 0;
+
+      // The number of markers already in the map that each view sees.
+      std::vector<std::size_t> known_counts{};
+
+      for (auto &msg : rig_msgs_) {
+        fms.emplace_back(fiducial_math(msg.camera_info));
+        auto &fm = *fms.back();
+        observations_list.emplace_back(msg);
+        auto &observations = observations_list.back();
+        if (observations.size() == 0 || !pass_ingest_gate(fm, observations, 1)) {
+          continue;
+        }
+
+        auto t_base_camera = rig_->find_t_base_camera(msg.header.frame_id);
+        views.emplace_back(FiducialMath::RigView{&fm, t_base_camera, &observations});
+        camera_info_msgs.emplace_back(&msg.camera_info);
+        observation_count += observations.size();
+        known_counts.emplace_back(std::count_if(
+          observations.observations().begin(), observations.observations().end(),
+          [this](const Observation &observation) -> bool
+          { return map_->find_marker(observation.id()) != nullptr; }));
+      }
+
+      // The rig pose comes from the camera that sees the most known markers. If it can't
+      // solve for its own pose, try the camera with the next most.
+      std::vector<std::size_t> order(views.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&known_counts](std::size_t a, std::size_t b) -> bool
+      { return known_counts[a] > known_counts[b]; });
+
+      TransformWithCovariance t_map_base{};
+      for (auto i : order) {
+        if (known_counts[i] == 0) {
+          break;
+        }
+        auto &view = views[i];
+        auto t_map_camera = view.fm_->solve_t_map_camera(*view.observations_, *map_);
+        if (t_map_camera.is_valid()) {
+          t_map_base = TransformWithCovariance{t_map_camera.transform() * view.t_base_camera_->transform().inverse()};
+          break;
+        }
+      }
+
+      auto stamp = rig_msgs_.front().header.stamp;
+      if (t_map_base.is_valid() && observation_count >= 2) {
+        FVLAM_TRACE2(map_update_start, trace_stamp(stamp), static_cast<int>(observation_count));
+        if (cxt_.submap_radius_ > 0.) {
+          // The submaps are optimized one camera at a time.
+          for (std::size_t i = 0; i < views.size(); i += 1) {
+            auto t_map_camera = TransformWithCovariance{
+              t_map_base.transform() * views[i].t_base_camera_->transform()};
+            submaps().update_map(t_map_camera, *views[i].observations_, *camera_info_msgs[i],
+                                 *views[i].fm_, *map_);
+          }
+        } else {
+          FiducialMath::update_map_rig(t_map_base, views, *map_);
+        }
+        FVLAM_TRACE3(map_update_end, trace_stamp(stamp), static_cast<int>(observation_count),
+                     static_cast<int>(map_->markers().size()));
+      }
+
+      rig_msgs_.clear();
+    }
+
+    Submaps &submaps()
+    {
+      if (!submaps_) {
+        submaps_ = std::make_unique<Submaps>(
+          cxt_.submap_radius_,
+          [this](const sensor_msgs::msg::CameraInfo &camera_info_msg) -> std::unique_ptr<FiducialMath>
+          {
+            return make_fiducial_math(camera_info_msg);
+          },
+          *map_);
+      }
+      return *submaps_;
+    }
+
+    // Find the FiducialMath for the camera that made these observations. The observations
+    // can come from several cameras, so keep one for each calibration that has been seen
+    // recently. The calibrations are compared by value. Callers that hold on to a
+    // FiducialMath across calls hold on to the shared_ptr, so an eviction can't free it.
+    std::shared_ptr<FiducialMath> fiducial_math(const sensor_msgs::msg::CameraInfo &camera_info_msg)
+    {
+      auto it = std::find_if(fms_.begin(), fms_.end(), [this, &camera_info_msg](const std::shared_ptr<FiducialMath> &fm)
+      { return fm->is_built_from(cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_, camera_info_msg); });
+      if (it != fms_.end()) {
+        fms_.splice(fms_.begin(), fms_, it);
+      } else {
+        fms_.emplace_front(make_fiducial_math(camera_info_msg));
+        while (fms_.size() > static_cast<std::size_t>(std::max(1, cxt_.max_camera_calibrations_))) {
+          fms_.pop_back();
+        }
       }
+      auto &fm = fms_.front();
+      fm->set_cv_map_fusion(cxt_.cv_map_fusion_ != 0);
+      return fm;
+    }
+
+    std::unique_ptr<FiducialMath> make_fiducial_math(const sensor_msgs::msg::CameraInfo &camera_info_msg)
+    {
+      auto fm = std::make_unique<FiducialMath>(cxt_.sam_not_cv_, cxt_.corner_measurement_sigma_,
+                                               CameraInfo{camera_info_msg});
+      fm->set_cv_map_fusion(cxt_.cv_map_fusion_ != 0);
+      return fm;
     }
 
     tf2_msgs::msg::TFMessage to_tf_message()
@@ -460,13 +894,39 @@ namespace fiducial_vlam
       return markers;
     }
 
-    void publish_map_and_visualization()
+    // Log the ingest gate counts when something more has been dropped.
+    void report_ingest_gate()
+    {
+      auto dropped = gate_messages_dropped_ + gate_observations_dropped_;
+      if (dropped == gate_reported_dropped_) {
+        return;
+      }
+      gate_reported_dropped_ = dropped;
+      RCLCPP_INFO(get_logger(), "Ingest gate dropped %d of %d messages and %d of %d observations",
+                  static_cast<int>(gate_messages_dropped_), static_cast<int>(gate_messages_),
+                  static_cast<int>(gate_observations_dropped_), static_cast<int>(gate_observations_));
+    }
+
+    void publish_map()
     {
-      // publish the map
       std_msgs::msg::Header header;
       header.stamp = now();
       header.frame_id = cxt_.map_frame_id_;
       fiducial_map_pub_->publish(*map_->to_map_msg(header));
+      FVLAM_TRACE1(map_publish, static_cast<int>(map_->markers().size()));
+
+      if (map_shm_writer_) {
+        auto err_msg = map_shm_writer_->write(*map_);
+        if (!err_msg.empty()) {
+          RCLCPP_ERROR(get_logger(), err_msg.c_str());
+        }
+      }
+    }
+
+    void publish_map_and_visualization()
+    {
+      // publish the map
+      publish_map();
 
       // Publish the marker Visualization
       if (cxt_.publish_marker_visualizations_) {
@@ -478,12 +938,33 @@ namespace fiducial_vlam
         tf_message_pub_->publish(to_tf_message());
       }
 
-      // Save the map
+      // Save a copy of the map in the background. If the last save
+      // hasn't finished, skip this one.
       if (cxt_.make_not_use_map_ && !cxt_.marker_map_save_full_filename_.empty()) {
-        auto err_msg = to_YAML_file(map_, cxt_.marker_map_save_full_filename_);
-        if (!err_msg.empty()) {
-          RCLCPP_INFO(get_logger(), err_msg.c_str());
+        if (map_save_future_.valid()) {
+          if (map_save_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+          }
+          log_map_save_result();
         }
+        map_save_future_ = TaskScheduler::instance().submit(
+          TaskPriority::background,
+          [map_copy = std::make_unique<Map>(*map_), filename = cxt_.marker_map_save_full_filename_]() -> std::string
+          {
+            FVLAM_TRACE1(yaml_save_start, static_cast<int>(map_copy->markers().size()));
+            auto err_msg = to_YAML_file(map_copy, filename);
+            FVLAM_TRACE2(yaml_save_end, static_cast<int>(map_copy->markers().size()), err_msg.empty() ? 0 : 1);
+            return err_msg;
+          });
+      }
+    }
+
+    // Wait for a map save to finish and log any error.
+    void log_map_save_result()
+    {
+      auto err_msg = TaskScheduler::instance().wait(map_save_future_, TaskPriority::background);
+      if (!err_msg.empty()) {
+        RCLCPP_INFO(get_logger(), err_msg.c_str());
       }
     }
 
@@ -513,8 +994,10 @@ namespace fiducial_vlam
       }
 
       // Base the style of the new map on the sam_not_cv parameter. If we are not
-      // doing sam, then the map contains only poses.
-      Map::MapStyles new_map_style = cxt_.sam_not_cv_ ?
+      // doing sam or fusion, then the map contains only poses. Corners are added if requested.
+      Map::MapStyles new_map_style = cxt_.map_with_corners_ ?
+                                     Map::MapStyles::corners :
+                                     cxt_.sam_not_cv_ || cxt_.cv_map_fusion_ ?
                                      Map::MapStyles::covariance :
                                      Map::MapStyles::pose;
 
@@ -574,8 +1057,12 @@ int main(int argc, char **argv)
   auto result = rcutils_logging_set_logger_level(node->get_logger().get_name(), RCUTILS_LOG_SEVERITY_INFO);
   (void) result;
 
-  // Spin until rclcpp::ok() returns false
-  rclcpp::spin(node);
+  // A replay runs to the end of the log and exits. Otherwise spin until rclcpp::ok() returns false
+  if (node->is_replay()) {
+    node->replay();
+  } else {
+    rclcpp::spin(node);
+  }
 
   // Shut down ROS
   rclcpp::shutdown();
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "marker_decoder.hpp"
+
+#include "opencv2/aruco.hpp"
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+// Compare MarkerDecoder with cv::aruco::detectMarkers on markers drawn by cv::aruco::drawMarker.
+// Both must find the same ids with the corners in the same order.
+
+namespace fiducial_vlam
+{
+  constexpr int marker_side = 100;
+  constexpr int marker_spacing = 160;
+  constexpr int marker_margin = 30;
+
+  struct Detection
+  {
+    int id_;
+    std::vector<cv::Point2f> corners_;
+  };
+
+  // Sort by id and then by position so the two detectors' lists line up.
+  static std::vector<Detection> to_detections(const std::vector<std::vector<cv::Point2f>> &corners,
+                                              const std::vector<int> &ids)
+  {
+    std::vector<Detection> detections{};
+    for (std::size_t i = 0; i < ids.size(); i += 1) {
+      detections.emplace_back(Detection{ids[i], corners[i]});
+    }
+    std::sort(detections.begin(), detections.end(), [](const Detection &a, const Detection &b) -> bool
+    {
+      return std::make_tuple(a.id_, a.corners_[0].y, a.corners_[0].x) <
+             std::make_tuple(b.id_, b.corners_[0].y, b.corners_[0].x);
+    });
+    return detections;
+  }
+
+  static std::vector<Detection> detect_aruco(const cv::Mat &gray)
+  {
+    auto dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
+    std::vector<std::vector<cv::Point2f>> corners{};
+    std::vector<int> ids{};
+    cv::aruco::detectMarkers(gray, dictionary, corners, ids);
+    return to_detections(corners, ids);
+  }
+
+  static std::vector<Detection> detect_in_tree(const cv::Mat &gray)
+  {
+    std::vector<std::vector<cv::Point2f>> corners{};
+    std::vector<int> ids{};
+    MarkerDecoder{}.detect_markers(gray, corners, ids, false);
+    return to_detections(corners, ids);
+  }
+
+  // One row for each id, with the marker turned by 0, 90, 180 and 270 degrees.
+  static cv::Mat draw_rotated_markers(const std::vector<int> &ids)
+  {
+    auto dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
+    cv::Mat gray(static_cast<int>(ids.size()) * marker_spacing, 4 * marker_spacing, CV_8UC1, cv::Scalar{255});
+    for (std::size_t row = 0; row < ids.size(); row += 1) {
+      cv::Mat marker;
+      cv::aruco::drawMarker(dictionary, ids[row], marker_side, marker);
+      for (int rotation = 0; rotation < 4; rotation += 1) {
+        cv::Mat rotated = marker;
+        if (rotation > 0) {
+          cv::rotate(marker, rotated, rotation == 1 ? cv::ROTATE_90_CLOCKWISE :
+                                      rotation == 2 ? cv::ROTATE_180 :
+                                      cv::ROTATE_90_COUNTERCLOCKWISE);
+        }
+        rotated.copyTo(gray(cv::Rect{rotation * marker_spacing + marker_margin,
+                                     static_cast<int>(row) * marker_spacing + marker_margin,
+                                     marker_side, marker_side}));
+      }
+    }
+    return gray;
+  }
+
+  static void expect_same_detections(const cv::Mat &gray, std::size_t expected_count)
+  {
+    auto aruco = detect_aruco(gray);
+    auto in_tree = detect_in_tree(gray);
+    ASSERT_EQ(aruco.size(), expected_count);
+    ASSERT_EQ(in_tree.size(), aruco.size());
+
+    for (std::size_t i = 0; i < aruco.size(); i += 1) {
+      EXPECT_EQ(in_tree[i].id_, aruco[i].id_);
+      for (std::size_t j = 0; j < 4; j += 1) {
+        EXPECT_NEAR(in_tree[i].corners_[j].x, aruco[i].corners_[j].x, 1.0) << "id " << aruco[i].id_ << " corner " << j;
+        EXPECT_NEAR(in_tree[i].corners_[j].y, aruco[i].corners_[j].y, 1.0) << "id " << aruco[i].id_ << " corner " << j;
+      }
+    }
+  }
+
+  TEST(MarkerDecoderTest, MatchesArucoAtAllRotations)
+  {
+    std::vector<int> ids{0, 17, 123, 249};
+    expect_same_detections(draw_rotated_markers(ids), 4 * ids.size());
+  }
+
+  TEST(MarkerDecoderTest, MatchesArucoWhenBlurred)
+  {
+    std::vector<int> ids{3, 42, 200};
+    cv::Mat blurred;
+    cv::GaussianBlur(draw_rotated_markers(ids), blurred, cv::Size{5, 5}, 1.0);
+    expect_same_detections(blurred, 4 * ids.size());
+  }
+
+  // Two markers with one id are two detections. Only decodes of one marker are merged.
+  TEST(MarkerDecoderTest, KeepsTwoCopiesOfOneId)
+  {
+    auto detections = detect_in_tree(draw_rotated_markers({42}));
+    ASSERT_EQ(detections.size(), 4u);
+    for (auto &detection : detections) {
+      EXPECT_EQ(detection.id_, 42);
+    }
+  }
+}
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fiducial_math.hpp"
+#include "map.hpp"
+#include "observation.hpp"
+#include "sam_util.hpp"
+#include "transform_with_covariance.hpp"
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "yaml-cpp/yaml.h"
+
+#include <gtsam/geometry/Pose3.h>
+
+// gtest before 1.10 only has the old name.
+#ifndef INSTANTIATE_TEST_SUITE_P
+#define INSTANTIATE_TEST_SUITE_P INSTANTIATE_TEST_CASE_P
+#endif
+
+// Run both solvers over deterministic synthetic trajectories and compare the pose accuracy,
+// the covariance consistency (NEES) and the per-frame solve time against the budgets in
+// solver_regression_budgets.yaml. The measured values are recorded as test properties, so
+// --gtest_output=xml:<file> keeps them.
+//
+// Environment:
+//  FIDUCIAL_VLAM_SOLVER_BUDGETS         budgets file to use instead of the one in the source tree
+//  FIDUCIAL_VLAM_LATENCY_BUDGET_SCALE   multiply the latency budgets, for slow or loaded machines
+
+namespace fiducial_vlam
+{
+// ==============================================================================
+// Scenario
+// ==============================================================================
+
+  enum class CameraModel
+  {
+    pinhole = 0,
+    plumb_bob,
+  };
+
+  enum class Trajectory
+  {
+    orbit = 0,    // an arc in front of the markers at a constant range
+    approach,     // a straight line from far away to close up
+  };
+
+  struct SolverCase
+  {
+    bool sam_not_cv_;
+    CameraModel camera_model_;
+    Trajectory trajectory_;
+
+    std::string name() const
+    {
+      return std::string{sam_not_cv_ ? "sam" : "cv"} +
+             (camera_model_ == CameraModel::pinhole ? "_pinhole" : "_plumb_bob") +
+             (trajectory_ == Trajectory::orbit ? "_orbit" : "_approach");
+    }
+  };
+
+  constexpr double pi = 3.14159265358979323846;
+  constexpr double marker_length = 0.1778;
+  constexpr double corner_sigma = 0.5;
+  constexpr int image_width = 960;
+  constexpr int image_height = 720;
+  constexpr int frame_count = 120;
+  constexpr std::uint32_t noise_seed = 20191207;
+
+  static sensor_msgs::msg::CameraInfo make_camera_info(CameraModel camera_model)
+  {
+    sensor_msgs::msg::CameraInfo msg{};
+    msg.width = image_width;
+    msg.height = image_height;
+    msg.distortion_model = "plumb_bob";
+    msg.k = {600., 0., 480.,
+             0., 600., 360.,
+             0., 0., 1.};
+    msg.p = {600., 0., 480., 0.,
+             0., 600., 360., 0.,
+             0., 0., 1., 0.};
+    msg.d = camera_model == CameraModel::pinhole ?
+            std::vector<double>{0., 0., 0., 0., 0.} :
+            std::vector<double>{-0.25, 0.08, 0.001, -0.0005, 0.};
+    return msg;
+  }
+
+  // Six fixed markers roughly on a wall at z = 0, facing +z. They are offset and turned a
+  // little so the solves are not all against one plane.
+  static Map make_map()
+  {
+    Map map{Map::MapStyles::pose, marker_length};
+    int id = 1;
+    for (int row = 0; row < 2; row += 1) {
+      for (int col = 0; col < 3; col += 1) {
+        tf2::Quaternion q;
+        q.setRPY(0.1 * (row - 0.5), 0.15 * (col - 1), 0.05 * col);
+        tf2::Vector3 t{0.4 * (col - 1), 0.5 * (row - 0.5), 0.04 * ((row + col) % 2)};
+        Marker marker{id, TransformWithCovariance{tf2::Transform{q, t}}};
+        marker.set_is_fixed(true);
+        map.add_marker(marker);
+        id += 1;
+      }
+    }
+    return map;
+  }
+
+  // A camera at position looking at target. The image is upright when up is the map +y.
+  static tf2::Transform look_at(const tf2::Vector3 &position, const tf2::Vector3 &target)
+  {
+    tf2::Vector3 up{0., 1., 0.};
+    auto z = (target - position).normalized();
+    auto x = z.cross(up).normalized();
+    auto y = z.cross(x);
+    tf2::Matrix3x3 r{x.x(), y.x(), z.x(),
+                     x.y(), y.y(), z.y(),
+                     x.z(), y.z(), z.z()};
+    return tf2::Transform{r, position};
+  }
+
+  static std::vector<tf2::Transform> make_trajectory(Trajectory trajectory)
+  {
+    std::vector<tf2::Transform> t_map_cameras{};
+    for (int i = 0; i < frame_count; i += 1) {
+      double s = static_cast<double>(i) / (frame_count - 1);
+      if (trajectory == Trajectory::orbit) {
+        double a = -0.5 + s;
+        t_map_cameras.emplace_back(look_at(tf2::Vector3{1.6 * std::sin(a), 0.15 * std::sin(3. * a), 1.6 * std::cos(a)},
+                                           tf2::Vector3{0.05 * std::sin(2. * a), 0., 0.}));
+      } else {
+        t_map_cameras.emplace_back(look_at(tf2::Vector3{0.2 - 0.1 * s, -0.1 + 0.15 * s, 3.0 - 2.1 * s},
+                                           tf2::Vector3{0.02, 0., 0.}));
+      }
+    }
+    return t_map_cameras;
+  }
+
+  // Gaussian noise from a Box-Muller transform of xorshift32. The standard library
+  // distributions are not the same everywhere, and the noise has to be.
+  class Noise
+  {
+    std::uint32_t state_;
+    bool have_spare_{false};
+    double spare_{0.};
+
+    double uniform()
+    {
+      state_ ^= state_ << 13;
+      state_ ^= state_ >> 17;
+      state_ ^= state_ << 5;
+      return (state_ + 0.5) / 4294967296.;
+    }
+
+  public:
+    explicit Noise(std::uint32_t seed) :
+      state_{seed}
+    {}
+
+    double gaussian(double sigma)
+    {
+      if (have_spare_) {
+        have_spare_ = false;
+        return spare_ * sigma;
+      }
+      auto r = std::sqrt(-2. * std::log(uniform()));
+      auto theta = 2. * pi * uniform();
+      spare_ = r * std::sin(theta);
+      have_spare_ = true;
+      return r * std::cos(theta) * sigma;
+    }
+  };
+
+  // Project the corners of every marker that is fully in view and add corner noise.
+  static Observations make_observations(const tf2::Transform &t_map_camera,
+                                        Map &map,
+                                        const sensor_msgs::msg::CameraInfo &camera_info_msg,
+                                        Noise &noise)
+  {
+    cv::Matx33d camera_matrix{camera_info_msg.k[0], camera_info_msg.k[1], camera_info_msg.k[2],
+                              camera_info_msg.k[3], camera_info_msg.k[4], camera_info_msg.k[5],
+                              camera_info_msg.k[6], camera_info_msg.k[7], camera_info_msg.k[8]};
+    std::vector<double> dist_coeffs(camera_info_msg.d);
+
+    auto t_camera_map = t_map_camera.inverse();
+    auto q = t_camera_map.getRotation();
+    auto axis = q.getAxis() * q.getAngle();
+    auto &t = t_camera_map.getOrigin();
+    cv::Vec3d rvec{axis.x(), axis.y(), axis.z()};
+    cv::Vec3d tvec{t.x(), t.y(), t.z()};
+
+    Observations observations{};
+    for (auto &marker_pair : map.markers()) {
+      auto &t_map_marker = marker_pair.second.t_map_marker().transform();
+      std::vector<cv::Point3d> corners_f_map{};
+      bool in_front = true;
+      for (auto corner : {tf2::Vector3{-marker_length / 2, marker_length / 2, 0.},
+                          tf2::Vector3{marker_length / 2, marker_length / 2, 0.},
+                          tf2::Vector3{marker_length / 2, -marker_length / 2, 0.},
+                          tf2::Vector3{-marker_length / 2, -marker_length / 2, 0.}}) {
+        auto corner_f_map = t_map_marker * corner;
+        in_front = in_front && (t_camera_map * corner_f_map).z() > 0.1;
+        corners_f_map.emplace_back(corner_f_map.x(), corner_f_map.y(), corner_f_map.z());
+      }
+      if (!in_front) {
+        continue;
+      }
+
+      std::vector<cv::Point2d> corners_f_image{};
+      cv::projectPoints(corners_f_map, rvec, tvec, camera_matrix, dist_coeffs, corners_f_image);
+      bool in_view = std::all_of(corners_f_image.begin(), corners_f_image.end(), [](const cv::Point2d &p)
+      { return p.x > 5. && p.x < image_width - 5. && p.y > 5. && p.y < image_height - 5.; });
+      if (!in_view) {
+        continue;
+      }
+
+      for (auto &p : corners_f_image) {
+        p.x += noise.gaussian(corner_sigma);
+        p.y += noise.gaussian(corner_sigma);
+      }
+      observations.add(Observation{marker_pair.first,
+                                   corners_f_image[0].x, corners_f_image[0].y,
+                                   corners_f_image[1].x, corners_f_image[1].y,
+                                   corners_f_image[2].x, corners_f_image[2].y,
+                                   corners_f_image[3].x, corners_f_image[3].y});
+    }
+    return observations;
+  }
+
+// ==============================================================================
+// Metrics
+// ==============================================================================
+
+  // The normalized estimation error squared of a pose estimate.
+  static double nees(const TransformWithCovariance &estimate, const tf2::Transform &truth)
+  {
+    gtsam::Vector6 error = gtsam::Pose3::Logmap(to_pose3(estimate.transform()).between(to_pose3(truth)));
+    return error.dot(to_cov_sam(estimate.cov()).ldlt().solve(error));
+  }
+
+  struct SolverResults
+  {
+    int frames_{0};
+    int invalid_frames_{0};
+    double position_rmse_m_{0.};
+    double rotation_rmse_rad_{0.};
+    double mean_nees_{0.};
+    double mean_latency_ms_{0.};
+    double p95_latency_ms_{0.};
+  };
+
+  static SolverResults run_case(const SolverCase &solver_case)
+  {
+    auto camera_info_msg = make_camera_info(solver_case.camera_model_);
+    auto map = make_map();
+    FiducialMath fm{solver_case.sam_not_cv_, corner_sigma, camera_info_msg};
+    Noise noise{noise_seed};
+
+    SolverResults results{};
+    double position_sum{0.}, rotation_sum{0.}, nees_sum{0.};
+    std::vector<double> latencies_ms{};
+
+    for (auto &t_map_camera_truth : make_trajectory(solver_case.trajectory_)) {
+      auto observations = make_observations(t_map_camera_truth, map, camera_info_msg, noise);
+      results.frames_ += 1;
+
+      auto start = std::chrono::steady_clock::now();
+      auto t_map_camera = fm.solve_t_map_camera(observations, map);
+      auto stop = std::chrono::steady_clock::now();
+      latencies_ms.emplace_back(std::chrono::duration<double, std::milli>(stop - start).count());
+
+      if (observations.size() == 0 || !t_map_camera.is_valid()) {
+        results.invalid_frames_ += 1;
+        continue;
+      }
+
+      position_sum += (t_map_camera.transform().getOrigin() - t_map_camera_truth.getOrigin()).length2();
+      auto angle = t_map_camera.transform().getRotation().angleShortestPath(t_map_camera_truth.getRotation());
+      rotation_sum += angle * angle;
+      if (solver_case.sam_not_cv_) {
+        nees_sum += nees(t_map_camera, t_map_camera_truth);
+      }
+    }
+
+    auto valid_frames = std::max(1, results.frames_ - results.invalid_frames_);
+    results.position_rmse_m_ = std::sqrt(position_sum / valid_frames);
+    results.rotation_rmse_rad_ = std::sqrt(rotation_sum / valid_frames);
+    results.mean_nees_ = nees_sum / valid_frames;
+
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    for (auto latency_ms : latencies_ms) {
+      results.mean_latency_ms_ += latency_ms / latencies_ms.size();
+    }
+    results.p95_latency_ms_ = latencies_ms[static_cast<std::size_t>(0.95 * (latencies_ms.size() - 1))];
+    return results;
+  }
+
+// ==============================================================================
+// Budgets
+// ==============================================================================
+
+  class Budgets
+  {
+    YAML::Node budgets_;
+    std::string name_;
+
+  public:
+    explicit Budgets(const std::string &name) :
+      name_{name}
+    {
+      auto filename = std::getenv("FIDUCIAL_VLAM_SOLVER_BUDGETS");
+      budgets_ = YAML::LoadFile(filename != nullptr ? filename :
+                                FIDUCIAL_VLAM_TEST_DIR "/solver_regression_budgets.yaml");
+    }
+
+    // The budget for this case, or the default budget if this case doesn't have one.
+    double operator()(const std::string &key) const
+    {
+      auto case_node = budgets_[name_];
+      if (case_node && case_node[key]) {
+        return case_node[key].as<double>();
+      }
+      auto default_node = budgets_["default"];
+      if (default_node && default_node[key]) {
+        return default_node[key].as<double>();
+      }
+      ADD_FAILURE() << "No budget for " << key;
+      return 0.;
+    }
+  };
+
+  static double latency_budget_scale()
+  {
+    auto scale = std::getenv("FIDUCIAL_VLAM_LATENCY_BUDGET_SCALE");
+    return scale != nullptr ? std::atof(scale) : 1.0;
+  }
+
+// ==============================================================================
+// Tests
+// ==============================================================================
+
+  class SolverRegressionTest : public ::testing::TestWithParam<SolverCase>
+  {
+  };
+
+  TEST_P(SolverRegressionTest, AccuracyAndLatencyWithinBudgets)
+  {
+    auto &solver_case = GetParam();
+    Budgets budgets{solver_case.name()};
+    auto results = run_case(solver_case);
+
+    RecordProperty("invalid_frames", results.invalid_frames_);
+    RecordProperty("position_rmse_m", std::to_string(results.position_rmse_m_));
+    RecordProperty("rotation_rmse_rad", std::to_string(results.rotation_rmse_rad_));
+    RecordProperty("mean_nees", std::to_string(results.mean_nees_));
+    RecordProperty("mean_latency_ms", std::to_string(results.mean_latency_ms_));
+    RecordProperty("p95_latency_ms", std::to_string(results.p95_latency_ms_));
+
+    EXPECT_LE(results.invalid_frames_, budgets("max_invalid_frames"));
+    EXPECT_LE(results.position_rmse_m_, budgets("max_position_rmse_m"));
+    EXPECT_LE(results.rotation_rmse_rad_, budgets("max_rotation_rmse_rad"));
+    EXPECT_LE(results.p95_latency_ms_, budgets("max_p95_latency_ms") * latency_budget_scale());
+
+    // The OpenCV solver doesn't estimate a covariance.
+    if (solver_case.sam_not_cv_) {
+      EXPECT_GE(results.mean_nees_, budgets("min_mean_nees"));
+      EXPECT_LE(results.mean_nees_, budgets("max_mean_nees"));
+    }
+  }
+
+  static std::vector<SolverCase> all_cases()
+  {
+    std::vector<SolverCase> cases{};
+    for (auto sam_not_cv : {true, false}) {
+      for (auto camera_model : {CameraModel::pinhole, CameraModel::plumb_bob}) {
+        for (auto trajectory : {Trajectory::orbit, Trajectory::approach}) {
+          cases.emplace_back(SolverCase{sam_not_cv, camera_model, trajectory});
+        }
+      }
+    }
+    return cases;
+  }
+
+  INSTANTIATE_TEST_SUITE_P(
+    AllSolvers, SolverRegressionTest,
+    ::testing::ValuesIn(all_cases()),
+    [](const ::testing::TestParamInfo<SolverCase> &info)
+    { return info.param.name(); });
+}